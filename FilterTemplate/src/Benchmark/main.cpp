@@ -0,0 +1,607 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "frame_processor.hpp"
+#include "half_pixel.hpp"
+#include "y4m.hpp"
+
+// Every allocation of the process goes through here, so allocations per frame
+// can be counted around FrameProcessor::Process.
+static std::atomic<unsigned long> allocation_count{ 0 };
+
+void* operator new(size_t size) {
+	++allocation_count;
+
+	if (auto p = malloc(size ? size : 1))
+		return p;
+
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+	free(p);
+}
+
+void operator delete[](void* p) noexcept {
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+	free(p);
+}
+
+static const char usage[] =
+	"Usage: de_bench [options] [clip.y4m ...]\n"
+	"\n"
+	"Runs motion and depth estimation over a corpus and reports per-stage timings\n"
+	"and quality for every quality level. Without clips, synthetic clips are generated.\n"
+	"\n"
+	"  --size WxH           size of the synthetic clips (default 640x360)\n"
+	"  --frames N           frames per clip (default 30)\n"
+	"  --qualities A,B,...  quality levels (default 20,40,60,80,100)\n"
+	"  --threads N          motion estimation threads (default 1)\n"
+	"  --pipeline           run the stages pipelined\n"
+	"  --half-pixel         use half-pixel precision\n"
+	"  --search S           motion search: arps (default), hierarchical or predictive\n"
+	"  --termination T      early termination: fixed (default), adaptive or calibrated\n"
+	"  --refinement R       depth refinement: bilateral (default) or guided\n"
+	"  --guided-radius N    window radius of the guided filter (default 8)\n"
+	"  --median N           frames of the temporal median: 3, 5 (default), 7 or 9\n"
+	"  --csv FILE           also write the results to FILE\n"
+	"  --baseline FILE      compare with results written by --csv before, exit with 1\n"
+	"                       on a regression\n"
+	"  --tolerance P        allowed slowdown against the baseline, percent (default 15)\n"
+	"  --self-test          check the half-pixel interpolation against a scalar reference\n"
+	"                       and exit, with 1 on a mismatch\n";
+
+/// A clip kept in memory, so that reading it is not part of the measurement
+struct Clip {
+	std::string name;
+	VideoFormat format;
+	std::vector<PlanarFrame> frames;
+};
+
+/// Results of one clip at one quality level
+struct Result {
+	std::string clip;
+	int quality = 0;
+	double input_ns = 0.0;
+	double me_ns = 0.0;
+	double de_ns = 0.0;
+	double output_ns = 0.0;
+	double total_ns = 0.0;
+	double fps = 0.0;
+	double allocations = 0.0;
+	double y_psnr = 0.0;
+	double stability = 0.0;
+
+	std::string Key() const { return clip + "@" + std::to_string(quality); }
+};
+
+static uint8_t Texture(double x, double y) {
+	const auto v = 128 + 60 * sin(x * 0.21) * cos(y * 0.17) + 40 * sin((x + y) * 0.05)
+		+ ((static_cast<int>(std::floor(x)) * 7 + static_cast<int>(std::floor(y)) * 13) & 15);
+	return static_cast<uint8_t>(std::min(std::max(v, 0.0), 255.0));
+}
+
+/**
+ * Synthetic clips with known motion:
+ *  - pan: the whole frame moves 2 pixels right and 1 down per frame
+ *  - split: the top half moves right, the bottom half left, at different speeds
+ *  - object: a textured square moves over a still background
+ */
+static Clip GenerateClip(const std::string& name, int width, int height, int num_frames) {
+	Clip clip;
+	clip.name = name;
+	clip.format.width = width;
+	clip.format.height = height;
+	clip.format.chroma = ChromaFormat::C420;
+
+	const auto chroma_width = clip.format.ChromaWidth();
+	const auto chroma_height = clip.format.ChromaHeight();
+
+	for (int n = 0; n < num_frames; ++n) {
+		PlanarFrame frame;
+		frame.Y.resize(static_cast<size_t>(width) * height);
+		frame.Cb.resize(static_cast<size_t>(chroma_width) * chroma_height);
+		frame.Cr.resize(frame.Cb.size());
+
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width; ++x) {
+				double sx = x, sy = y;
+
+				if (name == "pan") {
+					sx -= 2.0 * n;
+					sy -= 1.0 * n;
+				} else if (name == "split") {
+					sx -= (y < height / 2 ? 3.0 : -1.0) * n;
+				} else {
+					const auto ox = width / 4 + 3 * n;
+					const auto oy = height / 4 + n;
+					if (x >= ox && x < ox + height / 3 && y >= oy && y < oy + height / 3) {
+						sx = 1000.0 + x - 3 * n;
+						sy = 1000.0 + y - n;
+					}
+				}
+
+				frame.Y[y * width + x] = Texture(sx, sy);
+			}
+		}
+
+		for (int y = 0; y < chroma_height; ++y) {
+			for (int x = 0; x < chroma_width; ++x) {
+				const auto luma = frame.Y[std::min(2 * y, height - 1) * width + std::min(2 * x, width - 1)];
+				frame.Cb[y * chroma_width + x] = static_cast<uint8_t>(96 + luma / 4);
+				frame.Cr[y * chroma_width + x] = static_cast<uint8_t>(160 - luma / 4);
+			}
+		}
+
+		clip.frames.push_back(std::move(frame));
+	}
+
+	return clip;
+}
+
+static bool LoadClip(const std::string& path, int max_frames, Clip& clip) {
+	auto file = fopen(path.c_str(), "rb");
+	if (!file) {
+		fprintf(stderr, "de_bench: cannot open %s\n", path.c_str());
+		return false;
+	}
+
+	FrameReader reader(file);
+	auto ok = reader.ReadHeader();
+
+	if (ok) {
+		clip.name = path.substr(path.find_last_of("/\\") + 1);
+		clip.format = reader.Format();
+
+		PlanarFrame frame;
+		while (static_cast<int>(clip.frames.size()) < max_frames && reader.ReadFrame(frame))
+			clip.frames.push_back(frame);
+
+		ok = reader.Error().empty() && clip.frames.size() >= 2;
+	}
+
+	if (!ok)
+		fprintf(stderr, "de_bench: %s: %s\n", path.c_str(), reader.Error().empty() ? "too few frames" : reader.Error().c_str());
+
+	fclose(file);
+	return ok;
+}
+
+static Result Run(const Clip& clip, int quality, const FilterTemplateConfig& base_config) {
+	auto config = base_config;
+	config.quality = static_cast<uint8_t>(quality);
+	config.output_type = OutputType::DEPTH;
+	config.measure_psnr = true;
+
+	const auto& format = clip.format;
+	const auto num_pixels = static_cast<size_t>(format.width) * format.height;
+
+	FrameProcessor processor(format.width, format.height, config);
+
+	const auto shift_x = format.ChromaWidth() < format.width ? 1 : 0;
+	const auto shift_y = format.ChromaHeight() < format.height ? 1 : 0;
+	const PlanarFrame* in = nullptr;
+
+	const FrameProcessor::InputFunc input = [&](uint8_t* p_Y, ptrdiff_t Y_pitch, int16_t* p_U, int16_t* p_V) {
+		for (int y = 0; y < format.height; ++y) {
+			memcpy(p_Y + y * Y_pitch, in->Y.data() + y * format.width, format.width);
+
+			for (int x = 0; x < format.width; ++x) {
+				const auto c = (y >> shift_y) * format.ChromaWidth() + (x >> shift_x);
+				*p_U++ = static_cast<int16_t>(in->Cb.empty() ? 0 : in->Cb[c] - 128);
+				*p_V++ = static_cast<int16_t>(in->Cr.empty() ? 0 : in->Cr[c] - 128);
+			}
+		}
+	};
+
+	// Depth stability: mean absolute change of the depth map between frames.
+	std::vector<uint8_t> prev_depth(num_pixels);
+	double total_change = 0.0;
+	unsigned depth_count = 0;
+
+	const FrameProcessor::OutputFunc output = [&](const OutputFrame* frame) {
+		if (!frame)
+			return;
+
+		unsigned long change = 0;
+
+		for (int y = 0; y < format.height; ++y) {
+			const auto row = frame->Y + y * frame->Y_pitch;
+			const auto prev_row = prev_depth.data() + y * format.width;
+
+			for (int x = 0; x < format.width; ++x)
+				change += abs(int{row[x]} - prev_row[x]);
+
+			memcpy(prev_depth.data() + y * format.width, row, format.width);
+		}
+
+		if (depth_count++ > 0)
+			total_change += static_cast<double>(change) / num_pixels;
+	};
+
+	// The first two frames allocate lazily created buffers, only count the rest.
+	unsigned long allocations = 0;
+	const auto start = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < clip.frames.size(); ++i) {
+		in = &clip.frames[i];
+
+		const auto before = allocation_count.load();
+		processor.Process(input, output);
+
+		if (i >= 2)
+			allocations += allocation_count.load() - before;
+	}
+
+	processor.Flush(output);
+
+	const auto end = std::chrono::steady_clock::now();
+	const auto& stats = processor.Stats();
+	const auto frames = static_cast<double>(stats.frame_count);
+	const auto to_ns_per_pixel = 1e6 / (frames * num_pixels);
+
+	Result result;
+	result.clip = clip.name;
+	result.quality = quality;
+	result.input_ns = stats.total_input * to_ns_per_pixel;
+	result.me_ns = stats.total_me * to_ns_per_pixel;
+	result.de_ns = stats.total_de * to_ns_per_pixel;
+	result.output_ns = stats.total_output * to_ns_per_pixel;
+	result.total_ns = std::chrono::duration<double, std::nano>(end - start).count() / (frames * num_pixels);
+	result.fps = frames / std::chrono::duration<double>(end - start).count();
+	result.allocations = clip.frames.size() > 2 ? static_cast<double>(allocations) / (clip.frames.size() - 2) : 0.0;
+	result.y_psnr = stats.psnr_count ? stats.total_y_psnr / stats.psnr_count : 0.0;
+	result.stability = depth_count > 1 ? total_change / (depth_count - 1) : 0.0;
+	return result;
+}
+
+static const char csv_header[] = "clip,quality,input_ns_px,me_ns_px,de_ns_px,output_ns_px,total_ns_px,fps,allocs_per_frame,y_psnr,depth_change";
+
+static void WriteCSV(std::ostream& out, const std::vector<Result>& results) {
+	out << csv_header << '\n';
+
+	for (const auto& r : results) {
+		out << r.clip << ',' << r.quality << ','
+			<< r.input_ns << ',' << r.me_ns << ',' << r.de_ns << ',' << r.output_ns << ',' << r.total_ns << ','
+			<< r.fps << ',' << r.allocations << ',' << r.y_psnr << ',' << r.stability << '\n';
+	}
+}
+
+static bool ReadCSV(const std::string& path, std::map<std::string, Result>& results) {
+	std::ifstream in(path);
+	std::string line;
+
+	if (!in || !std::getline(in, line) || line != csv_header) {
+		fprintf(stderr, "de_bench: %s is not a de_bench CSV file\n", path.c_str());
+		return false;
+	}
+
+	while (std::getline(in, line)) {
+		std::replace(line.begin(), line.end(), ',', ' ');
+		std::istringstream fields(line);
+
+		Result r;
+		if (fields >> r.clip >> r.quality >> r.input_ns >> r.me_ns >> r.de_ns >> r.output_ns >> r.total_ns
+			>> r.fps >> r.allocations >> r.y_psnr >> r.stability)
+			results[r.Key()] = r;
+	}
+
+	return true;
+}
+
+/// Compare with the baseline, report every regression, return true if there were none
+static bool CompareWithBaseline(const std::vector<Result>& results, const std::map<std::string, Result>& baseline, double tolerance) {
+	auto ok = true;
+
+	for (const auto& r : results) {
+		const auto it = baseline.find(r.Key());
+		if (it == baseline.end())
+			continue;
+
+		const auto& b = it->second;
+		const auto key = r.Key();
+
+		if (r.total_ns > b.total_ns * (1.0 + tolerance / 100.0)) {
+			printf("REGRESSION %s: %.2f ns/pixel, baseline %.2f\n", key.c_str(), r.total_ns, b.total_ns);
+			ok = false;
+		}
+
+		// Quality is deterministic, anything beyond rounding noise is a change in the algorithm.
+		if (r.y_psnr < b.y_psnr - 0.01) {
+			printf("REGRESSION %s: Y PSNR %.3f dB, baseline %.3f\n", key.c_str(), r.y_psnr, b.y_psnr);
+			ok = false;
+		}
+
+		if (r.stability > b.stability + 0.01) {
+			printf("REGRESSION %s: depth change %.3f per pixel, baseline %.3f\n", key.c_str(), r.stability, b.stability);
+			ok = false;
+		}
+
+		if (r.allocations > b.allocations + 0.5) {
+			printf("REGRESSION %s: %.1f allocations per frame, baseline %.1f\n", key.c_str(), r.allocations, b.allocations);
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+static uint8_t Narrow(int value, const uint8_t*) {
+	return static_cast<uint8_t>(std::min(std::max(value, 0), 255));
+}
+
+static int16_t Narrow(int value, const int16_t*) {
+	return static_cast<int16_t>(value);
+}
+
+/// Halfway between samples i and i + 1 of a line of n samples, step apart, as the former
+/// HalfpixelShift and HalfpixelShiftHorz computed it: averages next to the ends, the last
+/// sample kept, clamped for 8-bit planes and wrapped for 16-bit ones.
+template <typename T>
+static void ReferenceHalfpixelLine(const T* src, int n, int step, T* dst) {
+	for (int i = 0; i < n - 1; ++i) {
+		const int a = src[i * step], b = src[(i + 1) * step];
+		const auto value = i == 0 || i == n - 2
+			? (a + b) >> 1
+			: (5 * (a + b) - (src[(i - 1) * step] + src[(i + 2) * step])) >> 3;
+		dst[i * step] = Narrow(value, dst);
+	}
+
+	dst[(n - 1) * step] = src[(n - 1) * step];
+}
+
+/// Scalar reference of HalfpixelInterpolate, one direction at a time like the former shifts
+template <typename T>
+static void ReferenceHalfpixel(const T* src, int width, int height, T* up, T* left, T* upleft) {
+	for (int x = 0; x < width; ++x)
+		ReferenceHalfpixelLine(src + x, height, width, up + x);
+
+	for (int y = 0; y < height; ++y) {
+		ReferenceHalfpixelLine(src + y * width, width, 1, left + y * width);
+		ReferenceHalfpixelLine(up + y * width, width, 1, upleft + y * width);
+	}
+}
+
+/// Compare HalfpixelInterpolate with the reference on a random plane, report the first mismatch
+template <typename T>
+static bool CheckHalfpixel(std::mt19937& rng, int width, int height) {
+	const auto size = static_cast<size_t>(width) * height;
+	std::uniform_int_distribution<int> sample(std::numeric_limits<T>::min(), std::numeric_limits<T>::max());
+	std::vector<T> src(size), expected(3 * size), actual(3 * size);
+
+	for (auto& v : src)
+		v = static_cast<T>(sample(rng));
+
+	ReferenceHalfpixel(src.data(), width, height, &expected[0], &expected[size], &expected[2 * size]);
+	HalfpixelInterpolate(src.data(), width, height, &actual[0], &actual[size], &actual[2 * size]);
+
+	const char* names[] = { "up", "left", "upleft" };
+
+	for (size_t i = 0; i < expected.size(); ++i) {
+		if (expected[i] != actual[i]) {
+			fprintf(stderr, "de_bench: %d-bit %dx%d %s differs at (%d, %d): %d instead of %d\n",
+			        static_cast<int>(sizeof(T) * 8), width, height, names[i / size],
+			        static_cast<int>(i % size % width), static_cast<int>(i % size / width), actual[i], expected[i]);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/// Compare every tile of HalfpixelCache with the reference on a random 8-bit plane
+static bool CheckHalfpixelCache(std::mt19937& rng, int width, int height) {
+	const auto size = static_cast<size_t>(width) * height;
+	std::uniform_int_distribution<int> sample(0, 255);
+	std::vector<uint8_t> src(size), expected(3 * size);
+
+	for (auto& v : src)
+		v = static_cast<uint8_t>(sample(rng));
+
+	ReferenceHalfpixel(src.data(), width, height, &expected[0], &expected[size], &expected[2 * size]);
+
+	HalfpixelCache cache(width, height);
+	cache.Reset(src.data());
+
+	const ShiftDir dirs[] = { ShiftDir::UP, ShiftDir::LEFT, ShiftDir::UPLEFT };
+
+	for (int d = 0; d < 3; ++d) {
+		if (memcmp(cache.PrepareAll(dirs[d]), &expected[d * size], size) != 0) {
+			fprintf(stderr, "de_bench: cached %dx%d plane %d differs from the reference\n", width, height, d);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/// Random sizes, including the smallest ones and widths that are not a multiple of the vector size
+static bool SelfTest() {
+	std::mt19937 rng(12345);
+	std::uniform_int_distribution<int> side(4, 300);
+	constexpr int rounds = 200;
+
+	for (int round = 0; round < rounds; ++round) {
+		const auto width = round < 16 ? 4 + round % 4 : side(rng);
+		const auto height = round < 16 ? 4 + round / 4 : side(rng);
+
+		if (!CheckHalfpixel<uint8_t>(rng, width, height) || !CheckHalfpixel<int16_t>(rng, width, height)
+			|| !CheckHalfpixelCache(rng, width, height))
+			return false;
+	}
+
+	printf("Half-pixel interpolation matches the reference at %d plane sizes\n", rounds);
+	return true;
+}
+
+int main(int argc, char** argv) {
+	FilterTemplateConfig config;
+	int width = 640, height = 360, num_frames = 30;
+	std::vector<int> qualities = { 20, 40, 60, 80, 100 };
+	std::vector<std::string> paths;
+	std::string csv_path, baseline_path;
+	double tolerance = 15.0;
+
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+		const auto takes_value = arg == "--size" || arg == "--frames" || arg == "--qualities" || arg == "--threads"
+			|| arg == "--search" || arg == "--termination" || arg == "--refinement" || arg == "--guided-radius" || arg == "--median" || arg == "--csv" || arg == "--baseline" || arg == "--tolerance";
+
+		if (takes_value && !value) {
+			fprintf(stderr, "de_bench: %s needs a value\n", arg.c_str());
+			return 2;
+		}
+
+		if (arg == "-h" || arg == "--help") {
+			fputs(usage, stdout);
+			return 0;
+		} else if (arg == "--self-test") {
+			return SelfTest() ? 0 : 1;
+		} else if (arg == "--size") {
+			if (sscanf(value, "%dx%d", &width, &height) != 2 || width < 16 || height < 16) {
+				fprintf(stderr, "de_bench: bad size %s\n", value);
+				return 2;
+			}
+		} else if (arg == "--frames") {
+			num_frames = std::max(atoi(value), 3);
+		} else if (arg == "--qualities") {
+			qualities.clear();
+			std::istringstream list(value);
+			std::string q;
+			while (std::getline(list, q, ','))
+				qualities.push_back(std::min(std::max(atoi(q.c_str()), 0), 100));
+		} else if (arg == "--threads") {
+			config.num_threads = std::min(std::max(atoi(value), 0), 256);
+		} else if (arg == "--pipeline") {
+			config.pipeline = true;
+		} else if (arg == "--half-pixel") {
+			config.use_half_pixel = true;
+		} else if (arg == "--search") {
+			if (strcmp(value, "arps") == 0) {
+				config.search = MotionSearch::ARPS;
+			} else if (strcmp(value, "hierarchical") == 0) {
+				config.search = MotionSearch::HIERARCHICAL;
+			} else if (strcmp(value, "predictive") == 0) {
+				config.search = MotionSearch::PREDICTIVE;
+			} else {
+				fprintf(stderr, "de_bench: unknown search %s\n", value);
+				return 2;
+			}
+		} else if (arg == "--termination") {
+			if (strcmp(value, "fixed") == 0) {
+				config.termination = EarlyTermination::FIXED;
+			} else if (strcmp(value, "adaptive") == 0) {
+				config.termination = EarlyTermination::ADAPTIVE;
+			} else if (strcmp(value, "calibrated") == 0) {
+				config.termination = EarlyTermination::CALIBRATED;
+			} else {
+				fprintf(stderr, "de_bench: unknown termination %s\n", value);
+				return 2;
+			}
+		} else if (arg == "--refinement") {
+			if (strcmp(value, "bilateral") == 0) {
+				config.refinement = DepthRefinement::CROSS_BILATERAL;
+			} else if (strcmp(value, "guided") == 0) {
+				config.refinement = DepthRefinement::GUIDED;
+			} else {
+				fprintf(stderr, "de_bench: unknown refinement %s\n", value);
+				return 2;
+			}
+		} else if (arg == "--guided-radius") {
+			config.guided_radius = std::min(std::max(atoi(value), 1), 64);
+		} else if (arg == "--median") {
+			config.median_depth = std::min(std::max(atoi(value), MIN_MEDIAN_DEPTH), MAX_MEDIAN_DEPTH) | 1;
+		} else if (arg == "--csv") {
+			csv_path = value;
+		} else if (arg == "--baseline") {
+			baseline_path = value;
+		} else if (arg == "--tolerance") {
+			tolerance = atof(value);
+		} else if (arg[0] == '-') {
+			fprintf(stderr, "de_bench: unknown option %s\n", arg.c_str());
+			fputs(usage, stderr);
+			return 2;
+		} else {
+			paths.push_back(arg);
+			continue;
+		}
+
+		if (takes_value)
+			++i;
+	}
+
+	std::vector<Clip> clips;
+
+	if (paths.empty()) {
+		for (const auto name : { "pan", "split", "object" })
+			clips.push_back(GenerateClip(name, width, height, num_frames));
+	} else {
+		for (const auto& path : paths) {
+			Clip clip;
+			if (!LoadClip(path, num_frames, clip))
+				return 1;
+			clips.push_back(std::move(clip));
+		}
+	}
+
+	std::vector<Result> results;
+
+	printf("%-16s %4s %9s %9s %9s %9s %9s %8s %8s %8s %8s\n",
+	       "clip", "q", "in ns/px", "ME ns/px", "DE ns/px", "out ns/px", "all ns/px", "fps", "allocs", "Y PSNR", "d change");
+
+	for (const auto& clip : clips) {
+		for (const auto quality : qualities) {
+			const auto r = Run(clip, quality, config);
+			results.push_back(r);
+
+			printf("%-16s %4d %9.2f %9.2f %9.2f %9.2f %9.2f %8.1f %8.1f %8.3f %8.3f\n",
+			       r.clip.c_str(), r.quality, r.input_ns, r.me_ns, r.de_ns, r.output_ns, r.total_ns,
+			       r.fps, r.allocations, r.y_psnr, r.stability);
+			fflush(stdout);
+		}
+	}
+
+	if (!csv_path.empty()) {
+		std::ofstream csv(csv_path);
+		csv.precision(6);
+		WriteCSV(csv, results);
+	}
+
+	if (!baseline_path.empty()) {
+		std::map<std::string, Result> baseline;
+		if (!ReadCSV(baseline_path, baseline))
+			return 1;
+
+		if (!CompareWithBaseline(results, baseline, tolerance))
+			return 1;
+
+		printf("No regressions against %s\n", baseline_path.c_str());
+	}
+
+	return 0;
+}
@@ -0,0 +1,515 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "color_convert.hpp"
+#include "frame_processor.hpp"
+#include "y4m.hpp"
+
+static const char usage[] =
+	"Usage: depth_cli [options] [input]\n"
+	"\n"
+	"Estimates motion and depth of a video, reading YUV4MPEG2 or raw planar 8-bit\n"
+	"frames from input (default: stdin) and writing the output frames.\n"
+	"\n"
+	"Input:\n"
+	"  --raw WxH            input is raw planar frames of the given size\n"
+	"  --raw-format F       chroma of raw input: 420 (default), 422, 444 or mono\n"
+	"  --fps N[:D]          frame rate written to the output header for raw input\n"
+	"  --frames N           stop after N frames\n"
+	"\n"
+	"Output:\n"
+	"  -o, --output FILE    output file, - for stdout (default)\n"
+	"  --format F           y4m (default) or pgm; pgm writes the Y plane only, to one\n"
+	"                       file per frame if FILE is a printf pattern such as depth_%05d.pgm\n"
+	"  --stats              print timings and PSNR averages to stderr at the end\n"
+	"\n"
+	"Options of the filter (see Test/README.txt):\n"
+	"  --output-type T      source, residual-before, residual-after, compensated or\n"
+	"                       depth (default), or their numbers 0-4\n"
+	"  --show-vectors       draw motion vectors over the output\n"
+	"  --draw-nothing       do not write any output\n"
+	"  --psnr               measure ME PSNR\n"
+	"  --psnr-log FILE      measure ME PSNR and log it for every frame to FILE\n"
+	"  --psnr-csv FILE      measure ME PSNR and write it for every frame to FILE as CSV\n"
+	"  --ssim               measure ME PSNR and the SSIM of the compensated luma\n"
+	"  --quality Q          algorithm quality, 0-100 (default 100)\n"
+	"  --half-pixel         use half-pixel precision\n"
+	"  --search S           motion search: arps (default), hierarchical or predictive, or 0-2\n"
+	"  --termination T      early termination of arps and hierarchical: fixed (default),\n"
+	"                       adaptive or calibrated, or 0-2\n"
+	"  --threads N          motion estimation threads, 0 for one per core (default 1)\n"
+	"  --pipeline           run conversion, ME and DE of consecutive frames at the same time\n"
+	"  --refinement R       depth refinement: bilateral (default) or guided, or 0-1\n"
+	"  --guided-radius N    window radius of the guided filter, 1-64 (default 8)\n"
+	"  --median N           frames of the temporal median: 3, 5 (default), 7 or 9\n";
+
+enum class OutputFormat {
+	Y4M,
+	PGM
+};
+
+struct Options {
+	FilterTemplateConfig config;
+
+	std::string input = "-";
+	std::string output = "-";
+	std::string psnr_log;
+	std::string psnr_csv;
+	OutputFormat format = OutputFormat::Y4M;
+	bool raw = false;
+	VideoFormat raw_format;
+	long max_frames = -1;
+	bool print_stats = false;
+};
+
+static bool ParseOutputType(const char* value, OutputType& type) {
+	static const char* const names[] = { "source", "residual-before", "residual-after", "compensated", "depth" };
+
+	for (int i = 0; i < 5; ++i) {
+		if (strcmp(value, names[i]) == 0 || (value[0] == '0' + i && value[1] == '\0')) {
+			type = static_cast<OutputType>(i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool ParseRefinement(const char* value, DepthRefinement& refinement) {
+	static const char* const names[] = { "bilateral", "guided" };
+
+	for (int i = 0; i < 2; ++i) {
+		if (strcmp(value, names[i]) == 0 || (value[0] == '0' + i && value[1] == '\0')) {
+			refinement = static_cast<DepthRefinement>(i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool ParseSearch(const char* value, MotionSearch& search) {
+	static const char* const names[] = { "arps", "hierarchical", "predictive" };
+
+	for (int i = 0; i < 3; ++i) {
+		if (strcmp(value, names[i]) == 0 || (value[0] == '0' + i && value[1] == '\0')) {
+			search = static_cast<MotionSearch>(i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool ParseTermination(const char* value, EarlyTermination& termination) {
+	static const char* const names[] = { "fixed", "adaptive", "calibrated" };
+
+	for (int i = 0; i < 3; ++i) {
+		if (strcmp(value, names[i]) == 0 || (value[0] == '0' + i && value[1] == '\0')) {
+			termination = static_cast<EarlyTermination>(i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool ParseOptions(int argc, char** argv, Options& options) {
+	bool have_input = false;
+
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		const auto has_value = i + 1 < argc;
+		const char* value = has_value ? argv[i + 1] : "";
+
+		auto need_value = [&]() {
+			if (!has_value) {
+				fprintf(stderr, "depth_cli: %s needs a value\n", arg.c_str());
+				return false;
+			}
+
+			++i;
+			return true;
+		};
+
+		if (arg == "-h" || arg == "--help") {
+			fputs(usage, stdout);
+			exit(0);
+		} else if (arg == "-o" || arg == "--output") {
+			if (!need_value())
+				return false;
+			options.output = value;
+		} else if (arg == "--format") {
+			if (!need_value())
+				return false;
+			if (strcmp(value, "y4m") == 0)
+				options.format = OutputFormat::Y4M;
+			else if (strcmp(value, "pgm") == 0)
+				options.format = OutputFormat::PGM;
+			else {
+				fprintf(stderr, "depth_cli: unknown output format %s\n", value);
+				return false;
+			}
+		} else if (arg == "--raw") {
+			if (!need_value())
+				return false;
+			if (sscanf(value, "%dx%d", &options.raw_format.width, &options.raw_format.height) != 2
+				|| options.raw_format.width <= 0 || options.raw_format.height <= 0) {
+				fprintf(stderr, "depth_cli: bad frame size %s, expected WxH\n", value);
+				return false;
+			}
+			options.raw = true;
+		} else if (arg == "--raw-format") {
+			if (!need_value())
+				return false;
+			if (strcmp(value, "420") == 0)
+				options.raw_format.chroma = ChromaFormat::C420;
+			else if (strcmp(value, "422") == 0)
+				options.raw_format.chroma = ChromaFormat::C422;
+			else if (strcmp(value, "444") == 0)
+				options.raw_format.chroma = ChromaFormat::C444;
+			else if (strcmp(value, "mono") == 0)
+				options.raw_format.chroma = ChromaFormat::MONO;
+			else {
+				fprintf(stderr, "depth_cli: unknown raw format %s\n", value);
+				return false;
+			}
+		} else if (arg == "--fps") {
+			if (!need_value())
+				return false;
+			options.raw_format.fps_den = 1;
+			if (sscanf(value, "%d:%d", &options.raw_format.fps_num, &options.raw_format.fps_den) < 1
+				|| options.raw_format.fps_num <= 0 || options.raw_format.fps_den <= 0) {
+				fprintf(stderr, "depth_cli: bad frame rate %s\n", value);
+				return false;
+			}
+		} else if (arg == "--frames") {
+			if (!need_value())
+				return false;
+			options.max_frames = atol(value);
+		} else if (arg == "--stats") {
+			options.print_stats = true;
+		} else if (arg == "--output-type") {
+			if (!need_value())
+				return false;
+			if (!ParseOutputType(value, options.config.output_type)) {
+				fprintf(stderr, "depth_cli: unknown output type %s\n", value);
+				return false;
+			}
+		} else if (arg == "--show-vectors") {
+			options.config.show_vectors = true;
+		} else if (arg == "--draw-nothing") {
+			options.config.draw_nothing = true;
+		} else if (arg == "--psnr") {
+			options.config.measure_psnr = true;
+		} else if (arg == "--psnr-log") {
+			if (!need_value())
+				return false;
+			options.config.measure_psnr = true;
+			options.psnr_log = value;
+		} else if (arg == "--psnr-csv") {
+			if (!need_value())
+				return false;
+			options.config.measure_psnr = true;
+			options.psnr_csv = value;
+		} else if (arg == "--ssim") {
+			options.config.measure_psnr = true;
+			options.config.measure_ssim = true;
+		} else if (arg == "--quality") {
+			if (!need_value())
+				return false;
+			options.config.quality = static_cast<uint8_t>(std::min(std::max(atoi(value), 0), 100));
+		} else if (arg == "--half-pixel") {
+			options.config.use_half_pixel = true;
+		} else if (arg == "--search") {
+			if (!need_value())
+				return false;
+			if (!ParseSearch(value, options.config.search)) {
+				fprintf(stderr, "depth_cli: unknown search %s\n", value);
+				return false;
+			}
+		} else if (arg == "--termination") {
+			if (!need_value())
+				return false;
+			if (!ParseTermination(value, options.config.termination)) {
+				fprintf(stderr, "depth_cli: unknown termination %s\n", value);
+				return false;
+			}
+		} else if (arg == "--threads") {
+			if (!need_value())
+				return false;
+			options.config.num_threads = std::min(std::max(atoi(value), 0), 256);
+		} else if (arg == "--pipeline") {
+			options.config.pipeline = true;
+		} else if (arg == "--refinement") {
+			if (!need_value())
+				return false;
+			if (!ParseRefinement(value, options.config.refinement)) {
+				fprintf(stderr, "depth_cli: unknown refinement %s\n", value);
+				return false;
+			}
+		} else if (arg == "--guided-radius") {
+			if (!need_value())
+				return false;
+			options.config.guided_radius = std::min(std::max(atoi(value), 1), 64);
+		} else if (arg == "--median") {
+			if (!need_value())
+				return false;
+			options.config.median_depth = std::min(std::max(atoi(value), MIN_MEDIAN_DEPTH), MAX_MEDIAN_DEPTH) | 1;
+		} else if (arg[0] == '-' && arg != "-") {
+			fprintf(stderr, "depth_cli: unknown option %s\n", arg.c_str());
+			return false;
+		} else if (!have_input) {
+			options.input = arg;
+			have_input = true;
+		} else {
+			fprintf(stderr, "depth_cli: more than one input given\n");
+			return false;
+		}
+	}
+
+	// The pattern is handed to snprintf, so nothing but one frame number conversion may be in it.
+	if (options.format == OutputFormat::PGM && options.output.find('%') != std::string::npos
+		&& !PGMWriter::IsValidPattern(options.output)) {
+		fprintf(stderr, "depth_cli: bad file name pattern %s, expected one %%d, %%u or %%05d style conversion\n", options.output.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+/// Fill in the planes of the estimators from 8-bit YCbCr, chroma is upsampled to full size
+static void ConvertInput(const PlanarFrame& in, const VideoFormat& format, uint8_t* p_Y, ptrdiff_t Y_pitch, int16_t* p_U, int16_t* p_V) {
+	for (int y = 0; y < format.height; ++y)
+		memcpy(p_Y + y * Y_pitch, in.Y.data() + y * format.width, format.width);
+
+	const auto size = static_cast<size_t>(format.width) * format.height;
+
+	if (format.chroma == ChromaFormat::MONO) {
+		std::fill(p_U, p_U + size, int16_t{0});
+		std::fill(p_V, p_V + size, int16_t{0});
+		return;
+	}
+
+	const auto shift_x = format.ChromaWidth() < format.width ? 1 : 0;
+	const auto shift_y = format.ChromaHeight() < format.height ? 1 : 0;
+	const auto chroma_width = format.ChromaWidth();
+
+	ExpandChroma(in.Cb.data(), chroma_width, shift_x, shift_y, format.width, format.height, p_U);
+	ExpandChroma(in.Cr.data(), chroma_width, shift_x, shift_y, format.width, format.height, p_V);
+}
+
+/// Draw a vector over a greyscale plane, white over dark pixels and black over light ones
+static void DrawVector(std::vector<uint8_t>& plane, int width, int height, int x1, int y1, int x2, int y2) {
+	const auto steps = std::max(abs(x2 - x1), abs(y2 - y1));
+
+	for (int i = 0; i <= steps; ++i) {
+		const auto x = steps ? x1 + (x2 - x1) * i / steps : x1;
+		const auto y = steps ? y1 + (y2 - y1) * i / steps : y1;
+
+		if (x < 0 || x >= width || y < 0 || y >= height)
+			continue;
+
+		auto& pixel = plane[y * width + x];
+		pixel = (i == 0 || pixel < 128) ? 255 : 0;
+	}
+}
+
+/// Turn the output of the processor into 8-bit planes, chroma at full size
+static void ConvertOutput(const OutputFrame& frame, int width, int height, bool show_vectors, PlanarFrame& out) {
+	out.Y.resize(static_cast<size_t>(width) * height);
+
+	if (frame.subtract_Y) {
+		// Residual output: the amplified difference, the same as the filter draws.
+		out.Cb.resize(out.Y.size());
+		out.Cr.resize(out.Y.size());
+
+		for (int y = 0; y < height; ++y) {
+			const auto row = frame.Y + y * frame.Y_pitch;
+			const auto base_row = frame.subtract_Y + y * frame.subtract_Y_pitch;
+
+			for (int x = 0; x < width; ++x) {
+				const auto i = static_cast<size_t>(y) * width + x;
+				const auto u = static_cast<int16_t>((frame.U[i] - frame.subtract_U[i]) * 3);
+				const auto v = static_cast<int16_t>((frame.V[i] - frame.subtract_V[i]) * 3);
+
+				out.Y[i] = static_cast<uint8_t>(std::min(std::max(128 + (int{row[x]} - base_row[x]) * 3, 0), 255));
+				out.Cb[i] = static_cast<uint8_t>(std::min(std::max(u + 128, 0), 255));
+				out.Cr[i] = static_cast<uint8_t>(std::min(std::max(v + 128, 0), 255));
+			}
+		}
+	} else if (frame.U && frame.V) {
+		for (int y = 0; y < height; ++y)
+			memcpy(out.Y.data() + y * width, frame.Y + y * frame.Y_pitch, width);
+
+		out.Cb.resize(out.Y.size());
+		out.Cr.resize(out.Y.size());
+
+		for (size_t i = 0; i < out.Y.size(); ++i) {
+			out.Cb[i] = static_cast<uint8_t>(std::min(std::max(frame.U[i] + 128, 0), 255));
+			out.Cr[i] = static_cast<uint8_t>(std::min(std::max(frame.V[i] + 128, 0), 255));
+		}
+	} else {
+		for (int y = 0; y < height; ++y)
+			memcpy(out.Y.data() + y * width, frame.Y + y * frame.Y_pitch, width);
+
+		out.Cb.clear();
+		out.Cr.clear();
+	}
+
+	if (show_vectors) {
+		frame.vectors->ForEachLeaf([&](int x, int y, const MV& mv) {
+			DrawVector(out.Y, width, height, x, y, x + mv.x, y + mv.y);
+		});
+	}
+}
+
+int main(int argc, char** argv) {
+	Options options;
+
+	if (!ParseOptions(argc, argv, options)) {
+		fputs(usage, stderr);
+		return 2;
+	}
+
+	auto in = options.input == "-" ? stdin : fopen(options.input.c_str(), "rb");
+	if (!in) {
+		fprintf(stderr, "depth_cli: cannot open %s\n", options.input.c_str());
+		return 1;
+	}
+
+	FrameReader reader(in);
+
+	if (options.raw)
+		reader.SetRawFormat(options.raw_format);
+	else if (!reader.ReadHeader()) {
+		fprintf(stderr, "depth_cli: %s\n", reader.Error().c_str());
+		return 1;
+	}
+
+	const auto& format = reader.Format();
+	const auto& config = options.config;
+
+	// Depth maps are greyscale, everything else keeps its chroma at full size.
+	auto out_format = format;
+	out_format.chroma = config.output_type == OutputType::DEPTH ? ChromaFormat::MONO : ChromaFormat::C444;
+
+	const auto pgm_pattern = options.format == OutputFormat::PGM && options.output.find('%') != std::string::npos;
+
+	FILE* out = nullptr;
+	if (!config.draw_nothing && !pgm_pattern) {
+		out = options.output == "-" ? stdout : fopen(options.output.c_str(), "wb");
+		if (!out) {
+			fprintf(stderr, "depth_cli: cannot open %s\n", options.output.c_str());
+			return 1;
+		}
+	}
+
+	Y4MWriter y4m(out);
+	PGMWriter pgm(out, pgm_pattern ? options.output : std::string());
+
+	if (out && options.format == OutputFormat::Y4M && !y4m.WriteHeader(out_format)) {
+		fprintf(stderr, "depth_cli: cannot write the output\n");
+		return 1;
+	}
+
+	FrameProcessor processor(format.width, format.height, config);
+
+	std::ofstream psnr_file;
+	if (config.measure_psnr && !options.psnr_log.empty()) {
+		psnr_file.open(options.psnr_log);
+
+		if (psnr_file) {
+			psnr_file << (config.measure_ssim ? "#: YPSNR, UPSNR, VPSNR, YSSIM\n" : "#: YPSNR, UPSNR, VPSNR\n");
+			processor.SetPSNRLog(&psnr_file);
+		}
+	}
+
+	std::ofstream psnr_csv_file;
+	if (config.measure_psnr && !options.psnr_csv.empty()) {
+		psnr_csv_file.open(options.psnr_csv);
+
+		if (psnr_csv_file)
+			processor.SetPSNRCSV(&psnr_csv_file);
+	}
+
+	PlanarFrame in_frame, out_frame;
+	bool write_failed = false;
+
+	const auto input = [&](uint8_t* p_Y, ptrdiff_t Y_pitch, int16_t* p_U, int16_t* p_V) {
+		ConvertInput(in_frame, format, p_Y, Y_pitch, p_U, p_V);
+	};
+
+	const auto output = [&](const OutputFrame* frame) {
+		// Frames still filling up the pipeline are written by Flush() later.
+		if (!frame || write_failed)
+			return;
+
+		ConvertOutput(*frame, format.width, format.height, config.show_vectors, out_frame);
+
+		const auto ok = options.format == OutputFormat::Y4M
+			? y4m.WriteFrame(out_frame)
+			: pgm.WriteFrame(out_frame, format.width, format.height, frame->number);
+
+		if (!ok) {
+			fprintf(stderr, "depth_cli: cannot write frame %u\n", frame->number);
+			write_failed = true;
+		}
+	};
+
+	const auto start = std::chrono::steady_clock::now();
+
+	while ((options.max_frames < 0 || static_cast<long>(processor.Stats().frame_count) < options.max_frames)
+		&& !write_failed
+		&& reader.ReadFrame(in_frame)) {
+		processor.Process(input, output);
+	}
+
+	processor.Flush(output);
+
+	const auto end = std::chrono::steady_clock::now();
+
+	if (out && out != stdout)
+		fclose(out);
+	else if (out)
+		fflush(out);
+
+	if (in != stdin)
+		fclose(in);
+
+	if (!reader.Error().empty()) {
+		fprintf(stderr, "depth_cli: %s\n", reader.Error().c_str());
+		return 1;
+	}
+
+	if (write_failed)
+		return 1;
+
+	if (options.print_stats) {
+		const auto& stats = processor.Stats();
+		const auto frames = std::max(stats.frame_count, 1u);
+		const auto seconds = std::chrono::duration<double>(end - start).count();
+
+		fprintf(stderr, "Frame count: %u\n", stats.frame_count);
+		fprintf(stderr, "Average ME time (ms per frame): %.6f\n", stats.total_me / frames);
+		fprintf(stderr, "Average DE time (ms per frame): %.6f\n", stats.total_de / frames);
+		fprintf(stderr, "Frames per second: %.3f\n", stats.frame_count / std::max(seconds, 1e-9));
+
+		if (config.measure_psnr && stats.psnr_count > 0) {
+			fprintf(stderr, "Average ME Y PSNR: %.6f\n", stats.total_y_psnr / stats.psnr_count);
+			fprintf(stderr, "Average ME U PSNR: %.6f\n", stats.total_u_psnr / stats.psnr_count);
+			fprintf(stderr, "Average ME V PSNR: %.6f\n", stats.total_v_psnr / stats.psnr_count);
+
+			if (config.measure_ssim)
+				fprintf(stderr, "Average ME Y SSIM: %.6f\n", stats.total_y_ssim / stats.psnr_count);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,263 @@
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include "y4m.hpp"
+
+int VideoFormat::ChromaWidth() const {
+	switch (chroma) {
+	case ChromaFormat::C420:
+	case ChromaFormat::C422:
+		return (width + 1) / 2;
+
+	case ChromaFormat::C444:
+		return width;
+
+	default:
+		return 0;
+	}
+}
+
+int VideoFormat::ChromaHeight() const {
+	switch (chroma) {
+	case ChromaFormat::C420:
+		return (height + 1) / 2;
+
+	case ChromaFormat::C422:
+	case ChromaFormat::C444:
+		return height;
+
+	default:
+		return 0;
+	}
+}
+
+FrameReader::FrameReader(FILE* file)
+	: file(file)
+	, raw(false) {
+}
+
+bool FrameReader::ReadLine(std::string& line) {
+	line.clear();
+
+	int c;
+	while ((c = fgetc(file)) != EOF && c != '\n') {
+		// Stream headers are short, anything longer is not a header.
+		if (line.size() > 4096)
+			return false;
+
+		line.push_back(static_cast<char>(c));
+	}
+
+	return c != EOF || !line.empty();
+}
+
+bool FrameReader::ReadHeader() {
+	std::string line;
+
+	if (!ReadLine(line) || line.compare(0, 9, "YUV4MPEG2") != 0) {
+		error = "input is not a YUV4MPEG2 stream";
+		return false;
+	}
+
+	std::istringstream tokens(line.substr(9));
+	std::string token;
+
+	while (tokens >> token) {
+		const auto value = token.substr(1);
+
+		switch (token[0]) {
+		case 'W':
+			format.width = atoi(value.c_str());
+			break;
+
+		case 'H':
+			format.height = atoi(value.c_str());
+			break;
+
+		case 'F':
+			if (sscanf(value.c_str(), "%d:%d", &format.fps_num, &format.fps_den) != 2 || format.fps_den <= 0) {
+				format.fps_num = 25;
+				format.fps_den = 1;
+			}
+			break;
+
+		case 'C':
+			if (value == "420" || value == "420jpeg" || value == "420paldv" || value == "420mpeg2")
+				format.chroma = ChromaFormat::C420;
+			else if (value == "422")
+				format.chroma = ChromaFormat::C422;
+			else if (value == "444")
+				format.chroma = ChromaFormat::C444;
+			else if (value == "mono")
+				format.chroma = ChromaFormat::MONO;
+			else {
+				error = "unsupported YUV4MPEG2 colour space C" + value + ", only 8-bit 420, 422, 444 and mono are supported";
+				return false;
+			}
+			break;
+
+		default:
+			// Interlacing, aspect ratio and extensions do not matter here.
+			break;
+		}
+	}
+
+	if (format.width <= 0 || format.height <= 0) {
+		error = "YUV4MPEG2 header has no valid frame size";
+		return false;
+	}
+
+	raw = false;
+	return true;
+}
+
+void FrameReader::SetRawFormat(const VideoFormat& format) {
+	this->format = format;
+	raw = true;
+}
+
+size_t FrameReader::ReadPlane(std::vector<uint8_t>& plane, size_t size) {
+	plane.resize(size);
+
+	if (size == 0)
+		return 0;
+
+	return fread(plane.data(), 1, size, file);
+}
+
+bool FrameReader::ReadFrame(PlanarFrame& frame) {
+	if (!raw) {
+		std::string line;
+
+		if (!ReadLine(line))
+			return false;
+
+		if (line.compare(0, 5, "FRAME") != 0) {
+			error = "malformed YUV4MPEG2 frame header";
+			return false;
+		}
+	}
+
+	const auto luma_size = static_cast<size_t>(format.width) * format.height;
+	const auto chroma_size = static_cast<size_t>(format.ChromaWidth()) * format.ChromaHeight();
+
+	const auto read = ReadPlane(frame.Y, luma_size);
+
+	if (read != luma_size) {
+		// A raw stream ends where the next frame would start.
+		if (!raw || read != 0)
+			error = "truncated frame";
+
+		return false;
+	}
+
+	if (ReadPlane(frame.Cb, chroma_size) != chroma_size || ReadPlane(frame.Cr, chroma_size) != chroma_size) {
+		error = "truncated frame";
+		return false;
+	}
+
+	return true;
+}
+
+Y4MWriter::Y4MWriter(FILE* file)
+	: file(file) {
+}
+
+bool Y4MWriter::WriteHeader(const VideoFormat& format) {
+	const char* chroma;
+
+	switch (format.chroma) {
+	default:
+	case ChromaFormat::C420:
+		chroma = "420jpeg";
+		break;
+
+	case ChromaFormat::C422:
+		chroma = "422";
+		break;
+
+	case ChromaFormat::C444:
+		chroma = "444";
+		break;
+
+	case ChromaFormat::MONO:
+		chroma = "mono";
+		break;
+	}
+
+	return fprintf(file,
+	               "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C%s\n",
+	               format.width,
+	               format.height,
+	               format.fps_num,
+	               format.fps_den,
+	               chroma) > 0;
+}
+
+bool Y4MWriter::WriteFrame(const PlanarFrame& frame) {
+	if (fputs("FRAME\n", file) < 0)
+		return false;
+
+	for (const auto plane : { &frame.Y, &frame.Cb, &frame.Cr }) {
+		if (!plane->empty() && fwrite(plane->data(), 1, plane->size(), file) != plane->size())
+			return false;
+	}
+
+	return true;
+}
+
+PGMWriter::PGMWriter(FILE* file, const std::string& pattern)
+	: file(file)
+	, pattern(pattern) {
+}
+
+bool PGMWriter::IsValidPattern(const std::string& pattern) {
+	// The width is capped so that the name always fits the buffer of WriteFrame.
+	constexpr int max_width = 20;
+	int conversions = 0;
+
+	for (size_t i = 0; i < pattern.size(); ++i) {
+		if (pattern[i] != '%')
+			continue;
+
+		if (++i < pattern.size() && pattern[i] == '%')
+			continue;
+
+		if (i < pattern.size() && pattern[i] == '0')
+			++i;
+
+		int width = 0;
+		while (i < pattern.size() && isdigit(static_cast<unsigned char>(pattern[i])) && width <= max_width)
+			width = width * 10 + (pattern[i++] - '0');
+
+		if (i == pattern.size() || (pattern[i] != 'd' && pattern[i] != 'u') || width > max_width)
+			return false;
+
+		++conversions;
+	}
+
+	return conversions == 1;
+}
+
+bool PGMWriter::WriteFrame(const PlanarFrame& frame, int width, int height, unsigned number) {
+	auto out = file;
+
+	if (!pattern.empty()) {
+		std::vector<char> name(pattern.size() + 32);
+		snprintf(name.data(), name.size(), pattern.c_str(), number);
+
+		out = fopen(name.data(), "wb");
+		if (!out)
+			return false;
+	}
+
+	auto ok = fprintf(out, "P5\n%d %d\n255\n", width, height) > 0
+		&& fwrite(frame.Y.data(), 1, frame.Y.size(), out) == frame.Y.size();
+
+	if (out != file)
+		ok = fclose(out) == 0 && ok;
+
+	return ok;
+}
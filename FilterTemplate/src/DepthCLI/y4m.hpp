@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/// Chroma layout of 8-bit planar YCbCr frames
+enum class ChromaFormat {
+	C420,
+	C422,
+	C444,
+	MONO
+};
+
+struct VideoFormat {
+	int width = 0;
+	int height = 0;
+	ChromaFormat chroma = ChromaFormat::C420;
+	int fps_num = 25;
+	int fps_den = 1;
+
+	/// Width of the chroma planes
+	int ChromaWidth() const;
+
+	/// Height of the chroma planes
+	int ChromaHeight() const;
+};
+
+/// One frame of planar YCbCr, Cb and Cr are empty for MONO
+struct PlanarFrame {
+	std::vector<uint8_t> Y, Cb, Cr;
+};
+
+/// Reads YUV4MPEG2 streams or headerless planar frames
+class FrameReader {
+public:
+	/// Constructor, does not take ownership of the file
+	explicit FrameReader(FILE* file);
+
+	/// Read and parse the YUV4MPEG2 stream header
+	bool ReadHeader();
+
+	/// Read headerless frames of the given format instead
+	void SetRawFormat(const VideoFormat& format);
+
+	const VideoFormat& Format() const { return format; }
+
+	/// Read the next frame, false at the end of the input or on error
+	bool ReadFrame(PlanarFrame& frame);
+
+	/// Description of the last error, empty at a clean end of the input
+	const std::string& Error() const { return error; }
+
+private:
+	FILE* file;
+	VideoFormat format;
+	bool raw;
+	std::string error;
+
+	/// Read a header line without the newline
+	bool ReadLine(std::string& line);
+
+	/// Read a plane, returns the number of bytes read
+	size_t ReadPlane(std::vector<uint8_t>& plane, size_t size);
+};
+
+/// Writes frames as a YUV4MPEG2 stream
+class Y4MWriter {
+public:
+	/// Constructor, does not take ownership of the file
+	explicit Y4MWriter(FILE* file);
+
+	bool WriteHeader(const VideoFormat& format);
+	bool WriteFrame(const PlanarFrame& frame);
+
+private:
+	FILE* file;
+};
+
+/**
+ * Writes the Y plane of frames as binary PGM images.
+ * With a printf-style pattern ("depth_%05d.pgm") every frame goes to its own file,
+ * otherwise all frames are appended to one stream.
+ */
+class PGMWriter {
+public:
+	/// Constructor, file is used when pattern is empty, otherwise pattern must pass IsValidPattern
+	PGMWriter(FILE* file, const std::string& pattern);
+
+	/// Whether pattern has exactly one %d or %u conversion, optionally zero padded ("%05d"),
+	/// and no other conversions than the literal "%%"
+	static bool IsValidPattern(const std::string& pattern);
+
+	bool WriteFrame(const PlanarFrame& frame, int width, int height, unsigned number);
+
+private:
+	FILE* file;
+	std::string pattern;
+};
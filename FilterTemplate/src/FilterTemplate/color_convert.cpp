@@ -0,0 +1,524 @@
+#include <cstring>
+
+#include "color_convert.hpp"
+#include "cpu.hpp"
+
+#if defined(DE_ARCH_X86)
+#include <immintrin.h>
+#endif
+
+/// Fractional bits of the fixed point coefficients
+static constexpr int SHIFT = 15;
+
+// BT.601 coefficients scaled by 2^SHIFT, in B, G, R order like the pixels.
+static constexpr int Y_B = 3735, Y_G = 19235, Y_R = 9798;
+static constexpr int U_B = 14287, U_G = -9465, U_R = -4821;
+static constexpr int V_B = -3277, V_G = -16875, V_R = 20152;
+
+/// Fractional bits of the coefficients converting back to RGB
+static constexpr int RGB_SHIFT = 13;
+
+// Coefficients of U and V in R, G and B, scaled by 2^RGB_SHIFT.
+static constexpr int R_V = 9337;
+static constexpr int G_U = -3233, G_V = -4756;
+static constexpr int B_U = 16647;
+
+/// Drop the fractional bits, rounding towards zero
+static inline int TruncateFixed(int value)
+{
+	return (value + ((value >> 31) & ((1 << SHIFT) - 1))) >> SHIFT;
+}
+
+static void ConvertRow_Scalar(const uint8_t* src, int begin, int width, uint8_t* Y, int16_t* U, int16_t* V)
+{
+	for (int x = begin; x < width; ++x) {
+		const int b = src[4 * x];
+		const int g = src[4 * x + 1];
+		const int r = src[4 * x + 2];
+
+		Y[x] = static_cast<uint8_t>((Y_B * b + Y_G * g + Y_R * r + (1 << (SHIFT - 1))) >> SHIFT);
+		U[x] = static_cast<int16_t>(TruncateFixed(U_B * b + U_G * g + U_R * r));
+		V[x] = static_cast<int16_t>(TruncateFixed(V_B * b + V_G * g + V_R * r));
+	}
+}
+
+static inline uint8_t ClampToByte(int value)
+{
+	return static_cast<uint8_t>(value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+static inline void StoreXRGB(int y, int u, int v, uint8_t* dst)
+{
+	const auto y_fixed = y << RGB_SHIFT;
+
+	dst[0] = ClampToByte((y_fixed + B_U * u) >> RGB_SHIFT);
+	dst[1] = ClampToByte((y_fixed + G_U * u + G_V * v) >> RGB_SHIFT);
+	dst[2] = ClampToByte((y_fixed + R_V * v) >> RGB_SHIFT);
+	dst[3] = 0;
+}
+
+static void ConvertYUVRow_Scalar(const uint8_t* Y, const int16_t* U, const int16_t* V, int begin, int width, uint8_t* dst)
+{
+	for (int x = begin; x < width; ++x)
+		StoreXRGB(Y[x], U[x], V[x], dst + 4 * x);
+}
+
+static void ConvertGreyRow_Scalar(const uint8_t* Y, int begin, int width, uint8_t* dst)
+{
+	for (int x = begin; x < width; ++x) {
+		dst[4 * x] = Y[x];
+		dst[4 * x + 1] = Y[x];
+		dst[4 * x + 2] = Y[x];
+		dst[4 * x + 3] = 0;
+	}
+}
+
+static void ConvertResidualRow_Scalar(const uint8_t* Y, const int16_t* U, const int16_t* V,
+                                      const uint8_t* base_Y, const int16_t* base_U, const int16_t* base_V,
+                                      int begin, int width, uint8_t* dst)
+{
+	for (int x = begin; x < width; ++x) {
+		const auto y = ClampToByte(128 + (int{Y[x]} - base_Y[x]) * 3);
+		const auto u = static_cast<int16_t>((U[x] - base_U[x]) * 3);
+		const auto v = static_cast<int16_t>((V[x] - base_V[x]) * 3);
+
+		StoreXRGB(y, u, v, dst + 4 * x);
+	}
+}
+
+/// Full size pixels [begin, width) of a chroma row
+static void ExpandChromaRow_Scalar(const uint8_t* src, int shift_x, int begin, int width, int16_t* dst)
+{
+	for (int x = begin; x < width; ++x)
+		dst[x] = static_cast<int16_t>(src[x >> shift_x] - 128);
+}
+
+/// Chroma samples [begin, count) of a full size row
+static void SubsampleChromaRow_Scalar(const int16_t* src, int shift_x, int begin, int count, uint8_t* dst)
+{
+	for (int x = begin; x < count; ++x)
+		dst[x] = ClampToByte(src[x << shift_x] + 128);
+}
+
+#if defined(DE_ARCH_X86)
+
+/**
+ * Weighted sums of four pixels: pixels_lo and pixels_hi hold two pixels each as 16-bit B, G, R, X,
+ * coefficients hold B, G, R, 0 weights for both. Returns the four sums in pixel order.
+ */
+DE_TARGET_SSE2 static inline __m128i WeightedSum(__m128i pixels_lo, __m128i pixels_hi, __m128i coefficients)
+{
+	// Each pixel gives two partial sums, B * cB + G * cG and R * cR.
+	const auto lo = _mm_castsi128_ps(_mm_madd_epi16(pixels_lo, coefficients));
+	const auto hi = _mm_castsi128_ps(_mm_madd_epi16(pixels_hi, coefficients));
+
+	return _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))),
+	                     _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+DE_TARGET_SSE2 static inline __m128i TruncateFixed_SSE2(__m128i value)
+{
+	const auto bias = _mm_and_si128(_mm_srai_epi32(value, 31), _mm_set1_epi32((1 << SHIFT) - 1));
+	return _mm_srai_epi32(_mm_add_epi32(value, bias), SHIFT);
+}
+
+/// Returns the number of pixels converted, the rest is left to the scalar version
+DE_TARGET_SSE2 static int ConvertRow_SSE2(const uint8_t* src, int width, uint8_t* Y, int16_t* U, int16_t* V)
+{
+	const auto zero = _mm_setzero_si128();
+	const auto y_coefficients = _mm_setr_epi16(Y_B, Y_G, Y_R, 0, Y_B, Y_G, Y_R, 0);
+	const auto u_coefficients = _mm_setr_epi16(U_B, U_G, U_R, 0, U_B, U_G, U_R, 0);
+	const auto v_coefficients = _mm_setr_epi16(V_B, V_G, V_R, 0, V_B, V_G, V_R, 0);
+	const auto round = _mm_set1_epi32(1 << (SHIFT - 1));
+
+	int x = 0;
+
+	for (; x + 8 <= width; x += 8) {
+		const auto first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * x));
+		const auto second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * x + 16));
+
+		const __m128i pixels[4] = {
+			_mm_unpacklo_epi8(first, zero), _mm_unpackhi_epi8(first, zero),
+			_mm_unpacklo_epi8(second, zero), _mm_unpackhi_epi8(second, zero)
+		};
+
+		const auto y_first = _mm_srai_epi32(_mm_add_epi32(WeightedSum(pixels[0], pixels[1], y_coefficients), round), SHIFT);
+		const auto y_second = _mm_srai_epi32(_mm_add_epi32(WeightedSum(pixels[2], pixels[3], y_coefficients), round), SHIFT);
+		const auto y = _mm_packs_epi32(y_first, y_second);
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(Y + x), _mm_packus_epi16(y, y));
+
+		const auto u = _mm_packs_epi32(TruncateFixed_SSE2(WeightedSum(pixels[0], pixels[1], u_coefficients)),
+		                               TruncateFixed_SSE2(WeightedSum(pixels[2], pixels[3], u_coefficients)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(U + x), u);
+
+		const auto v = _mm_packs_epi32(TruncateFixed_SSE2(WeightedSum(pixels[0], pixels[1], v_coefficients)),
+		                               TruncateFixed_SSE2(WeightedSum(pixels[2], pixels[3], v_coefficients)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(V + x), v);
+	}
+
+	return x;
+}
+
+/// Same as WeightedSum, for eight pixels; the sums come out in pixel order across both lanes.
+DE_TARGET_AVX2 static inline __m256i WeightedSum_AVX2(__m256i pixels_lo, __m256i pixels_hi, __m256i coefficients)
+{
+	const auto lo = _mm256_castsi256_ps(_mm256_madd_epi16(pixels_lo, coefficients));
+	const auto hi = _mm256_castsi256_ps(_mm256_madd_epi16(pixels_hi, coefficients));
+
+	return _mm256_add_epi32(_mm256_castps_si256(_mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))),
+	                        _mm256_castps_si256(_mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+DE_TARGET_AVX2 static inline __m256i TruncateFixed_AVX2(__m256i value)
+{
+	const auto bias = _mm256_and_si256(_mm256_srai_epi32(value, 31), _mm256_set1_epi32((1 << SHIFT) - 1));
+	return _mm256_srai_epi32(_mm256_add_epi32(value, bias), SHIFT);
+}
+
+/// Pack two registers of eight 32-bit values to sixteen 16-bit values in order
+DE_TARGET_AVX2 static inline __m256i Pack32To16_AVX2(__m256i first, __m256i second)
+{
+	return _mm256_permute4x64_epi64(_mm256_packs_epi32(first, second), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+DE_TARGET_AVX2 static int ConvertRow_AVX2(const uint8_t* src, int width, uint8_t* Y, int16_t* U, int16_t* V)
+{
+	const auto zero = _mm256_setzero_si256();
+	const auto y_coefficients = _mm256_setr_epi16(Y_B, Y_G, Y_R, 0, Y_B, Y_G, Y_R, 0, Y_B, Y_G, Y_R, 0, Y_B, Y_G, Y_R, 0);
+	const auto u_coefficients = _mm256_setr_epi16(U_B, U_G, U_R, 0, U_B, U_G, U_R, 0, U_B, U_G, U_R, 0, U_B, U_G, U_R, 0);
+	const auto v_coefficients = _mm256_setr_epi16(V_B, V_G, V_R, 0, V_B, V_G, V_R, 0, V_B, V_G, V_R, 0, V_B, V_G, V_R, 0);
+	const auto round = _mm256_set1_epi32(1 << (SHIFT - 1));
+
+	int x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		const auto first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 4 * x));
+		const auto second = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 4 * x + 32));
+
+		// Unpacking works within 128-bit lanes, WeightedSum_AVX2 puts the pixels back in order.
+		const __m256i pixels[4] = {
+			_mm256_unpacklo_epi8(first, zero), _mm256_unpackhi_epi8(first, zero),
+			_mm256_unpacklo_epi8(second, zero), _mm256_unpackhi_epi8(second, zero)
+		};
+
+		const auto y_first = _mm256_srai_epi32(_mm256_add_epi32(WeightedSum_AVX2(pixels[0], pixels[1], y_coefficients), round), SHIFT);
+		const auto y_second = _mm256_srai_epi32(_mm256_add_epi32(WeightedSum_AVX2(pixels[2], pixels[3], y_coefficients), round), SHIFT);
+		const auto y = Pack32To16_AVX2(y_first, y_second);
+		const auto y8 = _mm_packus_epi16(_mm256_castsi256_si128(y), _mm256_extracti128_si256(y, 1));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(Y + x), y8);
+
+		const auto u = Pack32To16_AVX2(TruncateFixed_AVX2(WeightedSum_AVX2(pixels[0], pixels[1], u_coefficients)),
+		                               TruncateFixed_AVX2(WeightedSum_AVX2(pixels[2], pixels[3], u_coefficients)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(U + x), u);
+
+		const auto v = Pack32To16_AVX2(TruncateFixed_AVX2(WeightedSum_AVX2(pixels[0], pixels[1], v_coefficients)),
+		                               TruncateFixed_AVX2(WeightedSum_AVX2(pixels[2], pixels[3], v_coefficients)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(V + x), v);
+	}
+
+	return x;
+}
+
+/// Convert eight pixels given as 16-bit Y, U and V and store them as 32-bit B, G, R, X
+DE_TARGET_SSE2 static inline void StoreXRGB_SSE2(__m128i y, __m128i u, __m128i v, uint8_t* dst)
+{
+	const auto zero = _mm_setzero_si128();
+	const auto r_coefficients = _mm_setr_epi16(0, R_V, 0, R_V, 0, R_V, 0, R_V);
+	const auto g_coefficients = _mm_setr_epi16(G_U, G_V, G_U, G_V, G_U, G_V, G_U, G_V);
+	const auto b_coefficients = _mm_setr_epi16(B_U, 0, B_U, 0, B_U, 0, B_U, 0);
+
+	const auto y_lo = _mm_slli_epi32(_mm_unpacklo_epi16(y, zero), RGB_SHIFT);
+	const auto y_hi = _mm_slli_epi32(_mm_unpackhi_epi16(y, zero), RGB_SHIFT);
+	const auto uv_lo = _mm_unpacklo_epi16(u, v);
+	const auto uv_hi = _mm_unpackhi_epi16(u, v);
+
+	const auto channel = [&](__m128i coefficients) {
+		const auto lo = _mm_srai_epi32(_mm_add_epi32(y_lo, _mm_madd_epi16(uv_lo, coefficients)), RGB_SHIFT);
+		const auto hi = _mm_srai_epi32(_mm_add_epi32(y_hi, _mm_madd_epi16(uv_hi, coefficients)), RGB_SHIFT);
+		const auto packed = _mm_packs_epi32(lo, hi);
+		return _mm_packus_epi16(packed, packed);
+	};
+
+	const auto bg = _mm_unpacklo_epi8(channel(b_coefficients), channel(g_coefficients));
+	const auto r0 = _mm_unpacklo_epi8(channel(r_coefficients), zero);
+
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi16(bg, r0));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 16), _mm_unpackhi_epi16(bg, r0));
+}
+
+DE_TARGET_SSE2 static inline __m128i Load8x16(const uint8_t* p)
+{
+	return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)), _mm_setzero_si128());
+}
+
+DE_TARGET_SSE2 static inline __m128i Load16x8(const int16_t* p)
+{
+	return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+DE_TARGET_SSE2 static int ConvertYUVRow_SSE2(const uint8_t* Y, const int16_t* U, const int16_t* V, int width, uint8_t* dst)
+{
+	int x = 0;
+
+	for (; x + 8 <= width; x += 8)
+		StoreXRGB_SSE2(Load8x16(Y + x), Load16x8(U + x), Load16x8(V + x), dst + 4 * x);
+
+	return x;
+}
+
+DE_TARGET_SSE2 static int ConvertResidualRow_SSE2(const uint8_t* Y, const int16_t* U, const int16_t* V,
+                                                  const uint8_t* base_Y, const int16_t* base_U, const int16_t* base_V,
+                                                  int width, uint8_t* dst)
+{
+	const auto three = _mm_set1_epi16(3);
+	const auto grey = _mm_set1_epi16(128);
+	const auto white = _mm_set1_epi16(255);
+
+	int x = 0;
+
+	for (; x + 8 <= width; x += 8) {
+		auto y = _mm_add_epi16(grey, _mm_mullo_epi16(_mm_sub_epi16(Load8x16(Y + x), Load8x16(base_Y + x)), three));
+		y = _mm_min_epi16(_mm_max_epi16(y, _mm_setzero_si128()), white);
+
+		const auto u = _mm_mullo_epi16(_mm_sub_epi16(Load16x8(U + x), Load16x8(base_U + x)), three);
+		const auto v = _mm_mullo_epi16(_mm_sub_epi16(Load16x8(V + x), Load16x8(base_V + x)), three);
+
+		StoreXRGB_SSE2(y, u, v, dst + 4 * x);
+	}
+
+	return x;
+}
+
+DE_TARGET_SSSE3 static int ConvertGreyRow_SSSE3(const uint8_t* Y, int width, uint8_t* dst)
+{
+	// Byte i of each group of four pixels goes to B, G and R of pixel i, X is zeroed.
+	const __m128i spread[4] = {
+		_mm_setr_epi8(0, 0, 0, -1, 1, 1, 1, -1, 2, 2, 2, -1, 3, 3, 3, -1),
+		_mm_setr_epi8(4, 4, 4, -1, 5, 5, 5, -1, 6, 6, 6, -1, 7, 7, 7, -1),
+		_mm_setr_epi8(8, 8, 8, -1, 9, 9, 9, -1, 10, 10, 10, -1, 11, 11, 11, -1),
+		_mm_setr_epi8(12, 12, 12, -1, 13, 13, 13, -1, 14, 14, 14, -1, 15, 15, 15, -1)
+	};
+
+	int x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		const auto grey = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Y + x));
+
+		for (int i = 0; i < 4; ++i)
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4 * x + 16 * i), _mm_shuffle_epi8(grey, spread[i]));
+	}
+
+	return x;
+}
+
+/// Returns the number of full size pixels done, the rest is left to the scalar version
+DE_TARGET_SSE2 static int ExpandChromaRow_SSE2(const uint8_t* src, int shift_x, int width, int16_t* dst)
+{
+	const auto zero = _mm_setzero_si128();
+	const auto bias = _mm_set1_epi16(128);
+
+	int x = 0;
+
+	if (shift_x) {
+		for (; x + 32 <= width; x += 32) {
+			const auto samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x / 2));
+			const auto lo = _mm_sub_epi16(_mm_unpacklo_epi8(samples, zero), bias);
+			const auto hi = _mm_sub_epi16(_mm_unpackhi_epi8(samples, zero), bias);
+
+			// Unpacking a register with itself repeats every sample twice.
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_unpacklo_epi16(lo, lo));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x + 8), _mm_unpackhi_epi16(lo, lo));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x + 16), _mm_unpacklo_epi16(hi, hi));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x + 24), _mm_unpackhi_epi16(hi, hi));
+		}
+	} else {
+		for (; x + 16 <= width; x += 16) {
+			const auto samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_sub_epi16(_mm_unpacklo_epi8(samples, zero), bias));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x + 8), _mm_sub_epi16(_mm_unpackhi_epi8(samples, zero), bias));
+		}
+	}
+
+	return x;
+}
+
+/// Returns the number of chroma samples done, the rest is left to the scalar version
+DE_TARGET_SSE2 static int SubsampleChromaRow_SSE2(const int16_t* src, int shift_x, int count, uint8_t* dst)
+{
+	const auto bias = _mm_set1_epi16(128);
+
+	// Even pixels of eight full size ones, sign extended to 32 bits
+	const auto even = [](const int16_t* p) {
+		return _mm_srai_epi32(_mm_slli_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), 16), 16);
+	};
+
+	int x = 0;
+
+	for (; x + 16 <= count; x += 16) {
+		__m128i lo, hi;
+
+		if (shift_x) {
+			lo = _mm_packs_epi32(even(src + 2 * x), even(src + 2 * x + 8));
+			hi = _mm_packs_epi32(even(src + 2 * x + 16), even(src + 2 * x + 24));
+		} else {
+			lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+			hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x + 8));
+		}
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(_mm_adds_epi16(lo, bias), _mm_adds_epi16(hi, bias)));
+	}
+
+	return x;
+}
+
+#endif
+
+void ConvertXRGBToYUV(const uint8_t* src, ptrdiff_t src_pitch, int width, int height,
+                      uint8_t* Y, ptrdiff_t Y_pitch, int16_t* U, int16_t* V)
+{
+#if defined(DE_ARCH_X86)
+	const auto& cpu = GetCPUFeatures();
+#endif
+
+	for (int y = 0; y < height; ++y) {
+		int done = 0;
+
+#if defined(DE_ARCH_X86)
+		if (cpu.avx2)
+			done = ConvertRow_AVX2(src, width, Y, U, V);
+		else if (cpu.sse2)
+			done = ConvertRow_SSE2(src, width, Y, U, V);
+#endif
+
+		ConvertRow_Scalar(src, done, width, Y, U, V);
+
+		src += src_pitch;
+		Y += Y_pitch;
+		U += width;
+		V += width;
+	}
+}
+
+void ConvertYUVToXRGB(const uint8_t* Y, ptrdiff_t Y_pitch, const int16_t* U, const int16_t* V,
+                      int width, int height, uint8_t* dst, ptrdiff_t dst_pitch)
+{
+#if defined(DE_ARCH_X86)
+	const auto use_sse2 = GetCPUFeatures().sse2;
+#endif
+
+	for (int y = 0; y < height; ++y) {
+		int done = 0;
+
+#if defined(DE_ARCH_X86)
+		if (use_sse2)
+			done = ConvertYUVRow_SSE2(Y, U, V, width, dst);
+#endif
+
+		ConvertYUVRow_Scalar(Y, U, V, done, width, dst);
+
+		Y += Y_pitch;
+		U += width;
+		V += width;
+		dst += dst_pitch;
+	}
+}
+
+void ConvertGreyToXRGB(const uint8_t* Y, ptrdiff_t Y_pitch, int width, int height, uint8_t* dst, ptrdiff_t dst_pitch)
+{
+#if defined(DE_ARCH_X86)
+	const auto use_ssse3 = GetCPUFeatures().ssse3;
+#endif
+
+	for (int y = 0; y < height; ++y) {
+		int done = 0;
+
+#if defined(DE_ARCH_X86)
+		if (use_ssse3)
+			done = ConvertGreyRow_SSSE3(Y, width, dst);
+#endif
+
+		ConvertGreyRow_Scalar(Y, done, width, dst);
+
+		Y += Y_pitch;
+		dst += dst_pitch;
+	}
+}
+
+void ConvertResidualToXRGB(const uint8_t* Y, ptrdiff_t Y_pitch, const int16_t* U, const int16_t* V,
+                           const uint8_t* base_Y, ptrdiff_t base_Y_pitch, const int16_t* base_U, const int16_t* base_V,
+                           int width, int height, uint8_t* dst, ptrdiff_t dst_pitch)
+{
+#if defined(DE_ARCH_X86)
+	const auto use_sse2 = GetCPUFeatures().sse2;
+#endif
+
+	for (int y = 0; y < height; ++y) {
+		int done = 0;
+
+#if defined(DE_ARCH_X86)
+		if (use_sse2)
+			done = ConvertResidualRow_SSE2(Y, U, V, base_Y, base_U, base_V, width, dst);
+#endif
+
+		ConvertResidualRow_Scalar(Y, U, V, base_Y, base_U, base_V, done, width, dst);
+
+		Y += Y_pitch;
+		U += width;
+		V += width;
+		base_Y += base_Y_pitch;
+		base_U += width;
+		base_V += width;
+		dst += dst_pitch;
+	}
+}
+
+void ExpandChroma(const uint8_t* src, ptrdiff_t src_pitch, int shift_x, int shift_y, int width, int height, int16_t* dst)
+{
+#if defined(DE_ARCH_X86)
+	const auto use_sse2 = GetCPUFeatures().sse2;
+#endif
+
+	for (int y = 0; y < height; ++y) {
+		// Rows sharing a chroma row are copies of the first one.
+		if (y & ((1 << shift_y) - 1)) {
+			memcpy(dst, dst - width, width * sizeof(int16_t));
+		} else {
+			int done = 0;
+
+#if defined(DE_ARCH_X86)
+			if (use_sse2)
+				done = ExpandChromaRow_SSE2(src, shift_x, width, dst);
+#endif
+
+			ExpandChromaRow_Scalar(src, shift_x, done, width, dst);
+			src += src_pitch;
+		}
+
+		dst += width;
+	}
+}
+
+void SubsampleChroma(const int16_t* src, int shift_x, int shift_y, int width, int height, uint8_t* dst, ptrdiff_t dst_pitch)
+{
+#if defined(DE_ARCH_X86)
+	const auto use_sse2 = GetCPUFeatures().sse2;
+#endif
+
+	const auto count = (width + (1 << shift_x) - 1) >> shift_x;
+
+	for (int y = 0; y < height; y += 1 << shift_y) {
+		int done = 0;
+
+#if defined(DE_ARCH_X86)
+		// The vector loop reads two full size pixels per sample, the last sample may only have one.
+		if (use_sse2)
+			done = SubsampleChromaRow_SSE2(src, shift_x, shift_x ? width / 2 : count, dst);
+#endif
+
+		SubsampleChromaRow_Scalar(src, shift_x, done, count, dst);
+
+		src += width << shift_y;
+		dst += dst_pitch;
+	}
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Convert 32-bit B, G, R, X pixels (XRGB32 in memory order) to BT.601 Y, U and V planes.
+ *
+ * Fixed point with 15 fractional bits. Y is rounded, U and V are truncated towards zero,
+ * as the floating point formula this replaces did; results differ from it by at most 1.
+ *
+ * @param[in] src first pixel of the source
+ * @param[in] src_pitch pitch of the source, in bytes
+ * @param[in] width frame width
+ * @param[in] height frame height
+ * @param[out] Y Y plane
+ * @param[in] Y_pitch pitch of the Y plane
+ * @param[out] U U plane, pitch equal to the width
+ * @param[out] V V plane, pitch equal to the width
+ */
+void ConvertXRGBToYUV(const uint8_t* src, ptrdiff_t src_pitch, int width, int height,
+                      uint8_t* Y, ptrdiff_t Y_pitch, int16_t* U, int16_t* V);
+
+/**
+ * Convert Y, U and V planes to 32-bit B, G, R, X pixels, the inverse of ConvertXRGBToYUV.
+ * Fixed point with 13 fractional bits, results differ from the floating point formula by at most 1.
+ *
+ * @param[in] Y Y plane
+ * @param[in] Y_pitch pitch of the Y plane
+ * @param[in] U U plane, pitch equal to the width
+ * @param[in] V V plane, pitch equal to the width
+ * @param[in] width frame width
+ * @param[in] height frame height
+ * @param[out] dst first pixel of the destination
+ * @param[in] dst_pitch pitch of the destination, in bytes
+ */
+void ConvertYUVToXRGB(const uint8_t* Y, ptrdiff_t Y_pitch, const int16_t* U, const int16_t* V,
+                      int width, int height, uint8_t* dst, ptrdiff_t dst_pitch);
+
+/**
+ * Write a greyscale plane as 32-bit pixels with B = G = R
+ *
+ * @param[in] Y grey plane
+ * @param[in] Y_pitch pitch of the grey plane
+ * @param[in] width frame width
+ * @param[in] height frame height
+ * @param[out] dst first pixel of the destination
+ * @param[in] dst_pitch pitch of the destination, in bytes
+ */
+void ConvertGreyToXRGB(const uint8_t* Y, ptrdiff_t Y_pitch, int width, int height, uint8_t* dst, ptrdiff_t dst_pitch);
+
+/**
+ * Write the amplified difference of two frames as 32-bit pixels, in one pass.
+ * The difference is Y = 128 + 3 * (Y - base_Y), U = 3 * (U - base_U) and V = 3 * (V - base_V),
+ * converted like ConvertYUVToXRGB.
+ *
+ * @param[in] Y, Y_pitch, U, V the frame to subtract from, U and V with a pitch equal to the width
+ * @param[in] base_Y, base_Y_pitch, base_U, base_V the frame to subtract
+ * @param[in] width frame width
+ * @param[in] height frame height
+ * @param[out] dst first pixel of the destination
+ * @param[in] dst_pitch pitch of the destination, in bytes
+ */
+void ConvertResidualToXRGB(const uint8_t* Y, ptrdiff_t Y_pitch, const int16_t* U, const int16_t* V,
+                           const uint8_t* base_Y, ptrdiff_t base_Y_pitch, const int16_t* base_U, const int16_t* base_V,
+                           int width, int height, uint8_t* dst, ptrdiff_t dst_pitch);
+
+/**
+ * Expand an 8-bit chroma plane to a full size plane of signed values (sample - 128),
+ * repeating every sample over the pixels it covers.
+ *
+ * @param[in] src first sample of the chroma plane
+ * @param[in] src_pitch pitch of the chroma plane, in bytes
+ * @param[in] shift_x, shift_y horizontal and vertical subsampling as a power of two, 0 or 1
+ * @param[in] width frame width
+ * @param[in] height frame height
+ * @param[out] dst full size plane, pitch equal to the width
+ */
+void ExpandChroma(const uint8_t* src, ptrdiff_t src_pitch, int shift_x, int shift_y, int width, int height, int16_t* dst);
+
+/**
+ * Subsample a full size chroma plane to 8 bits (value + 128, saturated), keeping the top left
+ * pixel of every group; the inverse of ExpandChroma.
+ *
+ * @param[in] src full size plane, pitch equal to the width
+ * @param[in] shift_x, shift_y horizontal and vertical subsampling as a power of two, 0 or 1
+ * @param[in] width frame width
+ * @param[in] height frame height
+ * @param[out] dst first sample of the chroma plane
+ * @param[in] dst_pitch pitch of the chroma plane, in bytes
+ */
+void SubsampleChroma(const int16_t* src, int shift_x, int shift_y, int width, int height, uint8_t* dst, ptrdiff_t dst_pitch);
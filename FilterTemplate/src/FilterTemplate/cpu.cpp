@@ -0,0 +1,79 @@
+#include <cstdint>
+
+#include "cpu.hpp"
+
+#if defined(DE_ARCH_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(DE_ARCH_X86)
+static void CPUID(unsigned leaf, unsigned subleaf, unsigned regs[4]) {
+#if defined(_MSC_VER)
+	int r[4];
+	__cpuidex(r, static_cast<int>(leaf), static_cast<int>(subleaf));
+	for (int i = 0; i < 4; ++i)
+		regs[i] = static_cast<unsigned>(r[i]);
+#else
+	if (!__get_cpuid_count(leaf, subleaf, &regs[0], &regs[1], &regs[2], &regs[3]))
+		regs[0] = regs[1] = regs[2] = regs[3] = 0;
+#endif
+}
+
+static uint64_t XGETBV() {
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	unsigned lo, hi;
+	__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return (static_cast<uint64_t>(hi) << 32) | lo;
+#endif
+}
+
+static CPUFeatures DetectCPUFeatures() {
+	CPUFeatures features;
+	unsigned regs[4];
+
+	CPUID(0, 0, regs);
+	const auto max_leaf = regs[0];
+
+	if (max_leaf < 1)
+		return features;
+
+	CPUID(1, 0, regs);
+	features.sse2 = (regs[3] & (1u << 26)) != 0;
+	features.ssse3 = (regs[2] & (1u << 9)) != 0;
+	features.sse41 = (regs[2] & (1u << 19)) != 0;
+
+	// AVX state has to be enabled by the OS, not only supported by the CPU.
+	const bool osxsave = (regs[2] & (1u << 27)) != 0;
+	const bool avx = (regs[2] & (1u << 28)) != 0;
+
+	if (!osxsave || !avx || max_leaf < 7)
+		return features;
+
+	const auto xcr0 = XGETBV();
+	const bool os_avx = (xcr0 & 0x06) == 0x06;
+	const bool os_avx512 = (xcr0 & 0xE6) == 0xE6;
+
+	CPUID(7, 0, regs);
+	features.avx2 = os_avx && (regs[1] & (1u << 5)) != 0;
+	features.avx512bw = os_avx512
+		&& (regs[1] & (1u << 16)) != 0   // AVX512F
+		&& (regs[1] & (1u << 30)) != 0;  // AVX512BW
+
+	return features;
+}
+#else
+static CPUFeatures DetectCPUFeatures() {
+	return CPUFeatures();
+}
+#endif
+
+const CPUFeatures& GetCPUFeatures() {
+	static const CPUFeatures features = DetectCPUFeatures();
+	return features;
+}
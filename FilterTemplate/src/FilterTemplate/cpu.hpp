@@ -0,0 +1,33 @@
+#pragma once
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define DE_ARCH_X86 1
+#endif
+
+// GCC and Clang only allow intrinsics inside functions compiled for the matching
+// instruction set, MSVC allows them everywhere.
+#if defined(__GNUC__) || defined(__clang__)
+#define DE_TARGET_SSE2 __attribute__((target("sse2")))
+#define DE_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define DE_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define DE_TARGET_AVX2 __attribute__((target("avx2")))
+#define DE_TARGET_AVX512BW __attribute__((target("avx512f,avx512bw")))
+#else
+#define DE_TARGET_SSE2
+#define DE_TARGET_SSSE3
+#define DE_TARGET_SSE41
+#define DE_TARGET_AVX2
+#define DE_TARGET_AVX512BW
+#endif
+
+/// Instruction set extensions supported by both the CPU and the OS
+struct CPUFeatures {
+	bool sse2 = false;
+	bool ssse3 = false;
+	bool sse41 = false;
+	bool avx2 = false;
+	bool avx512bw = false;
+};
+
+/// Detect CPU features (computed once, cached afterwards)
+const CPUFeatures& GetCPUFeatures();
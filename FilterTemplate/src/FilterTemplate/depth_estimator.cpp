@@ -1,20 +1,110 @@
 #include <cmath>
+#include <cstring>
 #include <vector>
 #include <algorithm>
 #include <functional>
 
+#include "cpu.hpp"
 #include "motion_estimator.hpp"
 #include "depth_estimator.hpp"
 
-DepthEstimator::DepthEstimator(int width, int height, uint8_t quality)
+#if defined(DE_ARCH_X86)
+#include <emmintrin.h>
+#endif
+
+/// Range sigma of the cross bilateral filter
+static constexpr double BILATERAL_SIGMA = 10.0;
+
+/// Regularisation of the guided filter
+static constexpr double GUIDED_EPSILON = 1e-3;
+
+/**
+ * Expand a row of per-cell values to a row of pixels, every value repeated CELL_SIZE times
+ *
+ * @param[in] cells values of the cells, one per CELL_SIZE pixels
+ * @param[in] begin first pixel to write
+ * @param[in] width number of pixels in the row
+ * @param[out] out pixels of the row
+ */
+template <int CELL_SIZE>
+static void ExpandCells_Scalar(const uint8_t* cells, int begin, int width, uint8_t* out)
+{
+	for (int x = begin; x < width; ++x)
+		out[x] = cells[x / CELL_SIZE];
+}
+
+#if defined(DE_ARCH_X86)
+
+/// Returns the number of pixels written, the rest is left to the scalar version
+template <int CELL_SIZE>
+DE_TARGET_SSE2 static int ExpandCells_SSE2(const uint8_t* cells, int width, uint8_t* out)
+{
+	static_assert(CELL_SIZE > 0 && CELL_SIZE <= 16 && (CELL_SIZE & (CELL_SIZE - 1)) == 0,
+	              "cell size must be a power of two up to 16");
+
+	int x = 0;
+
+	for (; x + 16 * CELL_SIZE <= width; x += 16 * CELL_SIZE) {
+		// Every unpack of a register with itself doubles each byte, 16 cells become CELL_SIZE registers.
+		__m128i parts[CELL_SIZE];
+		parts[0] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cells + x / CELL_SIZE));
+
+		for (int n = 1; n < CELL_SIZE; n *= 2) {
+			for (int i = n - 1; i >= 0; --i) {
+				parts[2 * i + 1] = _mm_unpackhi_epi8(parts[i], parts[i]);
+				parts[2 * i] = _mm_unpacklo_epi8(parts[i], parts[i]);
+			}
+		}
+
+		for (int i = 0; i < CELL_SIZE; ++i)
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + x + 16 * i), parts[i]);
+	}
+
+	return x;
+}
+
+#endif
+
+template <int CELL_SIZE>
+static void ExpandCells(const uint8_t* cells, int width, uint8_t* out)
+{
+	int done = 0;
+
+#if defined(DE_ARCH_X86)
+	if (GetCPUFeatures().sse2)
+		done = ExpandCells_SSE2<CELL_SIZE>(cells, width, out);
+#endif
+
+	ExpandCells_Scalar<CELL_SIZE>(cells, done, width, out);
+}
+
+DepthEstimator::DepthEstimator(int width, int height, uint8_t quality, DepthRefinement refinement, int guided_radius, int median_depth)
 	: width(width)
 	, height(height)
 	, quality(quality)
 	, width_ext(width + 2 * MotionEstimator::BORDER)
 	, num_blocks_hor((width + MotionEstimator::BLOCK_SIZE - 1) / MotionEstimator::BLOCK_SIZE)
 	, num_blocks_vert((height + MotionEstimator::BLOCK_SIZE - 1) / MotionEstimator::BLOCK_SIZE)
-	, first_row_offset(width_ext * MotionEstimator::BORDER + MotionEstimator::BORDER) {
-	// PUT YOUR CODE HERE
+	, first_row_offset(width_ext * MotionEstimator::BORDER + MotionEstimator::BORDER)
+	, median_depth(std::min(std::max(median_depth | 1, MIN_MEDIAN_DEPTH), MAX_MEDIAN_DEPTH))
+	, max_history(this->median_depth - 1)
+	, history_size(0)
+	, cell_depth(num_blocks_hor * MVField::CELLS_PER_BLOCK) {
+	// Planes are padded to whole cache lines, so every one of them stays aligned.
+	const auto plane_size = (static_cast<size_t>(width) * height + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+	plane_storage = std::make_unique<uint8_t[]>(plane_size * (max_history + 1) + ALIGNMENT - 1);
+
+	const auto address = reinterpret_cast<uintptr_t>(plane_storage.get());
+	const auto first_plane = plane_storage.get() + ((ALIGNMENT - address % ALIGNMENT) % ALIGNMENT);
+
+	for (int i = 0; i < max_history; ++i)
+		history[i] = first_plane + i * plane_size;
+	warp_buffer = first_plane + max_history * plane_size;
+
+	if (refinement == DepthRefinement::GUIDED)
+		guided = std::make_unique<GuidedFilter>(width, height, guided_radius, GUIDED_EPSILON);
+	else
+		bilateral = std::make_unique<CrossBilateralFilter>(width, height, BILATERAL_SIGMA);
 }
 
 DepthEstimator::~DepthEstimator() {
@@ -27,160 +117,124 @@ DepthEstimator::~DepthEstimator() {
 void DepthEstimator::Estimate(const uint8_t* cur_Y,
                               const int16_t* cur_U,
                               const int16_t* cur_V,
-                              const MV* mvectors,
+                              const MVField& mvectors,
                               uint8_t* depth_map) {
 	CreateInitialMap(mvectors, depth_map);
 	
 	UpdateHistory(mvectors);
-	ApplyCrossBilateralFilter(depth_map, cur_Y, cur_U, cur_V);
+	if (guided)
+		ApplyGuidedFilter(depth_map, cur_Y, cur_U, cur_V);
+	else
+		ApplyCrossBilateralFilter(depth_map, cur_Y, cur_U, cur_V);
 	ApplyMedianFilter(depth_map);
 	Cache(depth_map);
 }
 
-void DepthEstimator::CreateInitialMap(const MV * mvectors, uint8_t * depth_map)
+void DepthEstimator::CreateInitialMap(const MVField& mvectors, uint8_t * depth_map)
 {
-	constexpr int MULTIPLIER = 16.0;
-
-	constexpr int block_size = 4; // FIXME: dependent on BLOCK_SIZE
-	constexpr unsigned mask16 = MotionEstimator::BLOCK_SIZE - 1;
-	constexpr unsigned mask8 = mask16 >> 1;
-	constexpr unsigned mask4 = mask8 >> 1;
-
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			const auto i = y >> block_size;
-			const auto j = x >> block_size;
-			const auto block_id = i * num_blocks_hor + j;
-			
-			const auto h =
-				(((y & mask16) < (MotionEstimator::BLOCK_SIZE / 2)) ? 0 : 2)
-				+ (((x & mask16) < (MotionEstimator::BLOCK_SIZE / 2)) ? 0 : 1);
-			const auto h2 =
-				(((y & mask8) < (MotionEstimator::BLOCK_SIZE / 4)) ? 0 : 2)
-				+ (((x & mask8) < (MotionEstimator::BLOCK_SIZE / 4)) ? 0 : 1);
-
-			const auto & mv = mvectors[block_id].SubVector(h).SubVector(h2);
-			
-			depth_map[y * width + x] = static_cast<uint8_t>(std::min(abs(mv.x) * MULTIPLIER, 255));
-		}
+	constexpr int MULTIPLIER = 16;
+	constexpr int CELL_SIZE = MVField::CELL_SIZE;
+
+	const auto mv_x = mvectors.X();
+	const auto num_cells = (width + CELL_SIZE - 1) / CELL_SIZE;
+
+	for (int y0 = 0; y0 < height; y0 += CELL_SIZE) {
+		const auto row = mv_x + (y0 / CELL_SIZE) * mvectors.Stride();
+
+		// Depth of every cell of the row first, then the first pixel row, copied to the others.
+		for (int c = 0; c < num_cells; ++c)
+			cell_depth[c] = static_cast<uint8_t>(std::min(abs(row[c]) * MULTIPLIER, 255));
+
+		const auto out = depth_map + y0 * width;
+		ExpandCells<CELL_SIZE>(cell_depth.data(), width, out);
+
+		for (int y = y0 + 1; y < std::min(y0 + CELL_SIZE, height); ++y)
+			memcpy(depth_map + y * width, out, width);
+	}
+}
+
+void DepthEstimator::UpdateHistory(const MVField& mvectors)
+{
+	for (int i = 0; i < history_size; ++i) {
+		Warp(mvectors, history[i], warp_buffer);
+		std::swap(history[i], warp_buffer);
 	}
 }
 
-void DepthEstimator::UpdateHistory(const MV * mvectors)
+void DepthEstimator::Warp(const MVField& mvectors, const uint8_t* src, uint8_t* dst) const
 {
-	auto prev = new uint8_t[height*width];
-
-	constexpr int block_size = 4; // FIXME: dependent on BLOCK_SIZE
-	constexpr unsigned mask16 = MotionEstimator::BLOCK_SIZE - 1;
-	constexpr unsigned mask8 = mask16 >> 1;
-	constexpr unsigned mask4 = mask8 >> 1;
-
-	for (auto m : history) {
-		memcpy(prev, m, height * width);
-		
-		for (int y = 0; y < height; ++y) {
-			for (int x = 0; x < width; ++x) {
-				const auto i = y >> block_size;
-				const auto j = x >> block_size;
-				const auto block_id = i * num_blocks_hor + j;
-				
-				const auto h =
-					(((y & mask16) < (MotionEstimator::BLOCK_SIZE / 2)) ? 0 : 2)
-					+ (((x & mask16) < (MotionEstimator::BLOCK_SIZE / 2)) ? 0 : 1);
-				const auto h2 =
-					(((y & mask8) < (MotionEstimator::BLOCK_SIZE / 4)) ? 0 : 2)
-					+ (((x & mask8) < (MotionEstimator::BLOCK_SIZE / 4)) ? 0 : 1);
-
-				const auto & mv = mvectors[block_id].SubVector(h).SubVector(h2);
-
-				const auto prev_x = std::min(std::max(x + mv.x, 0), width - 1);
-				const auto prev_y = std::min(std::max(y + mv.y, 0), height - 1);
-				m[y * width + x] = prev[prev_y * width + prev_x];
+	constexpr int CELL_SIZE = MVField::CELL_SIZE;
+
+	const auto mv_x = mvectors.X();
+	const auto mv_y = mvectors.Y();
+	const auto num_cells = (width + CELL_SIZE - 1) / CELL_SIZE;
+
+	for (int y0 = 0; y0 < height; y0 += CELL_SIZE) {
+		const auto cells = (y0 / CELL_SIZE) * mvectors.Stride();
+		const auto y1 = std::min(y0 + CELL_SIZE, height);
+
+		// Neighbouring cells with the same vector move together, one row copy per run.
+		for (int c = 0; c < num_cells; ) {
+			const int dx = mv_x[cells + c];
+			const int dy = mv_y[cells + c];
+
+			auto end = c + 1;
+			while (end < num_cells && mv_x[cells + end] == dx && mv_y[cells + end] == dy)
+				++end;
+
+			const auto x0 = c * CELL_SIZE;
+			const auto x1 = std::min(end * CELL_SIZE, width);
+			const auto inside = x0 + dx >= 0 && x1 + dx <= width;
+
+			for (int y = y0; y < y1; ++y) {
+				const auto src_row = src + std::min(std::max(y + dy, 0), height - 1) * width;
+				const auto dst_row = dst + y * width;
+
+				if (inside) {
+					memcpy(dst_row + x0, src_row + x0 + dx, x1 - x0);
+				} else {
+					for (int x = x0; x < x1; ++x)
+						dst_row[x] = src_row[std::min(std::max(x + dx, 0), width - 1)];
+				}
 			}
+
+			c = end;
 		}
 	}
-
-	delete[] prev;
 }
 
 void DepthEstimator::ApplyMedianFilter(uint8_t * depth_map)
 {
-	if (history.size() >= max_history) {
-		return;
-	}
+	// Until the history fills up, the current map stands in for the missing frames.
+	const uint8_t* planes[MAX_MEDIAN_DEPTH];
+	int count = 0;
 
-	std::vector<uint8_t> v;
-	v.reserve(max_history + 1);
+	for (int i = 0; i < history_size; ++i)
+		planes[count++] = history[i];
 
-	for (int i = 0; i < height*width; ++i) {
-		// add relevant points to vector
-		for (auto m : history) {
-			v.push_back(m[i]);
-		}
-		v.push_back(depth_map[i]);
-		// find median
-		std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
-		// update value
-		depth_map[i] = v[v.size() / 2];
-		v.clear();
-	}
-}
+	while (count < median_depth)
+		planes[count++] = depth_map;
 
-inline int sqr(int x) {
-	return x * x;
+	TemporalMedian(planes, median_depth, width * height, depth_map);
 }
 
 void DepthEstimator::ApplyCrossBilateralFilter(uint8_t * depth_map, const uint8_t * cur_Y, const int16_t * cur_U, const int16_t * cur_V)
 {
-	constexpr int S = 3;
-	constexpr int W = 2 * S + 1;
-	constexpr double sigma1 = 2.0, sigma2 = 10.0;
-
-	
-	auto filt = new uint8_t[height*width];
-
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			const auto ofs = y * width + x;
-
-			double acc = 0.0;
-			double sum = 0.0; // For accumulating the kernel values
-
-			auto depth_center = &depth_map[ofs];
-			auto Y_center = &cur_Y[y * width_ext + x];
-
-			for (int i = std::max(-S, 0 - y); i < std::min(S, height - y - 1); ++i) {
-				for (int j = std::max(-S, 0 - x); j < std::min(S, width - x - 1); ++j) {
-					auto v = 
-						//exp(-0.5*sqrt(sqr(i)+sqr(j)) / sigma1) *
-						exp(
-							-0.5*sqrt(
-								sqr(*Y_center - *(Y_center + width_ext * i + j))+
-								sqr(cur_U[y * width + x] - cur_U[(y + i)*width + (x + j)]) +
-								sqr(cur_V[y * width + x] - cur_V[(y + i)*width + (x + j)])
-							) / sigma2);
-
-					acc += v * *(depth_center + i * width + j);
-					sum += v;
-				}
-			}
-
-			filt[ofs] = acc / sum;
-		}
-	}
-	memcpy(depth_map, filt, height*width);
+	bilateral->Apply(depth_map, cur_Y + first_row_offset, width_ext, cur_U, cur_V);
+}
 
-	delete[] filt;
+void DepthEstimator::ApplyGuidedFilter(uint8_t * depth_map, const uint8_t * cur_Y, const int16_t * cur_U, const int16_t * cur_V)
+{
+	guided->Apply(depth_map, cur_Y + first_row_offset, width_ext, cur_U, cur_V);
 }
 
 void DepthEstimator::Cache(uint8_t * depth_map)
 {
-	if (history.size() >= max_history) {
-		auto first = history.front();
-		history.pop_front();
-		delete[] first;
-	}
-	auto copy = new uint8_t[height * width];
-	memcpy(copy, depth_map, sizeof(uint8_t) * height * width);
-	history.push_back(copy);
+	// When full, the oldest plane is reused for the newest map.
+	if (history_size == max_history)
+		std::rotate(history, history + 1, history + max_history);
+	else
+		++history_size;
+
+	memcpy(history[history_size - 1], depth_map, sizeof(uint8_t) * height * width);
 }
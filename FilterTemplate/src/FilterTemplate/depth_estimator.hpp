@@ -1,13 +1,48 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
-#include <deque>
-#include "mv.hpp"
+#include <memory>
+#include <vector>
+#include "depth_filter.hpp"
+#include "mv_field.hpp"
+
+/// Filter refining the depth map along edges of the frame
+enum class DepthRefinement : int {
+	/// 7x7 cross bilateral filter
+	CROSS_BILATERAL,
+
+	/// Colour guided filter, cost does not depend on the radius
+	GUIDED
+};
 
 class DepthEstimator {
 public:
-	/// Constructor
-	DepthEstimator(int width, int height, uint8_t quality);
+	/// Default radius of the guided filter
+	static constexpr int DEFAULT_GUIDED_RADIUS = 8;
+
+	/// Default number of frames the temporal median is taken over
+	static constexpr int DEFAULT_MEDIAN_DEPTH = 5;
+
+	/// Alignment of the history planes
+	static constexpr size_t ALIGNMENT = 64;
+
+	/**
+	 * Constructor
+	 *
+	 * @param[in] width frame width
+	 * @param[in] height frame height
+	 * @param[in] quality algorithm quality
+	 * @param[in] refinement filter refining the depth map
+	 * @param[in] guided_radius window radius of the guided filter
+	 * @param[in] median_depth frames the temporal median is taken over: 3, 5, 7 or 9
+	 */
+	DepthEstimator(int width,
+	               int height,
+	               uint8_t quality,
+	               DepthRefinement refinement = DepthRefinement::CROSS_BILATERAL,
+	               int guided_radius = DEFAULT_GUIDED_RADIUS,
+	               int median_depth = DEFAULT_MEDIAN_DEPTH);
 
 	/// Destructor
 	~DepthEstimator();
@@ -30,13 +65,13 @@ public:
 	 * @param[in] cur_Y array of pixel Y values of the current frame
 	 * @param[in] cur_U array of pixel U values of the current frame
 	 * @param[in] cur_V array of pixel V values of the current frame
-	 * @param[in] mvectors array of motion vectors
+	 * @param[in] mvectors motion vectors of the current frame
 	 * @param[out] depth_map output array of pixel depth values
 	 */
 	void Estimate(const uint8_t* cur_Y,
 	              const int16_t* cur_U,
 	              const int16_t* cur_V,
-	              const MV* mvectors,
+	              const MVField& mvectors,
 	              uint8_t* depth_map);
 
 private:
@@ -61,16 +96,39 @@ private:
 	/// Position of the first pixel of the frame in the extended frame
 	const int first_row_offset;
 
+	/// Frames the temporal median is taken over, the current one included
+	const int median_depth;
+
 	// data
-	const int max_history = 3;
-	std::deque<uint8_t *> history;
+	const int max_history;
+
+	/// Storage of the history planes and the warp buffer, aligned to ALIGNMENT
+	std::unique_ptr<uint8_t[]> plane_storage;
+
+	/// Depth maps of previous frames warped to the current one, oldest first.
+	/// All point into plane_storage, the first history_size hold maps.
+	uint8_t* history[MAX_MEDIAN_DEPTH - 1];
+	int history_size;
+
+	/// Target of warping, swaps places with the history plane it was warped from
+	uint8_t* warp_buffer;
+
+	/// Initial depth of every cell of a row of cells
+	std::vector<uint8_t> cell_depth;
+
+	/// Refinement filter, only the selected one exists
+	std::unique_ptr<CrossBilateralFilter> bilateral;
+	std::unique_ptr<GuidedFilter> guided;
 
 
 	/// Convert MV into depth map
-	void CreateInitialMap(const MV* mvectors, uint8_t* depth_map);
+	void CreateInitialMap(const MVField& mvectors, uint8_t* depth_map);
 	
 	/// Update history with new motion vectors
-	void UpdateHistory(const MV* mvectors);
+	void UpdateHistory(const MVField& mvectors);
+
+	/// Move a depth map by the motion vectors, every pixel taking the value it came from
+	void Warp(const MVField& mvectors, const uint8_t* src, uint8_t* dst) const;
 
 
 	/// Apply temporal median filter
@@ -79,6 +137,9 @@ private:
 	/// Apply cross bilateral filter based on image data
 	void ApplyCrossBilateralFilter(uint8_t *depth_map, const uint8_t * cur_Y, const int16_t * cur_U, const int16_t * cur_V);
 
+	/// Apply guided filter based on image data
+	void ApplyGuidedFilter(uint8_t *depth_map, const uint8_t * cur_Y, const int16_t * cur_U, const int16_t * cur_V);
+
 	/// Cache DM for use in median filter
 	void Cache(uint8_t * depth_map);
 
@@ -0,0 +1,506 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "cpu.hpp"
+#include "depth_filter.hpp"
+
+#if defined(DE_ARCH_X86)
+#include <emmintrin.h>
+#endif
+
+/// Taps of a 1-D pass besides the centre one
+static constexpr int TAPS = 2 * CrossBilateralFilter::RADIUS;
+
+/// Colour differences are clamped to this, anything further apart has weight 0 anyway
+static constexpr int MAX_DIFFERENCE = 255;
+
+/**
+ * Weighted average of the centre pixel (weight 1) and its taps, rounded
+ *
+ * @param[in] center depth values of the centre pixels
+ * @param[in] depth depth values of every tap
+ * @param[in] weights weights of every tap
+ */
+static void FilterRow_Scalar(const uint8_t* center, const uint8_t* const depth[TAPS], const uint8_t* const weights[TAPS], int count, uint8_t* out)
+{
+	for (int x = 0; x < count; ++x) {
+		int acc = CrossBilateralFilter::WEIGHT_ONE * center[x];
+		int sum = CrossBilateralFilter::WEIGHT_ONE;
+
+		for (int t = 0; t < TAPS; ++t) {
+			acc += weights[t][x] * depth[t][x];
+			sum += weights[t][x];
+		}
+
+		out[x] = static_cast<uint8_t>((acc + sum / 2) / sum);
+	}
+}
+
+static void SquaredDistances_Scalar(const uint8_t* Y0, const int16_t* U0, const int16_t* V0,
+                                    const uint8_t* Y1, const int16_t* U1, const int16_t* V1,
+                                    int count, int16_t* distances)
+{
+	for (int x = 0; x < count; ++x) {
+		const auto dy = int{Y0[x]} - Y1[x];
+		const auto du = std::min(std::abs(U0[x] - U1[x]), MAX_DIFFERENCE);
+		const auto dv = std::min(std::abs(V0[x] - V1[x]), MAX_DIFFERENCE);
+
+		distances[x] = static_cast<int16_t>(std::min(dy * dy + du * du + dv * dv, CrossBilateralFilter::WEIGHT_TABLE_SIZE - 1));
+	}
+}
+
+#if defined(DE_ARCH_X86)
+
+/// Sum two pairs of 16-bit products: a0 * b0 + a1 * b1 for the low and high four lanes
+DE_TARGET_SSE2 static inline void MulAdd(__m128i a0, __m128i a1, __m128i b0, __m128i b1, __m128i& lo, __m128i& hi)
+{
+	lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a0, a1), _mm_unpacklo_epi16(b0, b1)));
+	hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a0, a1), _mm_unpackhi_epi16(b0, b1)));
+}
+
+DE_TARGET_SSE2 static inline __m128i Load8(const uint8_t* p)
+{
+	return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)), _mm_setzero_si128());
+}
+
+DE_TARGET_SSE2 static void FilterRow_SSE2(const uint8_t* center, const uint8_t* const depth[TAPS], const uint8_t* const weights[TAPS], int count, uint8_t* out)
+{
+	const auto zero = _mm_setzero_si128();
+	const auto one = _mm_set1_epi16(CrossBilateralFilter::WEIGHT_ONE);
+	const auto half = _mm_set1_ps(0.5f);
+
+	int x = 0;
+
+	for (; x + 8 <= count; x += 8) {
+		// WEIGHT_ONE * depth still fits 16 bits unsigned.
+		const auto weighted_center = _mm_mullo_epi16(Load8(center + x), one);
+		auto acc_lo = _mm_unpacklo_epi16(weighted_center, zero);
+		auto acc_hi = _mm_unpackhi_epi16(weighted_center, zero);
+		auto sum = one;
+
+		for (int t = 0; t < TAPS; t += 2) {
+			const auto w0 = Load8(weights[t] + x);
+			const auto w1 = Load8(weights[t + 1] + x);
+			MulAdd(w0, w1, Load8(depth[t] + x), Load8(depth[t + 1] + x), acc_lo, acc_hi);
+			sum = _mm_add_epi16(sum, _mm_add_epi16(w0, w1));
+		}
+
+		const auto lo = _mm_cvttps_epi32(_mm_add_ps(
+			_mm_div_ps(_mm_cvtepi32_ps(acc_lo), _mm_cvtepi32_ps(_mm_unpacklo_epi16(sum, zero))), half));
+		const auto hi = _mm_cvttps_epi32(_mm_add_ps(
+			_mm_div_ps(_mm_cvtepi32_ps(acc_hi), _mm_cvtepi32_ps(_mm_unpackhi_epi16(sum, zero))), half));
+
+		const auto result = _mm_packs_epi32(lo, hi);
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(out + x), _mm_packus_epi16(result, result));
+	}
+
+	if (x < count) {
+		const uint8_t* depth_tail[TAPS];
+		const uint8_t* weights_tail[TAPS];
+
+		for (int t = 0; t < TAPS; ++t) {
+			depth_tail[t] = depth[t] + x;
+			weights_tail[t] = weights[t] + x;
+		}
+
+		FilterRow_Scalar(center + x, depth_tail, weights_tail, count - x, out + x);
+	}
+}
+
+DE_TARGET_SSE2 static void SquaredDistances_SSE2(const uint8_t* Y0, const int16_t* U0, const int16_t* V0,
+                                                 const uint8_t* Y1, const int16_t* U1, const int16_t* V1,
+                                                 int count, int16_t* distances)
+{
+	const auto zero = _mm_setzero_si128();
+	const auto max_difference = _mm_set1_epi16(MAX_DIFFERENCE);
+	const auto min_difference = _mm_set1_epi16(-MAX_DIFFERENCE);
+
+	int x = 0;
+
+	for (; x + 8 <= count; x += 8) {
+		const auto dy = _mm_sub_epi16(Load8(Y0 + x), Load8(Y1 + x));
+
+		auto du = _mm_subs_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(U0 + x)),
+		                         _mm_loadu_si128(reinterpret_cast<const __m128i*>(U1 + x)));
+		auto dv = _mm_subs_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(V0 + x)),
+		                         _mm_loadu_si128(reinterpret_cast<const __m128i*>(V1 + x)));
+		du = _mm_max_epi16(_mm_min_epi16(du, max_difference), min_difference);
+		dv = _mm_max_epi16(_mm_min_epi16(dv, max_difference), min_difference);
+
+		auto lo = _mm_setzero_si128();
+		auto hi = _mm_setzero_si128();
+		MulAdd(dy, du, dy, du, lo, hi);
+		MulAdd(dv, zero, dv, zero, lo, hi);
+
+		// Signed saturation clamps to WEIGHT_TABLE_SIZE - 1.
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(distances + x), _mm_packs_epi32(lo, hi));
+	}
+
+	SquaredDistances_Scalar(Y0 + x, U0 + x, V0 + x, Y1 + x, U1 + x, V1 + x, count - x, distances + x);
+}
+
+#endif
+
+CrossBilateralFilter::CrossBilateralFilter(int width, int height, double sigma)
+	: width(width)
+	, height(height)
+	, weight_table(WEIGHT_TABLE_SIZE)
+	, tmp(static_cast<size_t>(width) * height)
+	, line(width + 2 * RADIUS)
+	, distances(width)
+	, zero_weights(width)
+#if defined(DE_ARCH_X86)
+	, use_sse2(GetCPUFeatures().sse2)
+#else
+	, use_sse2(false)
+#endif
+{
+	for (int d2 = 0; d2 < WEIGHT_TABLE_SIZE; ++d2)
+		weight_table[d2] = static_cast<uint8_t>(WEIGHT_ONE * exp(-0.5 * sqrt(d2) / sigma) + 0.5);
+
+	for (auto& weights : horz_weights)
+		weights.resize(width + 2 * RADIUS);
+
+	for (auto& rows : vert_weights)
+		for (auto& weights : rows)
+			weights.resize(width);
+}
+
+void CrossBilateralFilter::Weigh(const uint8_t* Y0, const int16_t* U0, const int16_t* V0,
+                                 const uint8_t* Y1, const int16_t* U1, const int16_t* V1,
+                                 int count, uint8_t* weights)
+{
+#if defined(DE_ARCH_X86)
+	if (use_sse2)
+		SquaredDistances_SSE2(Y0, U0, V0, Y1, U1, V1, count, distances.data());
+	else
+#endif
+		SquaredDistances_Scalar(Y0, U0, V0, Y1, U1, V1, count, distances.data());
+
+	const auto table = weight_table.data();
+
+	for (int x = 0; x < count; ++x)
+		weights[x] = table[distances[x]];
+}
+
+void CrossBilateralFilter::Apply(uint8_t* depth_map, const uint8_t* Y, ptrdiff_t Y_pitch, const int16_t* U, const int16_t* V)
+{
+	auto filter_row = &FilterRow_Scalar;
+#if defined(DE_ARCH_X86)
+	if (use_sse2)
+		filter_row = &FilterRow_SSE2;
+#endif
+
+	const uint8_t* depth[TAPS];
+	const uint8_t* weights[TAPS];
+
+	// Horizontal pass, depth_map -> tmp. Weights between x and x + k also serve x + k looking back.
+	const auto center = line.data() + RADIUS;
+
+	for (int y = 0; y < height; ++y) {
+		const auto Y_row = Y + y * Y_pitch;
+		const auto U_row = U + y * width;
+		const auto V_row = V + y * width;
+
+		for (int k = 1; k <= RADIUS; ++k) {
+			const auto forward = horz_weights[k - 1].data() + RADIUS;
+			Weigh(Y_row, U_row, V_row, Y_row + k, U_row + k, V_row + k, width - k, forward);
+
+			depth[2 * k - 2] = center + k;
+			weights[2 * k - 2] = forward;
+			depth[2 * k - 1] = center - k;
+			weights[2 * k - 1] = forward - k;
+		}
+
+		memcpy(center, depth_map + y * width, width);
+		filter_row(center, depth, weights, width, tmp.data() + y * width);
+	}
+
+	// Vertical pass, tmp -> depth_map. Weights between rows y and y + k are kept until row y + k.
+	for (int y = 0; y < height; ++y) {
+		const auto Y_row = Y + y * Y_pitch;
+		const auto U_row = U + y * width;
+		const auto V_row = V + y * width;
+
+		for (int k = 1; k <= RADIUS; ++k) {
+			if (y + k < height) {
+				const auto forward = vert_weights[k - 1][y % (RADIUS + 1)].data();
+				Weigh(Y_row, U_row, V_row, Y_row + k * Y_pitch, U_row + k * width, V_row + k * width, width, forward);
+
+				depth[2 * k - 2] = tmp.data() + (y + k) * width;
+				weights[2 * k - 2] = forward;
+			} else {
+				depth[2 * k - 2] = tmp.data() + y * width;
+				weights[2 * k - 2] = zero_weights.data();
+			}
+
+			if (y - k >= 0) {
+				depth[2 * k - 1] = tmp.data() + (y - k) * width;
+				weights[2 * k - 1] = vert_weights[k - 1][(y - k) % (RADIUS + 1)].data();
+			} else {
+				depth[2 * k - 1] = tmp.data() + y * width;
+				weights[2 * k - 1] = zero_weights.data();
+			}
+		}
+
+		filter_row(tmp.data() + y * width, depth, weights, width, depth_map + y * width);
+	}
+}
+
+/**
+ * Means of C channels over a square window around every pixel, clipped at the frame edges.
+ * Column sums are updated as the window moves down, row sums as it moves right.
+ *
+ * @param[in] channels channels(x, y, values) fills in the C channel values of a pixel
+ * @param[in] row row(y, means) receives the C means of every pixel of row y, interleaved
+ */
+template <int C, typename Channels, typename Row>
+static void BoxMeans(int width, int height, int radius, std::vector<double>& columns, std::vector<double>& means, Channels channels, Row row)
+{
+	columns.assign(static_cast<size_t>(width) * C, 0.0);
+	means.resize(static_cast<size_t>(width) * C);
+
+	const auto add_row = [&](int y, double sign) {
+		double values[C];
+
+		for (int x = 0; x < width; ++x) {
+			channels(x, y, values);
+
+			for (int c = 0; c < C; ++c)
+				columns[x * C + c] += sign * values[c];
+		}
+	};
+
+	for (int y = 0; y < std::min(radius, height); ++y)
+		add_row(y, 1.0);
+
+	for (int y = 0; y < height; ++y) {
+		if (y + radius < height)
+			add_row(y + radius, 1.0);
+		if (y - radius - 1 >= 0)
+			add_row(y - radius - 1, -1.0);
+
+		const auto rows = std::min(y + radius, height - 1) - std::max(y - radius, 0) + 1;
+
+		double sums[C] = {};
+
+		for (int x = 0; x < std::min(radius, width); ++x)
+			for (int c = 0; c < C; ++c)
+				sums[c] += columns[x * C + c];
+
+		for (int x = 0; x < width; ++x) {
+			if (x + radius < width)
+				for (int c = 0; c < C; ++c)
+					sums[c] += columns[(x + radius) * C + c];
+			if (x - radius - 1 >= 0)
+				for (int c = 0; c < C; ++c)
+					sums[c] -= columns[(x - radius - 1) * C + c];
+
+			const auto cols = std::min(x + radius, width - 1) - std::max(x - radius, 0) + 1;
+			const auto scale = 1.0 / (rows * cols);
+
+			for (int c = 0; c < C; ++c)
+				means[x * C + c] = sums[c] * scale;
+		}
+
+		row(y, means.data());
+	}
+}
+
+GuidedFilter::GuidedFilter(int width, int height, int radius, double epsilon)
+	: width(width)
+	, height(height)
+	, radius(radius)
+	, epsilon(epsilon)
+	, a_Y(static_cast<size_t>(width) * height)
+	, a_U(a_Y.size())
+	, a_V(a_Y.size())
+	, b(a_Y.size()) {
+}
+
+void GuidedFilter::Apply(uint8_t* depth_map, const uint8_t* Y, ptrdiff_t Y_pitch, const int16_t* U, const int16_t* V)
+{
+	constexpr double SCALE = 1.0 / 255.0;
+
+	// Window means of the guide I = (Y, U, V), the depth p, I * I^T and I * p.
+	enum { I_Y, I_U, I_V, P, YY, YU, YV, UU, UV, VV, YP, UP, VP, STATISTICS };
+
+	const auto statistics = [&](int x, int y, double* s) {
+		const auto i_y = Y[y * Y_pitch + x] * SCALE;
+		const auto i_u = U[y * width + x] * SCALE;
+		const auto i_v = V[y * width + x] * SCALE;
+		const auto p = depth_map[y * width + x] * SCALE;
+
+		s[I_Y] = i_y;
+		s[I_U] = i_u;
+		s[I_V] = i_v;
+		s[P] = p;
+		s[YY] = i_y * i_y;
+		s[YU] = i_y * i_u;
+		s[YV] = i_y * i_v;
+		s[UU] = i_u * i_u;
+		s[UV] = i_u * i_v;
+		s[VV] = i_v * i_v;
+		s[YP] = i_y * p;
+		s[UP] = i_u * p;
+		s[VP] = i_v * p;
+	};
+
+	// a = (cov(I) + epsilon)^-1 * cov(I, p), b = mean(p) - a * mean(I)
+	const auto fit = [&](int y, const double* means) {
+		for (int x = 0; x < width; ++x) {
+			const auto m = means + x * STATISTICS;
+
+			const auto s_yy = m[YY] - m[I_Y] * m[I_Y] + epsilon;
+			const auto s_yu = m[YU] - m[I_Y] * m[I_U];
+			const auto s_yv = m[YV] - m[I_Y] * m[I_V];
+			const auto s_uu = m[UU] - m[I_U] * m[I_U] + epsilon;
+			const auto s_uv = m[UV] - m[I_U] * m[I_V];
+			const auto s_vv = m[VV] - m[I_V] * m[I_V] + epsilon;
+
+			const auto c_y = m[YP] - m[I_Y] * m[P];
+			const auto c_u = m[UP] - m[I_U] * m[P];
+			const auto c_v = m[VP] - m[I_V] * m[P];
+
+			// Inverse of the symmetric matrix by cofactors, positive definite thanks to epsilon.
+			const auto inv_yy = s_uu * s_vv - s_uv * s_uv;
+			const auto inv_yu = s_uv * s_yv - s_yu * s_vv;
+			const auto inv_yv = s_yu * s_uv - s_uu * s_yv;
+			const auto inv_uu = s_yy * s_vv - s_yv * s_yv;
+			const auto inv_uv = s_yu * s_yv - s_yy * s_uv;
+			const auto inv_vv = s_yy * s_uu - s_yu * s_yu;
+			const auto det = s_yy * inv_yy + s_yu * inv_yu + s_yv * inv_yv;
+
+			const auto k_y = (inv_yy * c_y + inv_yu * c_u + inv_yv * c_v) / det;
+			const auto k_u = (inv_yu * c_y + inv_uu * c_u + inv_uv * c_v) / det;
+			const auto k_v = (inv_yv * c_y + inv_uv * c_u + inv_vv * c_v) / det;
+
+			const auto ofs = y * width + x;
+			a_Y[ofs] = static_cast<float>(k_y);
+			a_U[ofs] = static_cast<float>(k_u);
+			a_V[ofs] = static_cast<float>(k_v);
+			b[ofs] = static_cast<float>(m[P] - k_y * m[I_Y] - k_u * m[I_U] - k_v * m[I_V]);
+		}
+	};
+
+	BoxMeans<STATISTICS>(width, height, radius, columns, means, statistics, fit);
+
+	// Average the models of all windows covering a pixel and apply them to its colour.
+	const auto coefficients = [&](int x, int y, double* s) {
+		const auto ofs = y * width + x;
+		s[0] = a_Y[ofs];
+		s[1] = a_U[ofs];
+		s[2] = a_V[ofs];
+		s[3] = b[ofs];
+	};
+
+	const auto output = [&](int y, const double* means) {
+		for (int x = 0; x < width; ++x) {
+			const auto m = means + x * 4;
+			const auto q = m[0] * Y[y * Y_pitch + x] + m[1] * U[y * width + x] + m[2] * V[y * width + x] + m[3] * 255.0;
+
+			depth_map[y * width + x] = static_cast<uint8_t>(std::min(std::max(q + 0.5, 0.0), 255.0));
+		}
+	};
+
+	BoxMeans<4>(width, height, radius, columns, means, coefficients, output);
+}
+
+/// Compare-exchange steps of median selection networks, the median ends up in the middle element.
+/// From N. Devillard, "Fast median search: an ANSI C implementation".
+static const int8_t MEDIAN3[][2] = {
+	{ 0, 1 }, { 1, 2 }, { 0, 1 }
+};
+
+static const int8_t MEDIAN5[][2] = {
+	{ 0, 1 }, { 3, 4 }, { 0, 3 }, { 1, 4 }, { 1, 2 }, { 2, 3 }, { 1, 2 }
+};
+
+static const int8_t MEDIAN7[][2] = {
+	{ 0, 5 }, { 0, 3 }, { 1, 6 }, { 2, 4 }, { 0, 1 }, { 3, 5 }, { 2, 6 },
+	{ 2, 3 }, { 3, 6 }, { 4, 5 }, { 1, 4 }, { 1, 3 }, { 3, 4 }
+};
+
+static const int8_t MEDIAN9[][2] = {
+	{ 1, 2 }, { 4, 5 }, { 7, 8 }, { 0, 1 }, { 3, 4 }, { 6, 7 }, { 1, 2 },
+	{ 4, 5 }, { 7, 8 }, { 0, 3 }, { 5, 8 }, { 4, 7 }, { 3, 6 }, { 1, 4 },
+	{ 2, 5 }, { 4, 7 }, { 4, 2 }, { 6, 4 }, { 4, 2 }
+};
+
+struct MedianNetwork {
+	const int8_t (*steps)[2];
+	int num_steps;
+};
+
+static MedianNetwork GetMedianNetwork(int count)
+{
+	switch (count) {
+	case 3: return { MEDIAN3, 3 };
+	case 5: return { MEDIAN5, 7 };
+	case 7: return { MEDIAN7, 13 };
+	default: return { MEDIAN9, 19 };
+	}
+}
+
+static void TemporalMedian_Scalar(const uint8_t* const planes[], int count, int begin, int end, uint8_t* out)
+{
+	const auto network = GetMedianNetwork(count);
+	uint8_t v[MAX_MEDIAN_DEPTH];
+
+	for (int i = begin; i < end; ++i) {
+		for (int k = 0; k < count; ++k)
+			v[k] = planes[k][i];
+
+		for (int s = 0; s < network.num_steps; ++s) {
+			auto& a = v[network.steps[s][0]];
+			auto& b = v[network.steps[s][1]];
+			const auto lo = std::min(a, b);
+			b = std::max(a, b);
+			a = lo;
+		}
+
+		out[i] = v[count / 2];
+	}
+}
+
+#if defined(DE_ARCH_X86)
+
+DE_TARGET_SSE2 static int TemporalMedian_SSE2(const uint8_t* const planes[], int count, int size, uint8_t* out)
+{
+	const auto network = GetMedianNetwork(count);
+	__m128i v[MAX_MEDIAN_DEPTH];
+
+	int i = 0;
+
+	for (; i + 16 <= size; i += 16) {
+		for (int k = 0; k < count; ++k)
+			v[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[k] + i));
+
+		for (int s = 0; s < network.num_steps; ++s) {
+			auto& a = v[network.steps[s][0]];
+			auto& b = v[network.steps[s][1]];
+			const auto lo = _mm_min_epu8(a, b);
+			b = _mm_max_epu8(a, b);
+			a = lo;
+		}
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), v[count / 2]);
+	}
+
+	return i;
+}
+
+#endif
+
+void TemporalMedian(const uint8_t* const planes[], int count, int size, uint8_t* out)
+{
+	int done = 0;
+
+#if defined(DE_ARCH_X86)
+	if (GetCPUFeatures().sse2)
+		done = TemporalMedian_SSE2(planes, count, size, out);
+#endif
+
+	TemporalMedian_Scalar(planes, count, done, size, out);
+}
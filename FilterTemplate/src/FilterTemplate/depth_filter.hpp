@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Cross bilateral filter of a depth map, guided by the colour of the frame.
+ *
+ * Runs as a horizontal and a vertical pass over a (2 * RADIUS + 1) window. Range weights
+ * exp(-0.5 * |colour difference| / sigma) come from a table indexed by the squared
+ * colour distance, sums are kept in fixed point.
+ */
+class CrossBilateralFilter {
+public:
+	/// Window radius
+	static constexpr int RADIUS = 3;
+
+	/// Range weight of identical colours, weights are fixed point with this as 1.0
+	static constexpr int WEIGHT_ONE = 255;
+
+	/// Entries in the range weight table, squared distances past the end get weight 0
+	static constexpr int WEIGHT_TABLE_SIZE = 32768;
+
+	/**
+	 * Constructor
+	 *
+	 * @param[in] width frame width
+	 * @param[in] height frame height
+	 * @param[in] sigma range sigma, in units of colour distance
+	 */
+	CrossBilateralFilter(int width, int height, double sigma);
+
+	/**
+	 * Filter a depth map in place
+	 *
+	 * @param[in,out] depth_map depth values, pitch equal to the width
+	 * @param[in] Y first visible pixel of the Y plane
+	 * @param[in] Y_pitch pitch of the Y plane
+	 * @param[in] U U plane, pitch equal to the width
+	 * @param[in] V V plane, pitch equal to the width
+	 */
+	void Apply(uint8_t* depth_map, const uint8_t* Y, ptrdiff_t Y_pitch, const int16_t* U, const int16_t* V);
+
+private:
+	const int width;
+	const int height;
+
+	/// Range weight by squared colour distance
+	std::vector<uint8_t> weight_table;
+
+	/// Output of the horizontal pass
+	std::vector<uint8_t> tmp;
+
+	/// Depth row of the horizontal pass with RADIUS zeros on both sides
+	std::vector<uint8_t> line;
+
+	/// Squared distances of the row being weighted
+	std::vector<int16_t> distances;
+
+	/// Horizontal pass: weights between x and x + k, stored from offset RADIUS, zero outside the row
+	std::vector<uint8_t> horz_weights[RADIUS];
+
+	/// Vertical pass: weights between rows y and y + k for the last RADIUS + 1 rows
+	std::vector<uint8_t> vert_weights[RADIUS][RADIUS + 1];
+
+	/// A row of zero weights
+	std::vector<uint8_t> zero_weights;
+
+	const bool use_sse2;
+
+	/// Range weights between two rows of pixels
+	void Weigh(const uint8_t* Y0, const int16_t* U0, const int16_t* V0,
+	           const uint8_t* Y1, const int16_t* U1, const int16_t* V1,
+	           int count, uint8_t* weights);
+};
+
+/**
+ * Colour guided filter of a depth map (He, Sun and Tang), the Y, U and V planes being the guide.
+ *
+ * Every output pixel is a linear function of the guide colour, fitted to the depth over a
+ * (2 * radius + 1) window. Window sums are running sums, so the cost does not depend on the radius.
+ */
+class GuidedFilter {
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param[in] width frame width
+	 * @param[in] height frame height
+	 * @param[in] radius window radius
+	 * @param[in] epsilon regularisation, larger values smooth more across colour edges;
+	 *   colours and depth are scaled to [0, 1]
+	 */
+	GuidedFilter(int width, int height, int radius, double epsilon);
+
+	/**
+	 * Filter a depth map in place
+	 *
+	 * @param[in,out] depth_map depth values, pitch equal to the width
+	 * @param[in] Y first visible pixel of the Y plane
+	 * @param[in] Y_pitch pitch of the Y plane
+	 * @param[in] U U plane, pitch equal to the width
+	 * @param[in] V V plane, pitch equal to the width
+	 */
+	void Apply(uint8_t* depth_map, const uint8_t* Y, ptrdiff_t Y_pitch, const int16_t* U, const int16_t* V);
+
+private:
+	const int width;
+	const int height;
+	const int radius;
+	const double epsilon;
+
+	/// Coefficients of the linear model of every pixel: depth = a_Y * Y + a_U * U + a_V * V + b
+	std::vector<float> a_Y, a_U, a_V, b;
+
+	/// Running column sums and window means of the row being filtered
+	std::vector<double> columns, means;
+};
+
+/// Frame counts TemporalMedian supports
+constexpr int MIN_MEDIAN_DEPTH = 3;
+constexpr int MAX_MEDIAN_DEPTH = 9;
+
+/**
+ * Median of every pixel across an odd number of planes, by a median selection network
+ *
+ * @param[in] planes 3, 5, 7 or 9 planes of equal size
+ * @param[in] count number of planes
+ * @param[in] size number of pixels in a plane
+ * @param[out] out median plane, may be one of the input planes
+ */
+void TemporalMedian(const uint8_t* const planes[], int count, int size, uint8_t* out);
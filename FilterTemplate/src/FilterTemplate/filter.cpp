@@ -6,20 +6,15 @@
 #include <vd2/VDXFrame/VideoFilterDialog.h>
 
 #include <algorithm>
-#include <chrono>
 #include <cmath>
 #include <cstring>
 #include <fstream>
 #include <memory>
-#include <ratio>
 
-#include "half_pixel.hpp"
-#include "mv.hpp"
-#include "motion_estimator.hpp"
-#include "depth_estimator.hpp"
+#include "color_convert.hpp"
+#include "frame_processor.hpp"
 #include "resource.h"
 
-namespace chrono = std::chrono;
 using std::make_unique;
 using std::max;
 using std::memcpy;
@@ -49,52 +44,12 @@ inline static uint8 RGBToY(uint32 rgb) {
 	return static_cast<uint8>(0.299 * r + 0.587 * g + 0.114 * b + 0.5);
 }
 
-inline static void RGBToYUV(uint8 r, uint8 g, uint8 b, uint8& y, int16& u, int16& v) {
-	y = static_cast<uint8>(0.299 * r + 0.587 * g + 0.114 * b + 0.5);
-	u = static_cast<int16>(-0.14713 * r - 0.28886 * g + 0.436 * b);
-	v = static_cast<int16>(0.615 * r - 0.51499 * g - 0.10001 * b);
+/// Chroma subsampling of a planar YUV format, as powers of two
+inline static void ChromaShifts(sint32 format, int& shift_x, int& shift_y) {
+	shift_x = format == nsVDXPixmap::kPixFormat_YUV444_Planar ? 0 : 1;
+	shift_y = format == nsVDXPixmap::kPixFormat_YUV420_Planar ? 1 : 0;
 }
 
-inline static void YUVToRGB(uint8 y, int16 u, int16 v, uint8& r, uint8& g, uint8& b) {
-	int r_ = static_cast<int>(y + 1.13983 * v);
-	int g_ = static_cast<int>(y - 0.39465 * u - 0.5806 * v);
-	int b_ = static_cast<int>(y + 2.03211 * u);
-
-	r = static_cast<uint8>(clamp(r_, 0, 255));
-	g = static_cast<uint8>(clamp(g_, 0, 255));
-	b = static_cast<uint8>(clamp(b_, 0, 255));
-}
-
-inline static double PSNR(double MSE, sint32 w, sint32 h) {
-	return 10 * log10(w * h * 255.0 * 255.0 / MSE);
-}
-
-enum class OutputType : int {
-	SOURCE,
-	RESIDUAL_BEFORE_MC,
-	RESIDUAL_AFTER_MC,
-	COMPENSATED,
-	DEPTH
-};
-
-struct FilterTemplateConfig {
-	OutputType output_type;
-	bool show_vectors;
-	bool draw_nothing;
-	bool measure_psnr;
-	uint8 quality;
-	bool use_half_pixel;
-
-	FilterTemplateConfig()
-		: output_type(OutputType::DEPTH)
-		, show_vectors(false)
-		, draw_nothing(false)
-		, measure_psnr(false)
-		, quality(100)
-		, use_half_pixel(false) {
-	}
-};
-
 class FilterTemplateDialog : public VDXVideoFilterDialog {
 public:
 	FilterTemplateDialog(FilterTemplateConfig& config, IVDXFilterPreview* preview)
@@ -277,102 +232,61 @@ protected:
 	void ScriptConfig(IVDXScriptInterpreter *isi, const VDXScriptValue *argv, int argc);
 
 	void ProcessRGB32(void* dst, ptrdiff_t dst_pitch, const void* src, ptrdiff_t src_pitch);
-	void CopyFromSrc(const uint8* src, ptrdiff_t src_pitch);
-	void FillBorders();
-	void EstimateMotion();
-	void EstimateDepth();
-	void DrawOutput(uint8* dst, ptrdiff_t dst_pitch);
-	void CompensateMotion();
-	void CopyToDst(uint8* dst, ptrdiff_t dst_pitch, const uint8* p_Y, ptrdiff_t Y_gap, const int16* p_U, const int16* p_V);
-	void CopyYToDst(uint8* dst, ptrdiff_t dst_pitch, const uint8* p_Y, ptrdiff_t Y_gap);
+	void CopyFromSrc(const uint8* src, ptrdiff_t src_pitch, uint8* p_Y, ptrdiff_t Y_pitch, int16* p_U, int16* p_V);
+	void DrawOutput(uint8* dst, ptrdiff_t dst_pitch, const OutputFrame& frame);
+	void ClearDst(uint8* dst, ptrdiff_t dst_pitch);
 	void DrawLine(uint8* dst, ptrdiff_t dst_pitch, sint32 x1, sint32 y1, sint32 x2, sint32 y2);
-	void MeasurePSNR();
+
+	void ProcessPlanar(const VDXPixmap& dst, const VDXPixmap& src);
+	void CopyFromPlanarSrc(const VDXPixmap& src, uint8* p_Y, ptrdiff_t Y_pitch, int16* p_U, int16* p_V);
+	void DrawPlanarOutput(const VDXPixmap& dst, const OutputFrame& frame);
+	void ClearPlanarDst(const VDXPixmap& dst);
+	void DrawLineY(uint8* dst_Y, ptrdiff_t dst_pitch, sint32 x1, sint32 y1, sint32 x2, sint32 y2);
 
 	sint32 width, height;
-	sint32 width_ext, height_ext;
-	sint32 num_blocks_hor, num_blocks_vert;
-	unique_ptr<uint8[]> cur_Y;
-	unique_ptr<int16[]> cur_U, cur_V;
-	unique_ptr<uint8[]> prev_Y;
-	unique_ptr<int16[]> prev_U, prev_V;
-	unique_ptr<uint8[]> prev_Y_up, prev_Y_left, prev_Y_upleft;
-	unique_ptr<int16[]> prev_U_up, prev_U_left, prev_U_upleft;
-	unique_ptr<int16[]> prev_V_up, prev_V_left, prev_V_upleft;
-	unique_ptr<uint8[]> cur_Y_MC;
-	unique_ptr<int16[]> cur_U_MC, cur_V_MC;
-
-	unique_ptr<MotionEstimator> me;
-	unique_ptr<MV[]> vectors;
-
-	unique_ptr<DepthEstimator> de;
-	unique_ptr<uint8[]> depth;
-
-	bool measured_psnr;
+
+	/// Pixel format of the source and the output, one of the formats GetParams accepts
+	sint32 format;
+
+	unique_ptr<FrameProcessor> processor;
 
 	FilterTemplateConfig config;
 
-	ofstream perf_file, psnr_file;
-	double /*total_rgbtoyuv, total_borders, */total_me, total_de/*, total_output, total_copy*/;
-	double total_y_psnr, total_u_psnr, total_v_psnr;
-	unsigned frame_count;
+	ofstream perf_file, psnr_file, psnr_csv_file;
 };
 
 VDXVF_BEGIN_SCRIPT_METHODS(FilterTemplate)
 VDXVF_DEFINE_SCRIPT_METHOD(FilterTemplate, ScriptConfig, "iiiiii")
+VDXVF_DEFINE_SCRIPT_METHOD2(FilterTemplate, ScriptConfig, "iiiiiii")
+VDXVF_DEFINE_SCRIPT_METHOD2(FilterTemplate, ScriptConfig, "iiiiiiii")
+VDXVF_DEFINE_SCRIPT_METHOD2(FilterTemplate, ScriptConfig, "iiiiiiiii")
+VDXVF_DEFINE_SCRIPT_METHOD2(FilterTemplate, ScriptConfig, "iiiiiiiiii")
+VDXVF_DEFINE_SCRIPT_METHOD2(FilterTemplate, ScriptConfig, "iiiiiiiiiii")
+VDXVF_DEFINE_SCRIPT_METHOD2(FilterTemplate, ScriptConfig, "iiiiiiiiiiii")
+VDXVF_DEFINE_SCRIPT_METHOD2(FilterTemplate, ScriptConfig, "iiiiiiiiiiiii")
+VDXVF_DEFINE_SCRIPT_METHOD2(FilterTemplate, ScriptConfig, "iiiiiiiiiiiiii")
 VDXVF_END_SCRIPT_METHODS()
 
-FilterTemplate::FilterTemplate() : VDXVideoFilter() {
+FilterTemplate::FilterTemplate() : VDXVideoFilter(), format(nsVDXPixmap::kPixFormat_XRGB8888) {
 }
 
 FilterTemplate::FilterTemplate(const FilterTemplate& other)
 	: VDXVideoFilter(other)
 	, width(other.width)
 	, height(other.height)
-	, num_blocks_hor(other.num_blocks_hor)
-	, num_blocks_vert(other.num_blocks_vert)
-	, width_ext(other.width_ext)
-	, height_ext(other.height_ext)
-	, cur_Y(new uint8[width_ext * height_ext])
-	, cur_U(new int16[width * height])
-	, cur_V(new int16[width * height])
+	, format(other.format)
 	, config(other.config) {
-	if (other.prev_Y) {
-		prev_Y = make_unique<uint8[]>(width_ext * height_ext);
-		prev_U = make_unique<int16[]>(width * height);
-		prev_V = make_unique<int16[]>(width * height);
-
-		memcpy(prev_Y.get(), other.prev_Y.get(), width_ext * height_ext);
-		memcpy(prev_U.get(), other.prev_U.get(), width * height * 2);
-		memcpy(prev_V.get(), other.prev_V.get(), width * height * 2);
-	}
-
-	if (other.prev_Y_up) {
-		prev_Y_up = make_unique<uint8[]>(width_ext * height_ext);
-		prev_Y_left = make_unique<uint8[]>(width_ext * height_ext);
-		prev_Y_upleft = make_unique<uint8[]>(width_ext * height_ext);
-		prev_U_up = make_unique<int16[]>(width * height);
-		prev_U_left = make_unique<int16[]>(width * height);
-		prev_U_upleft = make_unique<int16[]>(width * height);
-		prev_V_up = make_unique<int16[]>(width * height);
-		prev_V_left = make_unique<int16[]>(width * height);
-		prev_V_upleft = make_unique<int16[]>(width * height);
-
-		memcpy(prev_Y_up.get(), other.prev_Y_up.get(), width_ext * height_ext);
-		memcpy(prev_Y_left.get(), other.prev_Y_left.get(), width_ext * height_ext);
-		memcpy(prev_Y_upleft.get(), other.prev_Y_upleft.get(), width_ext * height_ext);
-		memcpy(prev_U_up.get(), other.prev_U_up.get(), width * height * 2);
-		memcpy(prev_U_left.get(), other.prev_U_left.get(), width * height * 2);
-		memcpy(prev_U_upleft.get(), other.prev_U_upleft.get(), width * height * 2);
-		memcpy(prev_V_up.get(), other.prev_V_up.get(), width * height * 2);
-		memcpy(prev_V_left.get(), other.prev_V_left.get(), width * height * 2);
-		memcpy(prev_V_upleft.get(), other.prev_V_upleft.get(), width * height * 2);
-	}
 }
 
 uint32 FilterTemplate::GetParams() {
 	if (g_VFVAPIVersion >= 12) {
+		// Planar YUV is read as it is, the output keeps the format of the source.
 		switch (fa->src.mpPixmapLayout->format) {
 		case nsVDXPixmap::kPixFormat_XRGB8888:
+		case nsVDXPixmap::kPixFormat_Y8:
+		case nsVDXPixmap::kPixFormat_YUV444_Planar:
+		case nsVDXPixmap::kPixFormat_YUV422_Planar:
+		case nsVDXPixmap::kPixFormat_YUV420_Planar:
 			break;
 
 		default:
@@ -381,7 +295,13 @@ uint32 FilterTemplate::GetParams() {
 	}
 
 	fa->dst.offset = 0;
-	return FILTERPARAM_SWAP_BUFFERS | FILTERPARAM_NEEDS_LAST;
+
+	const uint32 flags = FILTERPARAM_SWAP_BUFFERS | FILTERPARAM_NEEDS_LAST | FILTERPARAM_SUPPORTS_ALTFORMATS;
+
+	if (config.pipeline)
+		return flags | FILTERPARAM_HAS_LAG(FrameProcessor::PIPELINE_LAG);
+
+	return flags;
 }
 
 void FilterTemplate::Start() {
@@ -390,63 +310,31 @@ void FilterTemplate::Start() {
 
 		width = pxsrc.w;
 		height = pxsrc.h;
+		format = pxsrc.format;
 	} else {
 		width = fa->src.w;
 		height = fa->src.h;
+		format = nsVDXPixmap::kPixFormat_XRGB8888;
 	}
 
-	width_ext = width + 2 * MotionEstimator::BORDER;
-	height_ext = height + 2 * MotionEstimator::BORDER;
-
-	num_blocks_hor = (width + MotionEstimator::BLOCK_SIZE - 1) / MotionEstimator::BLOCK_SIZE;
-	num_blocks_vert = (height + MotionEstimator::BLOCK_SIZE - 1) / MotionEstimator::BLOCK_SIZE;
-
-	cur_Y = make_unique<uint8[]>(width_ext * height_ext);
-	cur_U = make_unique<int16[]>(width * height);
-	cur_V = make_unique<int16[]>(width * height);
-	prev_Y.reset();
-	prev_U.reset();
-	prev_V.reset();
-	prev_Y_up.reset();
-	prev_Y_left.reset();
-	prev_Y_upleft.reset();
-	prev_U_up.reset();
-	prev_U_left.reset();
-	prev_U_upleft.reset();
-	prev_V_up.reset();
-	prev_V_left.reset();
-	prev_V_upleft.reset();
-	cur_Y_MC.reset();
-	cur_U_MC.reset();
-	cur_V_MC.reset();
-
-	me = make_unique<MotionEstimator>(width, height, config.quality, config.use_half_pixel);
-	vectors = make_unique<MV[]>(num_blocks_hor * num_blocks_vert);
-
-	de = make_unique<DepthEstimator>(width, height, config.quality);
-	depth = make_unique<uint8[]>(width * height);
+	processor = make_unique<FrameProcessor>(width, height, config);
 
 	perf_file.open("DE_performance.log", std::ios::app);
 
 	if (config.measure_psnr) {
 		psnr_file.open("ME_PSNR.log", std::ios::app);
 
-		if (psnr_file)
-			psnr_file << "\n\n#: YPSNR, UPSNR, VPSNR\n";
-	}
+		if (psnr_file) {
+			psnr_file << (config.measure_ssim ? "\n\n#: YPSNR, UPSNR, VPSNR, YSSIM\n" : "\n\n#: YPSNR, UPSNR, VPSNR\n");
+			processor->SetPSNRLog(&psnr_file);
+		}
 
-	//total_rgbtoyuv = 0.0;
-	//total_borders = 0.0;
-	//total_output = 0.0;
-	total_me = 0.0;
-	total_de = 0.0;
-	//total_copy = 0.0;
-	
-	total_y_psnr = 0.0;
-	total_u_psnr = 0.0;
-	total_v_psnr = 0.0;
-
-	frame_count = 0;
+		// Machine-readable copy of the same values, one file per run.
+		psnr_csv_file.open("ME_PSNR.csv");
+
+		if (psnr_csv_file)
+			processor->SetPSNRCSV(&psnr_csv_file);
+	}
 }
 
 void FilterTemplate::Run() {
@@ -454,33 +342,37 @@ void FilterTemplate::Run() {
 		const VDXPixmap& pxdst = *fa->dst.mpPixmap;
 		const VDXPixmap& pxsrc = *fa->src.mpPixmap;
 
-		ProcessRGB32(pxdst.data, pxdst.pitch, pxsrc.data, pxsrc.pitch);
+		if (format == nsVDXPixmap::kPixFormat_XRGB8888)
+			ProcessRGB32(pxdst.data, pxdst.pitch, pxsrc.data, pxsrc.pitch);
+		else
+			ProcessPlanar(pxdst, pxsrc);
 	} else {
 		ProcessRGB32(fa->dst.data, fa->dst.pitch, fa->src.data, fa->src.pitch);
 	}
 }
 
 void FilterTemplate::End() {
-	if (!perf_file)
+	if (!perf_file || !processor)
 		return;
 
+	const auto& stats = processor->Stats();
+	const auto frame_count = stats.frame_count;
+
 	// frame_count > 2 is to prevent spamming the log.
 	// VirtualDub likes to call the filter for one or two frames.
 	if (frame_count > 2) {
 		perf_file.precision(6);
 		perf_file.setf(std::ios::fixed);
-		//perf_file << "RGB to YUV: " << total_rgbtoyuv / frame_count << '\n';
-		//perf_file << "Borders: " << total_borders / frame_count << '\n';
-		//perf_file << "ME: " << total_me / frame_count << '\n';
-		//perf_file << "Output: " << total_output / frame_count << '\n';
-		//perf_file << "Copy: " << total_copy / frame_count << '\n';
-		perf_file << "Average ME time (ms per frame): " << total_me / frame_count << '\n';
-		perf_file << "Average DE time (ms per frame): " << total_de / frame_count << '\n';
+		perf_file << "Average ME time (ms per frame): " << stats.total_me / frame_count << '\n';
+		perf_file << "Average DE time (ms per frame): " << stats.total_de / frame_count << '\n';
 
 		if (config.measure_psnr) {
-			perf_file << "Average ME Y PSNR: " << total_y_psnr / (frame_count - 1) << '\n';
-			perf_file << "Average ME U PSNR: " << total_u_psnr / (frame_count - 1) << '\n';
-			perf_file << "Average ME V PSNR: " << total_v_psnr / (frame_count - 1) << '\n';
+			perf_file << "Average ME Y PSNR: " << stats.total_y_psnr / stats.psnr_count << '\n';
+			perf_file << "Average ME U PSNR: " << stats.total_u_psnr / stats.psnr_count << '\n';
+			perf_file << "Average ME V PSNR: " << stats.total_v_psnr / stats.psnr_count << '\n';
+
+			if (config.measure_ssim)
+				perf_file << "Average ME Y SSIM: " << stats.total_y_ssim / stats.psnr_count << '\n';
 		}
 
 		perf_file << "Frame count: " << frame_count << '\n';
@@ -489,6 +381,8 @@ void FilterTemplate::End() {
 
 	perf_file.close();
 	psnr_file.close();
+	psnr_csv_file.close();
+	processor.reset();
 }
 
 bool FilterTemplate::Configure(VDXHWND hwnd) {
@@ -505,13 +399,21 @@ bool FilterTemplate::Configure(VDXHWND hwnd) {
 void FilterTemplate::GetScriptString(char* buf, int maxlen) {
 	SafePrintf(buf,
 	           maxlen,
-	           "Config(%d, %d, %d, %d, %d, %d)",
+	           "Config(%d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d)",
 	           static_cast<int>(config.output_type),
 	           config.show_vectors ? 1 : 0,
 	           config.draw_nothing ? 1 : 0,
 	           config.measure_psnr ? 1 : 0,
 	           config.quality,
-	           config.use_half_pixel ? 1 : 0);
+	           config.use_half_pixel ? 1 : 0,
+	           config.num_threads,
+	           config.pipeline ? 1 : 0,
+	           static_cast<int>(config.refinement),
+	           config.guided_radius,
+	           config.median_depth,
+	           config.measure_ssim ? 1 : 0,
+	           static_cast<int>(config.search),
+	           static_cast<int>(config.termination));
 }
 
 void FilterTemplate::ScriptConfig(IVDXScriptInterpreter *isi, const VDXScriptValue *argv, int argc) {
@@ -521,436 +423,197 @@ void FilterTemplate::ScriptConfig(IVDXScriptInterpreter *isi, const VDXScriptVal
 	config.measure_psnr = !!argv[3].asInt();
 	config.quality = clamp(argv[4].asInt(), 0, 100);
 	config.use_half_pixel = !!argv[5].asInt();
+
+	// Optional arguments, older scripts stop at six.
+	config.num_threads = argc > 6 ? clamp(argv[6].asInt(), 0, 256) : 1;
+	config.pipeline = argc > 7 ? !!argv[7].asInt() : false;
+	config.refinement = static_cast<DepthRefinement>(argc > 8 ? clamp(argv[8].asInt(), 0, 1) : 0);
+	config.guided_radius = argc > 9 ? clamp(argv[9].asInt(), 1, 64) : DepthEstimator::DEFAULT_GUIDED_RADIUS;
+	config.median_depth = argc > 10 ? clamp(argv[10].asInt(), MIN_MEDIAN_DEPTH, MAX_MEDIAN_DEPTH) | 1 : DepthEstimator::DEFAULT_MEDIAN_DEPTH;
+	config.measure_ssim = argc > 11 ? !!argv[11].asInt() : false;
+	config.search = static_cast<MotionSearch>(argc > 12 ? clamp(argv[12].asInt(), 0, 2) : 0);
+	config.termination = static_cast<EarlyTermination>(argc > 13 ? clamp(argv[13].asInt(), 0, 2) : 0);
 }
 
 void FilterTemplate::ProcessRGB32(void* dst0, ptrdiff_t dst_pitch, const void* src0, ptrdiff_t src_pitch) {
 	const uint8* src = static_cast<const uint8*>(src0);
 	uint8* dst = static_cast<uint8*>(dst0);
 
-	// Fill in cur_{Y,U,V}.
-	//auto start = chrono::steady_clock::now();
-	CopyFromSrc(src, src_pitch);
-	//auto end = chrono::steady_clock::now();
-	//total_rgbtoyuv += chrono::duration<double, std::milli>(end - start).count();
-
-	// Fill in the borders.
-	//start = chrono::steady_clock::now();
-	FillBorders();
-	//end = chrono::steady_clock::now();
-	//total_borders += chrono::duration<double, std::milli>(end - start).count();
-
-	// On the first frame, copy cur_{Y,U,V} to prev_{Y,U,V}.
-	if (!prev_Y || !prev_U || !prev_V) {
-		prev_Y = make_unique<uint8[]>(width_ext * height_ext);
-		prev_U = make_unique<int16[]>(width * height);
-		prev_V = make_unique<int16[]>(width * height);
-
-		memcpy(prev_Y.get(), cur_Y.get(), width_ext * height_ext);
-		memcpy(prev_U.get(), cur_U.get(), width * height * 2);
-		memcpy(prev_V.get(), cur_V.get(), width * height * 2);
-	}
-
-	// Half-pixel shifts.
-	if (config.use_half_pixel) {
-		if (!prev_Y_up) {
-			prev_Y_up = make_unique<uint8[]>(width_ext * height_ext);
-			prev_Y_left = make_unique<uint8[]>(width_ext * height_ext);
-			prev_Y_upleft = make_unique<uint8[]>(width_ext * height_ext);
-			prev_U_up = make_unique<int16[]>(width * height);
-			prev_U_left = make_unique<int16[]>(width * height);
-			prev_U_upleft = make_unique<int16[]>(width * height);
-			prev_V_up = make_unique<int16[]>(width * height);
-			prev_V_left = make_unique<int16[]>(width * height);
-			prev_V_upleft = make_unique<int16[]>(width * height);
-		}
-
-		memcpy(prev_Y_up.get(), prev_Y.get(), width_ext * height_ext);
-		memcpy(prev_Y_left.get(), prev_Y.get(), width_ext * height_ext);
-		memcpy(prev_Y_upleft.get(), prev_Y.get(), width_ext * height_ext);
-
-		HalfpixelShiftHorz(prev_Y_left.get(), width_ext, height_ext, false);
-		HalfpixelShift(prev_Y_up.get(), width_ext, height_ext, false);
-		HalfpixelShift(prev_Y_upleft.get(), width_ext, height_ext, false);
-		HalfpixelShiftHorz(prev_Y_upleft.get(), width_ext, height_ext, false);
-
-		memcpy(prev_U_up.get(), prev_U.get(), width * height * 2);
-		memcpy(prev_U_left.get(), prev_U.get(), width * height * 2);
-		memcpy(prev_U_upleft.get(), prev_U.get(), width * height * 2);
-
-		HalfpixelShiftHorz(prev_U_left.get(), width, height, false);
-		HalfpixelShift(prev_U_up.get(), width, height, false);
-		HalfpixelShift(prev_U_upleft.get(), width, height, false);
-		HalfpixelShiftHorz(prev_U_upleft.get(), width, height, false);
-
-		memcpy(prev_V_up.get(), prev_V.get(), width * height * 2);
-		memcpy(prev_V_left.get(), prev_V.get(), width * height * 2);
-		memcpy(prev_V_upleft.get(), prev_V.get(), width * height * 2);
+	processor->Process(
+		[&](uint8* p_Y, ptrdiff_t Y_pitch, int16* p_U, int16* p_V) {
+			CopyFromSrc(src, src_pitch, p_Y, Y_pitch, p_U, p_V);
+		},
+		[&](const OutputFrame* frame) {
+			if (frame)
+				DrawOutput(dst, dst_pitch, *frame);
+			else
+				ClearDst(dst, dst_pitch);
+		});
+}
 
-		HalfpixelShiftHorz(prev_V_left.get(), width, height, false);
-		HalfpixelShift(prev_V_up.get(), width, height, false);
-		HalfpixelShift(prev_V_upleft.get(), width, height, false);
-		HalfpixelShiftHorz(prev_V_upleft.get(), width, height, false);
-	}
+void FilterTemplate::CopyFromSrc(const uint8* src, ptrdiff_t src_pitch, uint8* p_Y, ptrdiff_t Y_pitch, int16* p_U, int16* p_V) {
+	ConvertXRGBToYUV(src, src_pitch, width, height, p_Y, Y_pitch, p_U, p_V);
+}
 
-	// Call the motion estimator.
-	EstimateMotion();
-
-	// Call the depth estimator.
-	EstimateDepth();
-
-	// Flag that we measured psnr in DrawOutput.
-	measured_psnr = false;
-	
-	// Fill in the output.
-	//start = chrono::steady_clock::now();
-	if (!config.draw_nothing)
-		DrawOutput(dst, dst_pitch);
-	//end = chrono::steady_clock::now();
-	//total_output += chrono::duration<double, std::milli>(end - start).count();
-
-	// Measure PSNR here if we didn't do it before.
-	if (config.measure_psnr && !measured_psnr) {
-		if (!cur_Y_MC || !cur_U_MC || !cur_V_MC) {
-			cur_Y_MC = make_unique<uint8[]>(width * height);
-			cur_U_MC = make_unique<int16[]>(width * height);
-			cur_V_MC = make_unique<int16[]>(width * height);
-		}
+void FilterTemplate::DrawOutput(uint8* dst, ptrdiff_t dst_pitch, const OutputFrame& frame) {
+	if (frame.subtract_Y)
+		ConvertResidualToXRGB(frame.Y, frame.Y_pitch, frame.U, frame.V,
+		                      frame.subtract_Y, frame.subtract_Y_pitch, frame.subtract_U, frame.subtract_V,
+		                      width, height, dst, dst_pitch);
+	else if (frame.U && frame.V)
+		ConvertYUVToXRGB(frame.Y, frame.Y_pitch, frame.U, frame.V, width, height, dst, dst_pitch);
+	else
+		ConvertGreyToXRGB(frame.Y, frame.Y_pitch, width, height, dst, dst_pitch);
 
-		CompensateMotion();
-		MeasurePSNR();
+	if (config.show_vectors) {
+		frame.vectors->ForEachLeaf([&](int x, int y, const MV& mv) {
+			DrawLine(dst, dst_pitch, x, y, x + mv.x, y + mv.y);
+		});
 	}
-
-	// Copy cur_{Y,U,V} to prev_{Y,U,V}.
-	//start = chrono::steady_clock::now();
-	memcpy(prev_Y.get(), cur_Y.get(), width_ext * height_ext);
-	memcpy(prev_U.get(), cur_U.get(), width * height * 2);
-	memcpy(prev_V.get(), cur_V.get(), width * height * 2);
-	//end = chrono::steady_clock::now();
-	//total_copy += chrono::duration<double, std::milli>(end - start).count();
-
-	++frame_count;
 }
 
-void FilterTemplate::CopyFromSrc(const uint8* src, ptrdiff_t src_pitch) {
-	auto p_cur_Y = cur_Y.get() + width_ext * MotionEstimator::BORDER + MotionEstimator::BORDER;
-	auto p_cur_U = cur_U.get();
-	auto p_cur_V = cur_V.get();
-
+void FilterTemplate::ClearDst(uint8* dst, ptrdiff_t dst_pitch) {
 	for (sint32 y = 0; y < height; ++y) {
-		auto p_src = src;
-
-		for (sint32 x = 0; x < width; ++x) {
-			auto b = p_src[0];
-			auto g = p_src[1];
-			auto r = p_src[2];
-
-			RGBToYUV(r, g, b, *p_cur_Y, *p_cur_U, *p_cur_V);
-
-			++p_cur_Y;
-			++p_cur_U;
-			++p_cur_V;
-			p_src += 4;
-		}
-
-		p_cur_Y += 2 * MotionEstimator::BORDER;
-		src += src_pitch;
+		memset(dst, 0, width * 4);
+		dst += dst_pitch;
 	}
 }
 
-void FilterTemplate::FillBorders() {
-	// Left and right borders.
-	auto p_cur_Y = cur_Y.get() + width_ext * MotionEstimator::BORDER;
-
-	for (sint32 y = 0; y < height; ++y) {
-		memset(p_cur_Y, p_cur_Y[MotionEstimator::BORDER], MotionEstimator::BORDER);
-		p_cur_Y += MotionEstimator::BORDER + width;
-		memset(p_cur_Y, p_cur_Y[-1], MotionEstimator::BORDER);
-		p_cur_Y += MotionEstimator::BORDER;
-	}
+void FilterTemplate::ProcessPlanar(const VDXPixmap& dst, const VDXPixmap& src) {
+	processor->Process(
+		[&](uint8* p_Y, ptrdiff_t Y_pitch, int16* p_U, int16* p_V) {
+			CopyFromPlanarSrc(src, p_Y, Y_pitch, p_U, p_V);
+		},
+		[&](const OutputFrame* frame) {
+			if (frame)
+				DrawPlanarOutput(dst, *frame);
+			else
+				ClearPlanarDst(dst);
+		});
+}
 
-	// Top and bottom borders.
-	p_cur_Y = cur_Y.get();
-	auto p_cur_Y_row = p_cur_Y + width_ext * MotionEstimator::BORDER;
+void FilterTemplate::CopyFromPlanarSrc(const VDXPixmap& src, uint8* p_Y, ptrdiff_t Y_pitch, int16* p_U, int16* p_V) {
+	auto src_Y = static_cast<const uint8*>(src.data);
 
-	for (sint32 y = 0; y < MotionEstimator::BORDER; ++y) {
-		memcpy(p_cur_Y, p_cur_Y_row, width_ext);
-		p_cur_Y += width_ext;
+	for (sint32 y = 0; y < height; ++y) {
+		memcpy(p_Y, src_Y, width);
+		p_Y += Y_pitch;
+		src_Y += src.pitch;
 	}
 
-	p_cur_Y += width_ext * height;
-	p_cur_Y_row = p_cur_Y - width_ext;
-
-	for (sint32 y = 0; y < MotionEstimator::BORDER; ++y) {
-		memcpy(p_cur_Y, p_cur_Y_row, width_ext);
-		p_cur_Y += width_ext;
+	if (format == nsVDXPixmap::kPixFormat_Y8) {
+		memset(p_U, 0, width * height * sizeof(int16));
+		memset(p_V, 0, width * height * sizeof(int16));
+		return;
 	}
-}
-
-void FilterTemplate::EstimateMotion() {
-	const auto start = chrono::steady_clock::now();
 
-	me->Estimate(cur_Y.get(),
-	             prev_Y.get(),
-	             prev_Y_up.get(),
-	             prev_Y_left.get(),
-	             prev_Y_upleft.get(),
-	             vectors.get());
+	int shift_x, shift_y;
+	ChromaShifts(format, shift_x, shift_y);
 
-	const auto end = chrono::steady_clock::now();
-	total_me += chrono::duration<double, std::milli>(end - start).count();
+	ExpandChroma(static_cast<const uint8*>(src.data2), src.pitch2, shift_x, shift_y, width, height, p_U);
+	ExpandChroma(static_cast<const uint8*>(src.data3), src.pitch3, shift_x, shift_y, width, height, p_V);
 }
 
-void FilterTemplate::EstimateDepth() {
-	const auto start = chrono::steady_clock::now();
-
-	de->Estimate(cur_Y.get(),
-	             cur_U.get(),
-	             cur_V.get(),
-	             vectors.get(),
-	             depth.get());
-
-	const auto end = chrono::steady_clock::now();
-	total_de += chrono::duration<double, std::milli>(end - start).count();
-}
+void FilterTemplate::DrawPlanarOutput(const VDXPixmap& dst, const OutputFrame& frame) {
+	auto dst_Y = static_cast<uint8*>(dst.data);
 
-void FilterTemplate::DrawOutput(uint8* dst, ptrdiff_t dst_pitch) {
-	const uint8* p_Y;
-	const int16* p_U;
-	const int16* p_V;
-	ptrdiff_t Y_gap;
-
-	if (config.output_type == OutputType::SOURCE) {
-		p_Y = cur_Y.get() + width_ext * MotionEstimator::BORDER + MotionEstimator::BORDER;
-		p_U = cur_U.get();
-		p_V = cur_V.get();
-		Y_gap = 2 * MotionEstimator::BORDER;
-	} else if (config.output_type == OutputType::DEPTH) {
-		p_Y = depth.get();
-		p_U = nullptr;
-		p_V = nullptr;
-		Y_gap = 0;
-	} else {
-		if (!cur_Y_MC || !cur_U_MC || !cur_V_MC) {
-			cur_Y_MC = make_unique<uint8[]>(width * height);
-			cur_U_MC = make_unique<int16[]>(width * height);
-			cur_V_MC = make_unique<int16[]>(width * height);
-		}
+	for (sint32 y = 0; y < height; ++y) {
+		const auto row = frame.Y + y * frame.Y_pitch;
+		const auto out = dst_Y + y * dst.pitch;
 
-		if (config.output_type != OutputType::RESIDUAL_BEFORE_MC || config.measure_psnr)
-			CompensateMotion();
+		if (frame.subtract_Y) {
+			const auto base_row = frame.subtract_Y + y * frame.subtract_Y_pitch;
 
-		if (config.measure_psnr) {
-			MeasurePSNR();
-			measured_psnr = true;
+			for (sint32 x = 0; x < width; ++x)
+				out[x] = static_cast<uint8>(clamp(128 + (int{row[x]} - base_row[x]) * 3, 0, 255));
+		} else {
+			memcpy(out, row, width);
 		}
+	}
 
-		if (config.output_type == OutputType::RESIDUAL_BEFORE_MC) {
-			// We don't use the compensated frame here, simply copy the previous one.
-			auto prev = prev_Y.get() + width_ext * MotionEstimator::BORDER + MotionEstimator::BORDER;;
-			auto p_Y_MC = cur_Y_MC.get();
+	if (format != nsVDXPixmap::kPixFormat_Y8) {
+		int shift_x, shift_y;
+		ChromaShifts(format, shift_x, shift_y);
 
-			for (sint32 y = 0; y < height; ++y) {
-				memcpy(p_Y_MC, prev, width);
-				prev += width_ext;
-				p_Y_MC += width;
-			}
+		auto dst_U = static_cast<uint8*>(dst.data2);
+		auto dst_V = static_cast<uint8*>(dst.data3);
 
-			memcpy(cur_U_MC.get(), prev_U.get(), width * height * 2);
-			memcpy(cur_V_MC.get(), prev_V.get(), width * height * 2);
-		}
+		if (frame.subtract_Y) {
+			// Residual output: the amplified difference of the samples kept.
+			for (sint32 y = 0; y < height; y += 1 << shift_y) {
+				for (sint32 x = 0; x < width; x += 1 << shift_x) {
+					const auto i = y * width + x;
+					const auto u = static_cast<int16>((frame.U[i] - frame.subtract_U[i]) * 3);
+					const auto v = static_cast<int16>((frame.V[i] - frame.subtract_V[i]) * 3);
 
-		// For residuals, subtract the current frame.
-		if (config.output_type == OutputType::RESIDUAL_BEFORE_MC
-			|| config.output_type == OutputType::RESIDUAL_AFTER_MC) {
-			auto p_Y_MC = cur_Y_MC.get();
-			auto p_U_MC = cur_U_MC.get();
-			auto p_V_MC = cur_V_MC.get();
-
-			auto p_Y_cur = cur_Y.get() + width_ext * MotionEstimator::BORDER + MotionEstimator::BORDER;
-			auto p_U_cur = cur_U.get();
-			auto p_V_cur = cur_V.get();
-
-			for (sint32 y = 0; y < height; ++y) {
-				for (sint32 x = 0; x < width; ++x) {
-					*p_Y_MC = static_cast<uint8>(clamp(128 + (int{*p_Y_MC} - *p_Y_cur) * 3, 0, 255));
-					*p_U_MC = (*p_U_MC - *p_U_cur) * 3;
-					*p_V_MC = (*p_V_MC - *p_V_cur) * 3;
-
-					++p_Y_MC;
-					++p_U_MC;
-					++p_V_MC;
-					++p_Y_cur;
-					++p_U_cur;
-					++p_V_cur;
+					dst_U[x >> shift_x] = static_cast<uint8>(clamp(u + 128, 0, 255));
+					dst_V[x >> shift_x] = static_cast<uint8>(clamp(v + 128, 0, 255));
 				}
 
-				p_Y_cur += 2 * MotionEstimator::BORDER;
+				dst_U += dst.pitch2;
+				dst_V += dst.pitch3;
+			}
+		} else if (frame.U && frame.V) {
+			SubsampleChroma(frame.U, shift_x, shift_y, width, height, dst_U, dst.pitch2);
+			SubsampleChroma(frame.V, shift_x, shift_y, width, height, dst_V, dst.pitch3);
+		} else {
+			const auto chroma_width = (width + (1 << shift_x) - 1) >> shift_x;
+
+			for (sint32 y = 0; y < height; y += 1 << shift_y) {
+				memset(dst_U, 128, chroma_width);
+				memset(dst_V, 128, chroma_width);
+				dst_U += dst.pitch2;
+				dst_V += dst.pitch3;
 			}
 		}
-
-		p_Y = cur_Y_MC.get();
-		p_U = cur_U_MC.get();
-		p_V = cur_V_MC.get();
-		Y_gap = 0;
 	}
 
-	if (p_U && p_V)
-		CopyToDst(dst, dst_pitch, p_Y, Y_gap, p_U, p_V);
-	else
-		CopyYToDst(dst, dst_pitch, p_Y, Y_gap);
-
 	if (config.show_vectors) {
-		for (sint32 i = 0; i < num_blocks_vert; ++i) {
-			for (sint32 j = 0; j < num_blocks_hor; ++j) {
-				auto mv = vectors[i * num_blocks_hor + j];
-
-				if (!mv.IsSplit()) {
-					DrawLine(dst,
-					         dst_pitch,
-					         j * MotionEstimator::BLOCK_SIZE + MotionEstimator::BLOCK_SIZE / 2,
-					         i * MotionEstimator::BLOCK_SIZE + MotionEstimator::BLOCK_SIZE / 2,
-					         j * MotionEstimator::BLOCK_SIZE + MotionEstimator::BLOCK_SIZE / 2 + mv.x,
-					         i * MotionEstimator::BLOCK_SIZE + MotionEstimator::BLOCK_SIZE / 2 + mv.y);
-				} else {
-					for (int h = 0; h < 4; ++h) {
-						const auto mv_ = mv.SubVector(h);
-						const auto x = j * MotionEstimator::BLOCK_SIZE + MotionEstimator::BLOCK_SIZE / 2
-							+ (h & 1 ? 1 : -1) * (MotionEstimator::BLOCK_SIZE / 4);
-						const auto y = i * MotionEstimator::BLOCK_SIZE + MotionEstimator::BLOCK_SIZE / 2
-							+ (h > 1 ? 1 : -1) * (MotionEstimator::BLOCK_SIZE / 4);
-
-						DrawLine(dst,
-						         dst_pitch,
-						         x,
-						         y,
-						         x + mv_.x,
-						         y + mv_.y);
-					}
-				}
-			}
-		}
+		frame.vectors->ForEachLeaf([&](int x, int y, const MV& mv) {
+			DrawLineY(dst_Y, dst.pitch, x, y, x + mv.x, y + mv.y);
+		});
 	}
 }
 
-void FilterTemplate::CompensateMotion() {
-	auto p_Y_MC = cur_Y_MC.get();
-	auto p_U_MC = cur_U_MC.get();
-	auto p_V_MC = cur_V_MC.get();
+void FilterTemplate::ClearPlanarDst(const VDXPixmap& dst) {
+	auto dst_Y = static_cast<uint8*>(dst.data);
 
 	for (sint32 y = 0; y < height; ++y) {
-		for (sint32 x = 0; x < width; ++x) {
-			const auto i = (y / MotionEstimator::BLOCK_SIZE);
-			const auto j = (x / MotionEstimator::BLOCK_SIZE);
-			auto mv = vectors[i * num_blocks_hor + j];
-
-			if (mv.IsSplit()) {
-				const auto h = (((y % MotionEstimator::BLOCK_SIZE) < (MotionEstimator::BLOCK_SIZE / 2)) ? 0 : 2)
-					+ (((x % MotionEstimator::BLOCK_SIZE) < (MotionEstimator::BLOCK_SIZE / 2)) ? 0 : 1);
-				mv = mv.SubVector(h);
-			}
-
-			uint8* p_Y;
-			int16* p_U;
-			int16* p_V;
-
-			switch (mv.shift_dir) {
-			default:
-			case ShiftDir::NONE:
-				p_Y = prev_Y.get();
-				p_U = prev_U.get();
-				p_V = prev_V.get();
-				break;
-
-			case ShiftDir::UP:
-				p_Y = prev_Y_up.get();
-				p_U = prev_U_up.get();
-				p_V = prev_V_up.get();
-				break;
-
-			case ShiftDir::LEFT:
-				p_Y = prev_Y_left.get();
-				p_U = prev_U_left.get();
-				p_V = prev_V_left.get();
-				break;
-
-			case ShiftDir::UPLEFT:
-				p_Y = prev_Y_upleft.get();
-				p_U = prev_U_upleft.get();
-				p_V = prev_V_upleft.get();
-				break;
-			}
-
-			p_Y += width_ext * MotionEstimator::BORDER + MotionEstimator::BORDER
-				+ y * width_ext + x;
-			p_U += y * width + x;
-			p_V += y * width + x;
-
-			int sh_x, sh_y;
-			if (x + mv.x < 0)
-				sh_x = -x;
-			else if (x + mv.x >= width)
-				sh_x = width - 1 - x;
-			else
-				sh_x = mv.x;
-
-			if (y + mv.y < 0)
-				sh_y = -y;
-			else if (y + mv.y >= height)
-				sh_y = height - 1 - y;
-			else
-				sh_y = mv.y;
-
-			*p_Y_MC = p_Y[sh_y * width_ext + sh_x];
-			*p_U_MC = p_U[sh_y * width + sh_x];
-			*p_V_MC = p_V[sh_y * width + sh_x];
-
-			++p_Y_MC;
-			++p_U_MC;
-			++p_V_MC;
-		}
+		memset(dst_Y, 0, width);
+		dst_Y += dst.pitch;
 	}
-}
-
-void FilterTemplate::CopyToDst(uint8* dst, ptrdiff_t dst_pitch, const uint8* p_Y, ptrdiff_t Y_gap, const int16* p_U, const int16* p_V) {
-	for (sint32 y = 0; y < height; ++y) {
-		auto p_dst = dst;
 
-		for (sint32 x = 0; x < width; ++x) {
-			uint8 r, g, b;
-			YUVToRGB(*p_Y, *p_U, *p_V, r, g, b);
+	if (format == nsVDXPixmap::kPixFormat_Y8)
+		return;
 
-			p_dst[0] = b;
-			p_dst[1] = g;
-			p_dst[2] = r;
-			p_dst[3] = 0;
+	int shift_x, shift_y;
+	ChromaShifts(format, shift_x, shift_y);
 
-			++p_Y;
-			++p_U;
-			++p_V;
-			p_dst += 4;
-		}
+	const auto chroma_width = (width + (1 << shift_x) - 1) >> shift_x;
+	auto dst_U = static_cast<uint8*>(dst.data2);
+	auto dst_V = static_cast<uint8*>(dst.data3);
 
-		p_Y += Y_gap;
-		dst += dst_pitch;
+	for (sint32 y = 0; y < height; y += 1 << shift_y) {
+		memset(dst_U, 128, chroma_width);
+		memset(dst_V, 128, chroma_width);
+		dst_U += dst.pitch2;
+		dst_V += dst.pitch3;
 	}
 }
 
-void FilterTemplate::CopyYToDst(uint8* dst, ptrdiff_t dst_pitch, const uint8* p_Y, ptrdiff_t Y_gap) {
-	for (sint32 y = 0; y < height; ++y) {
-		auto p_dst = dst;
+// Luma only: white over dark pixels and black over light ones, the origin always white.
+void FilterTemplate::DrawLineY(uint8* dst_Y, ptrdiff_t dst_pitch, sint32 x1, sint32 y1, sint32 x2, sint32 y2) {
+	const auto steps = max(abs(x2 - x1), abs(y2 - y1));
 
-		for (sint32 x = 0; x < width; ++x) {
-			p_dst[0] = *p_Y;
-			p_dst[1] = *p_Y;
-			p_dst[2] = *p_Y;
-			p_dst[3] = 0;
+	for (sint32 i = 0; i <= steps; ++i) {
+		const auto x = steps ? x1 + (x2 - x1) * i / steps : x1;
+		const auto y = steps ? y1 + (y2 - y1) * i / steps : y1;
 
-			++p_Y;
-			p_dst += 4;
-		}
+		if (x < 0 || x >= width || y < 0 || y >= height)
+			continue;
 
-		p_Y += Y_gap;
-		dst += dst_pitch;
+		auto& pixel = dst_Y[y * dst_pitch + x];
+		pixel = (i == 0 || pixel < 128) ? 255 : 0;
 	}
 }
 
@@ -1072,54 +735,4 @@ void FilterTemplate::DrawLine(uint8* dst, ptrdiff_t dst_pitch, sint32 x1, sint32
 	}
 }
 
-void FilterTemplate::MeasurePSNR() {
-	if (frame_count == 0)
-		return;
-
-	// Calculate MSE.
-	double YMSE = 0.0, UMSE = 0.0, VMSE = 0.0;
-
-	auto p_Y_MC = cur_Y_MC.get();
-	auto p_U_MC = cur_U_MC.get();
-	auto p_V_MC = cur_V_MC.get();
-
-	auto p_Y_cur = cur_Y.get() + width_ext * MotionEstimator::BORDER + MotionEstimator::BORDER;
-	auto p_U_cur = cur_U.get();
-	auto p_V_cur = cur_V.get();
-
-	for (sint32 y = 0; y < height; ++y) {
-		for (sint32 x = 0; x < width; ++x) {
-			auto diff = int{*p_Y_cur} - *p_Y_MC;
-			YMSE += diff * diff;
-
-			diff = int{*p_U_cur} - *p_U_MC;
-			UMSE += diff * diff;
-
-			diff = int{*p_V_cur} - *p_V_MC;
-			VMSE += diff * diff;
-
-			++p_Y_MC;
-			++p_U_MC;
-			++p_V_MC;
-			++p_Y_cur;
-			++p_U_cur;
-			++p_V_cur;
-		}
-
-		p_Y_cur += 2 * MotionEstimator::BORDER;
-	}
-
-	// Calculate PSNR.
-	const auto YPSNR = PSNR(YMSE, width, height);
-	const auto UPSNR = PSNR(UMSE, width, height);
-	const auto VPSNR = PSNR(VMSE, width, height);
-
-	if (psnr_file)
-		psnr_file << frame_count << ": " << YPSNR << ' ' << UPSNR << ' ' << VPSNR << '\n';
-
-	total_y_psnr += YPSNR;
-	total_u_psnr += UPSNR;
-	total_v_psnr += VPSNR;
-}
-
 extern VDXFilterDefinition filterDef_template = VDXVideoFilterDefinition<FilterTemplate>(FILTER_AUTHOR, FILTER_NAME, "DE task filter");
@@ -0,0 +1,472 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <future>
+
+#include "frame_processor.hpp"
+#include "half_pixel.hpp"
+#include "ssim.hpp"
+
+namespace chrono = std::chrono;
+
+template<typename T>
+inline static T clamp(T value, T a, T b) {
+	if (value >= b)
+		return b;
+
+	if (value <= a)
+		return a;
+
+	return value;
+}
+
+inline static double PSNR(double MSE, int w, int h) {
+	return 10 * log10(w * h * 255.0 * 255.0 / MSE);
+}
+
+FrameProcessor::FrameProcessor(int width, int height, const FilterTemplateConfig& config)
+	: width(width)
+	, height(height)
+	, width_ext(width + 2 * MotionEstimator::BORDER)
+	, height_ext(height + 2 * MotionEstimator::BORDER)
+	, num_blocks_hor((width + MotionEstimator::BLOCK_SIZE - 1) / MotionEstimator::BLOCK_SIZE)
+	, num_blocks_vert((height + MotionEstimator::BLOCK_SIZE - 1) / MotionEstimator::BLOCK_SIZE)
+	, config(config)
+	, frames(config.pipeline ? PIPELINE_FRAMES : 2)
+	, step_count(0)
+	, measured_psnr(false)
+	, psnr_log(nullptr)
+	, psnr_csv(nullptr) {
+	for (auto& frame : frames)
+		AllocateFrame(frame);
+
+	me = std::make_unique<MotionEstimator>(width, height, config.quality, config.use_half_pixel, config.num_threads, config.search, config.termination);
+	de = std::make_unique<DepthEstimator>(width, height, config.quality, config.refinement, config.guided_radius, config.median_depth);
+
+	if (config.pipeline)
+		stage_pool = std::make_unique<ThreadPool>(3);
+}
+
+FrameProcessor::~FrameProcessor() {
+}
+
+void FrameProcessor::SetPSNRCSV(std::ostream* csv) {
+	psnr_csv = csv;
+
+	if (psnr_csv && *psnr_csv)
+		*psnr_csv << (config.measure_ssim ? "frame,y_psnr,u_psnr,v_psnr,y_ssim\n" : "frame,y_psnr,u_psnr,v_psnr\n");
+}
+
+void FrameProcessor::Process(const InputFunc& input, const OutputFunc& output) {
+	if (config.pipeline)
+		ProcessPipelined(&input, output);
+	else
+		ProcessSequential(input, output);
+
+	++stats.frame_count;
+}
+
+void FrameProcessor::Flush(const OutputFunc& output) {
+	if (!config.pipeline)
+		return;
+
+	for (int i = 0; i < PIPELINE_LAG; ++i)
+		ProcessPipelined(nullptr, output);
+}
+
+void FrameProcessor::ProcessSequential(const InputFunc& input, const OutputFunc& output) {
+	// The two frames take turns, so the current frame becomes the reference without copying it.
+	const auto n = stats.frame_count;
+	auto& cur = frames[n % 2];
+
+	// Fill in cur_{Y,U,V} and the borders.
+	ReadInput(cur, input);
+	cur.number = n;
+
+	// The first frame is its own reference.
+	auto& prev = n >= 1 ? frames[(n - 1) % 2] : cur;
+
+	// Half-pixel shifts.
+	if (config.use_half_pixel)
+		PrepareHalfPixel(prev);
+
+	// Call the motion estimator.
+	EstimateMotion(cur, prev);
+
+	// Depth, output and PSNR.
+	ProduceOutput(cur, prev, output);
+}
+
+// Frame n is converted while frame n-1 goes through ME and frame n-2 through DE and output.
+// Each stage only writes to its own frame, so the three can run at the same time.
+// Without input (flushing), only the stages of frames already passed in run.
+void FrameProcessor::ProcessPipelined(const InputFunc* input, const OutputFunc& output) {
+	const auto n = step_count++;
+	const auto num_inputs = stats.frame_count;
+
+	std::future<void> convert;
+
+	if (input) {
+		auto& in = frames[n % PIPELINE_FRAMES];
+
+		convert = stage_pool->Submit([this, &in, input, n]() {
+			ReadInput(in, *input);
+			in.number = n;
+		});
+	}
+
+	std::future<void> motion;
+
+	if (n >= 1 && n - 1 < num_inputs) {
+		auto& cur = frames[(n - 1) % PIPELINE_FRAMES];
+		auto& ref = n >= 2 ? frames[(n - 2) % PIPELINE_FRAMES] : cur;
+
+		motion = stage_pool->Submit([this, &cur, &ref]() {
+			if (config.use_half_pixel)
+				PrepareHalfPixel(ref);
+
+			EstimateMotion(cur, ref);
+		});
+	}
+
+	if (n >= PIPELINE_LAG && n - PIPELINE_LAG < num_inputs) {
+		auto& cur = frames[(n - PIPELINE_LAG) % PIPELINE_FRAMES];
+		auto& ref = n >= PIPELINE_LAG + 1 ? frames[(n - PIPELINE_LAG - 1) % PIPELINE_FRAMES] : cur;
+
+		ProduceOutput(cur, ref, output);
+	} else if (input && !config.draw_nothing) {
+		// Nothing has made it through the pipeline yet.
+		output(nullptr);
+	}
+
+	if (convert.valid())
+		convert.get();
+
+	if (motion.valid())
+		motion.get();
+}
+
+void FrameProcessor::AllocateFrame(Frame& frame) {
+	frame.Y = std::make_unique<uint8_t[]>(width_ext * height_ext);
+	frame.U = std::make_unique<int16_t[]>(width * height);
+	frame.V = std::make_unique<int16_t[]>(width * height);
+	frame.half_pixel_ready = false;
+	frame.chroma_half_pixel_ready = false;
+
+	if (config.use_half_pixel)
+		frame.Y_half = std::make_unique<HalfpixelCache>(width_ext, height_ext);
+
+	if (config.search == MotionSearch::HIERARCHICAL)
+		frame.pyramid = std::make_unique<LumaPyramid>(width, height);
+
+	// Shifted chroma is only read by motion compensation, which not every output needs.
+	const auto compensates = config.measure_psnr
+		|| config.output_type == OutputType::RESIDUAL_AFTER_MC
+		|| config.output_type == OutputType::COMPENSATED;
+
+	if (config.use_half_pixel && compensates) {
+		frame.U_up = std::make_unique<int16_t[]>(width * height);
+		frame.U_left = std::make_unique<int16_t[]>(width * height);
+		frame.U_upleft = std::make_unique<int16_t[]>(width * height);
+		frame.V_up = std::make_unique<int16_t[]>(width * height);
+		frame.V_left = std::make_unique<int16_t[]>(width * height);
+		frame.V_upleft = std::make_unique<int16_t[]>(width * height);
+	}
+
+	frame.vectors = MVField(num_blocks_hor, num_blocks_vert);
+	frame.depth = std::make_unique<uint8_t[]>(width * height);
+	frame.number = 0;
+}
+
+void FrameProcessor::ReadInput(Frame& frame, const InputFunc& input) {
+	const auto start = chrono::steady_clock::now();
+
+	input(frame.Y.get() + width_ext * MotionEstimator::BORDER + MotionEstimator::BORDER,
+	      width_ext,
+	      frame.U.get(),
+	      frame.V.get());
+
+	FillBorders(frame);
+	frame.half_pixel_ready = false;
+	frame.chroma_half_pixel_ready = false;
+
+	const auto end = chrono::steady_clock::now();
+	stats.total_input += chrono::duration<double, std::milli>(end - start).count();
+}
+
+void FrameProcessor::FillBorders(Frame& frame) {
+	// Left and right borders.
+	auto p_cur_Y = frame.Y.get() + width_ext * MotionEstimator::BORDER;
+
+	for (int y = 0; y < height; ++y) {
+		memset(p_cur_Y, p_cur_Y[MotionEstimator::BORDER], MotionEstimator::BORDER);
+		p_cur_Y += MotionEstimator::BORDER + width;
+		memset(p_cur_Y, p_cur_Y[-1], MotionEstimator::BORDER);
+		p_cur_Y += MotionEstimator::BORDER;
+	}
+
+	// Top and bottom borders.
+	p_cur_Y = frame.Y.get();
+	auto p_cur_Y_row = p_cur_Y + width_ext * MotionEstimator::BORDER;
+
+	for (int y = 0; y < MotionEstimator::BORDER; ++y) {
+		memcpy(p_cur_Y, p_cur_Y_row, width_ext);
+		p_cur_Y += width_ext;
+	}
+
+	p_cur_Y += width_ext * height;
+	p_cur_Y_row = p_cur_Y - width_ext;
+
+	for (int y = 0; y < MotionEstimator::BORDER; ++y) {
+		memcpy(p_cur_Y, p_cur_Y_row, width_ext);
+		p_cur_Y += width_ext;
+	}
+}
+
+// Only invalidates the luma tiles, the motion search interpolates the ones it needs.
+void FrameProcessor::PrepareHalfPixel(Frame& ref) {
+	if (ref.half_pixel_ready)
+		return;
+
+	ref.Y_half->Reset(ref.Y.get());
+	ref.half_pixel_ready = true;
+}
+
+void FrameProcessor::PrepareHalfPixelChroma(Frame& ref) {
+	if (ref.chroma_half_pixel_ready)
+		return;
+
+	HalfpixelInterpolate(ref.U.get(), width, height, ref.U_up.get(), ref.U_left.get(), ref.U_upleft.get());
+	HalfpixelInterpolate(ref.V.get(), width, height, ref.V_up.get(), ref.V_left.get(), ref.V_upleft.get());
+
+	ref.chroma_half_pixel_ready = true;
+}
+
+void FrameProcessor::EstimateMotion(Frame& cur, const Frame& ref) {
+	const auto start = chrono::steady_clock::now();
+
+	// Every frame is estimated before it becomes the reference, the first one against itself.
+	if (cur.pyramid)
+		cur.pyramid->Build(cur.Y.get() + width_ext * MotionEstimator::BORDER + MotionEstimator::BORDER, width_ext);
+
+	me->Estimate(cur.Y.get(),
+	             ref.Y.get(),
+	             ref.Y_half.get(),
+	             cur.pyramid.get(),
+	             ref.pyramid.get(),
+	             cur.vectors);
+
+	const auto end = chrono::steady_clock::now();
+	stats.total_me += chrono::duration<double, std::milli>(end - start).count();
+}
+
+void FrameProcessor::EstimateDepth(Frame& cur) {
+	const auto start = chrono::steady_clock::now();
+
+	de->Estimate(cur.Y.get(),
+	             cur.U.get(),
+	             cur.V.get(),
+	             cur.vectors,
+	             cur.depth.get());
+
+	const auto end = chrono::steady_clock::now();
+	stats.total_de += chrono::duration<double, std::milli>(end - start).count();
+}
+
+void FrameProcessor::ProduceOutput(Frame& cur, Frame& ref, const OutputFunc& output) {
+	// Call the depth estimator.
+	EstimateDepth(cur);
+
+	// Flag that we measured psnr in RenderOutput.
+	measured_psnr = false;
+
+	// Fill in the output.
+	if (!config.draw_nothing) {
+		const auto start = chrono::steady_clock::now();
+
+		const auto frame = RenderOutput(cur, ref);
+		output(&frame);
+
+		const auto end = chrono::steady_clock::now();
+		stats.total_output += chrono::duration<double, std::milli>(end - start).count();
+	}
+
+	// Measure PSNR here if we didn't do it before, the compensated frame itself is not needed.
+	if (config.measure_psnr && !measured_psnr)
+		CompensateMotion(cur, ref, false, true);
+}
+
+OutputFrame FrameProcessor::RenderOutput(const Frame& cur, Frame& ref) {
+	OutputFrame frame;
+	frame.subtract_Y = nullptr;
+	frame.subtract_Y_pitch = 0;
+	frame.subtract_U = nullptr;
+	frame.subtract_V = nullptr;
+	frame.vectors = &cur.vectors;
+	frame.number = cur.number;
+
+	if (config.output_type == OutputType::SOURCE) {
+		frame.Y = cur.Y.get() + width_ext * MotionEstimator::BORDER + MotionEstimator::BORDER;
+		frame.Y_pitch = width_ext;
+		frame.U = cur.U.get();
+		frame.V = cur.V.get();
+		return frame;
+	}
+
+	if (config.output_type == OutputType::DEPTH) {
+		frame.Y = cur.depth.get();
+		frame.Y_pitch = width;
+		frame.U = nullptr;
+		frame.V = nullptr;
+		return frame;
+	}
+
+	// PSNR is measured in the same pass, without storing the compensated frame if the output does not use it.
+	const auto store = config.output_type != OutputType::RESIDUAL_BEFORE_MC;
+
+	if (store)
+		AllocateCompensated();
+
+	if (store || config.measure_psnr) {
+		CompensateMotion(cur, ref, store, config.measure_psnr);
+		measured_psnr = config.measure_psnr;
+	}
+
+	if (config.output_type == OutputType::RESIDUAL_BEFORE_MC) {
+		// We don't use the compensated frame here, the previous one is the prediction.
+		frame.Y = ref.Y.get() + width_ext * MotionEstimator::BORDER + MotionEstimator::BORDER;
+		frame.Y_pitch = width_ext;
+		frame.U = ref.U.get();
+		frame.V = ref.V.get();
+	} else {
+		frame.Y = cur_Y_MC.get();
+		frame.Y_pitch = width;
+		frame.U = cur_U_MC.get();
+		frame.V = cur_V_MC.get();
+	}
+
+	// For residuals, the writer subtracts the current frame.
+	if (config.output_type == OutputType::RESIDUAL_BEFORE_MC
+		|| config.output_type == OutputType::RESIDUAL_AFTER_MC) {
+		frame.subtract_Y = cur.Y.get() + width_ext * MotionEstimator::BORDER + MotionEstimator::BORDER;
+		frame.subtract_Y_pitch = width_ext;
+		frame.subtract_U = cur.U.get();
+		frame.subtract_V = cur.V.get();
+	}
+
+	return frame;
+}
+
+void FrameProcessor::AllocateCompensated() {
+	if (cur_Y_MC && cur_U_MC && cur_V_MC)
+		return;
+
+	cur_Y_MC = std::make_unique<uint8_t[]>(width * height);
+	cur_U_MC = std::make_unique<int16_t[]>(width * height);
+	cur_V_MC = std::make_unique<int16_t[]>(width * height);
+}
+
+void FrameProcessor::CompensateMotion(const Frame& cur, Frame& ref, bool store, bool measure_psnr) {
+	// There is nothing to compare the first frame with.
+	if (cur.number == 0)
+		measure_psnr = false;
+
+	if (!store && !measure_psnr)
+		return;
+
+	// SSIM compares the compensated luma, which then has to be stored even if the output does not use it.
+	const auto measure_ssim = measure_psnr && config.measure_ssim;
+
+	if (measure_ssim)
+		AllocateCompensated();
+
+	// Planes by shift direction. Half-pixel planes are only filled in if a vector uses them.
+	const auto visible = width_ext * MotionEstimator::BORDER + MotionEstimator::BORDER;
+
+	ReferencePlanes planes = {
+		{ ref.Y.get() + visible, nullptr, nullptr, nullptr },
+		width_ext,
+		{ ref.U.get(), nullptr, nullptr, nullptr },
+		{ ref.V.get(), nullptr, nullptr, nullptr }
+	};
+
+	if (config.use_half_pixel) {
+		// Only what CompensateBlocks reads is interpolated: the source of each block using a
+		// shifted plane, clamped to the frame like the rows of blocks reaching past it.
+		cur.vectors.ForEachLeafBlock([&](int x, int y, int size, const MV& mv) {
+			const auto dir = static_cast<int>(mv.shift_dir);
+
+			if (dir == 0 || x >= width || y >= height)
+				return;
+
+			const auto x0 = std::min(std::max(x + mv.x, 0), width - 1);
+			const auto y0 = std::min(std::max(y + mv.y, 0), height - 1);
+			const auto x1 = std::min(std::max(x + mv.x + size, 1), width);
+			const auto y1 = std::min(std::max(y + mv.y + size, 1), height);
+
+			planes.Y[dir] = ref.Y_half->Prepare(mv.shift_dir, MotionEstimator::BORDER + x0, MotionEstimator::BORDER + y0, x1 - x0, y1 - y0) + visible;
+		});
+
+		if (planes.Y[1] || planes.Y[2] || planes.Y[3]) {
+			PrepareHalfPixelChroma(ref);
+
+			planes.U[1] = ref.U_up.get();
+			planes.U[2] = ref.U_left.get();
+			planes.U[3] = ref.U_upleft.get();
+			planes.V[1] = ref.V_up.get();
+			planes.V[2] = ref.V_left.get();
+			planes.V[3] = ref.V_upleft.get();
+		}
+	}
+
+	if (!measure_psnr) {
+		CompensateBlocks(cur.vectors, planes, width, height, cur_Y_MC.get(), width, cur_U_MC.get(), cur_V_MC.get());
+		return;
+	}
+
+	const CurrentPlanes cur_planes = { cur.Y.get() + visible, width_ext, cur.U.get(), cur.V.get() };
+	CompensationError error;
+
+	if (store)
+		CompensateAndMeasure(cur.vectors, planes, cur_planes, width, height, cur_Y_MC.get(), width, cur_U_MC.get(), cur_V_MC.get(), error);
+	else if (measure_ssim)
+		CompensateAndMeasure(cur.vectors, planes, cur_planes, width, height, cur_Y_MC.get(), width, nullptr, nullptr, error);
+	else
+		CompensateAndMeasure(cur.vectors, planes, cur_planes, width, height, nullptr, 0, nullptr, nullptr, error);
+
+	const auto ssim = measure_ssim ? BlockSSIM(cur_Y_MC.get(), width, cur_planes.Y, width_ext, width, height) : 0.0;
+
+	ReportQuality(cur, error, ssim);
+}
+
+void FrameProcessor::ReportQuality(const Frame& cur, const CompensationError& error, double ssim) {
+	// Calculate PSNR.
+	const auto YPSNR = PSNR(static_cast<double>(error.Y), width, height);
+	const auto UPSNR = PSNR(static_cast<double>(error.U), width, height);
+	const auto VPSNR = PSNR(static_cast<double>(error.V), width, height);
+
+	if (psnr_log && *psnr_log) {
+		*psnr_log << cur.number << ": " << YPSNR << ' ' << UPSNR << ' ' << VPSNR;
+
+		if (config.measure_ssim)
+			*psnr_log << ' ' << ssim;
+
+		*psnr_log << '\n';
+	}
+
+	if (psnr_csv && *psnr_csv) {
+		*psnr_csv << cur.number << ',' << YPSNR << ',' << UPSNR << ',' << VPSNR;
+
+		if (config.measure_ssim)
+			*psnr_csv << ',' << ssim;
+
+		*psnr_csv << '\n';
+	}
+
+	stats.total_y_psnr += YPSNR;
+	stats.total_u_psnr += UPSNR;
+	stats.total_v_psnr += VPSNR;
+	stats.total_y_ssim += ssim;
+	++stats.psnr_count;
+}
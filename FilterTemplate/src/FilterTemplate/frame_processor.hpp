@@ -0,0 +1,227 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <vector>
+#include "depth_estimator.hpp"
+#include "half_pixel.hpp"
+#include "motion_compensation.hpp"
+#include "motion_estimator.hpp"
+#include "mv_field.hpp"
+#include "thread_pool.hpp"
+
+enum class OutputType : int {
+	SOURCE,
+	RESIDUAL_BEFORE_MC,
+	RESIDUAL_AFTER_MC,
+	COMPENSATED,
+	DEPTH
+};
+
+struct FilterTemplateConfig {
+	OutputType output_type;
+	bool show_vectors;
+	bool draw_nothing;
+	bool measure_psnr;
+
+	/// Also measure the SSIM of the compensated luma when measuring PSNR
+	bool measure_ssim;
+
+	uint8_t quality;
+	bool use_half_pixel;
+
+	/// How the motion estimator searches for vectors
+	MotionSearch search;
+
+	/// How the motion estimator decides that a block is done
+	EarlyTermination termination;
+
+	int num_threads;
+	bool pipeline;
+	DepthRefinement refinement;
+	int guided_radius;
+	int median_depth;
+
+	FilterTemplateConfig()
+		: output_type(OutputType::DEPTH)
+		, show_vectors(false)
+		, draw_nothing(false)
+		, measure_psnr(false)
+		, measure_ssim(false)
+		, quality(100)
+		, use_half_pixel(false)
+		, search(MotionSearch::ARPS)
+		, termination(EarlyTermination::FIXED)
+		, num_threads(1)
+		, pipeline(false)
+		, refinement(DepthRefinement::CROSS_BILATERAL)
+		, guided_radius(DepthEstimator::DEFAULT_GUIDED_RADIUS)
+		, median_depth(DepthEstimator::DEFAULT_MEDIAN_DEPTH) {
+	}
+};
+
+/// Output of one frame. U and V have a pitch equal to the frame width and are null for greyscale output.
+struct OutputFrame {
+	const uint8_t* Y;
+	ptrdiff_t Y_pitch;
+	const int16_t* U;
+	const int16_t* V;
+
+	/**
+	 * For residual output, the frame to subtract from Y, U and V (same layout), left to the writer
+	 * so the difference is computed while converting. Null otherwise.
+	 */
+	const uint8_t* subtract_Y;
+	ptrdiff_t subtract_Y_pitch;
+	const int16_t* subtract_U;
+	const int16_t* subtract_V;
+
+	/// Motion vectors of the frame, for drawing them over the output
+	const MVField* vectors;
+
+	/// Number of the frame, counting from zero
+	unsigned number;
+};
+
+/// Running totals, averages are left to the caller. Times are in milliseconds.
+struct ProcessorStats {
+	double total_input = 0.0;
+	double total_me = 0.0;
+	double total_de = 0.0;
+	double total_output = 0.0;
+	double total_y_psnr = 0.0;
+	double total_u_psnr = 0.0;
+	double total_v_psnr = 0.0;
+	double total_y_ssim = 0.0;
+
+	/// Frames passed in so far
+	unsigned frame_count = 0;
+
+	/// Frames PSNR was measured on
+	unsigned psnr_count = 0;
+};
+
+/**
+ * Runs frames through motion estimation, depth estimation and output.
+ * Knows nothing about pixel formats of the host, frames come in and go out as Y, U and V planes.
+ */
+class FrameProcessor {
+public:
+	/// Fills the visible part of a frame. U and V have a pitch equal to the frame width.
+	using InputFunc = std::function<void(uint8_t* Y, ptrdiff_t Y_pitch, int16_t* U, int16_t* V)>;
+
+	/// Receives the output of a frame, or null while a pipeline is still filling up
+	using OutputFunc = std::function<void(const OutputFrame* frame)>;
+
+	/// Frames in flight in pipelined mode: the one being converted, estimated, output, and its reference.
+	static constexpr int PIPELINE_FRAMES = 4;
+
+	/// Output lag in pipelined mode, in frames.
+	static constexpr int PIPELINE_LAG = 2;
+
+	/// Constructor
+	FrameProcessor(int width, int height, const FilterTemplateConfig& config);
+
+	/// Destructor
+	~FrameProcessor();
+
+	/// Copy constructor (deleted)
+	FrameProcessor(const FrameProcessor&) = delete;
+
+	/// Copy assignment (deleted)
+	FrameProcessor& operator=(const FrameProcessor&) = delete;
+
+	/// Number of frames the output lags behind the input
+	int Lag() const { return config.pipeline ? PIPELINE_LAG : 0; }
+
+	/**
+	 * Process the next frame
+	 *
+	 * @param[in] input called once to fill in the new frame, possibly on another thread
+	 * @param[in] output called at most once with the output of the frame Lag() frames back;
+	 *   not called at all if draw_nothing is set
+	 */
+	void Process(const InputFunc& input, const OutputFunc& output);
+
+	/// Output the frames still in the pipeline after the last input frame
+	void Flush(const OutputFunc& output);
+
+	/// Set a stream receiving a line of PSNR values per frame, followed by SSIM if measured, or null
+	void SetPSNRLog(std::ostream* log) { psnr_log = log; }
+
+	/// Set a stream receiving the same values as CSV, a header line first, or null
+	void SetPSNRCSV(std::ostream* csv);
+
+	const ProcessorStats& Stats() const { return stats; }
+
+private:
+	/// Planes and per-frame results of one frame travelling through the stages.
+	struct Frame {
+		std::unique_ptr<uint8_t[]> Y;
+		std::unique_ptr<int16_t[]> U, V;
+
+		// Half-pixel shifted planes, used when this frame is the reference. Luma is interpolated
+		// as the motion search asks for it, chroma only once a half-pixel vector is compensated.
+		std::unique_ptr<HalfpixelCache> Y_half;
+		std::unique_ptr<int16_t[]> U_up, U_left, U_upleft;
+		std::unique_ptr<int16_t[]> V_up, V_left, V_upleft;
+		bool half_pixel_ready = false;
+		bool chroma_half_pixel_ready = false;
+
+		// Downsampled luma for the hierarchical search, built when the frame is estimated
+		// and searched again when it is the reference.
+		std::unique_ptr<LumaPyramid> pyramid;
+
+		MVField vectors;
+		std::unique_ptr<uint8_t[]> depth;
+
+		unsigned number = 0;
+	};
+
+	void ProcessSequential(const InputFunc& input, const OutputFunc& output);
+	void ProcessPipelined(const InputFunc* input, const OutputFunc& output);
+	void AllocateFrame(Frame& frame);
+	void ReadInput(Frame& frame, const InputFunc& input);
+	void FillBorders(Frame& frame);
+	void PrepareHalfPixel(Frame& ref);
+	void PrepareHalfPixelChroma(Frame& ref);
+	void EstimateMotion(Frame& cur, const Frame& ref);
+	void EstimateDepth(Frame& cur);
+	void ProduceOutput(Frame& cur, Frame& ref, const OutputFunc& output);
+	OutputFrame RenderOutput(const Frame& cur, Frame& ref);
+	void CompensateMotion(const Frame& cur, Frame& ref, bool store, bool measure_psnr);
+	void AllocateCompensated();
+	void ReportQuality(const Frame& cur, const CompensationError& error, double ssim);
+
+	const int width, height;
+	const int width_ext, height_ext;
+	const int num_blocks_hor, num_blocks_vert;
+
+	const FilterTemplateConfig config;
+
+	// Sequential mode: frame n lives in frames[n % 2].
+	// Pipelined mode: frame n lives in frames[n % PIPELINE_FRAMES].
+	std::vector<Frame> frames;
+
+	std::unique_ptr<uint8_t[]> cur_Y_MC;
+	std::unique_ptr<int16_t[]> cur_U_MC, cur_V_MC;
+
+	std::unique_ptr<MotionEstimator> me;
+	std::unique_ptr<DepthEstimator> de;
+
+	/// Runs the conversion and ME stages next to the output stage in pipelined mode.
+	std::unique_ptr<ThreadPool> stage_pool;
+
+	/// Pipeline steps taken, including the ones taken by Flush
+	unsigned step_count;
+
+	bool measured_psnr;
+
+	std::ostream* psnr_log;
+	std::ostream* psnr_csv;
+
+	ProcessorStats stats;
+};
@@ -1,219 +1,338 @@
-#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <thread>
 
+#include "cpu.hpp"
 #include "half_pixel.hpp"
 
-void HalfpixelShift(uint8_t *field, int width, int height, bool shift_up)
-{
-	int i, j, width2 = width * 2, temp;
-	std::unique_ptr<uint8_t[]> new_field(new uint8_t[width*height]);
-	uint8_t *old_ptr = field, *new_ptr = new_field.get();
-	old_ptr += width;
-	for (j = 0; j < width; j++)
-	{
-		temp = (old_ptr[j-width] + old_ptr[j])>>1;
-		if (temp < 255)
-			if (temp >= 0);
-			else
-				temp = 0;
-		else
-			temp = 255;
-		new_ptr[j] = static_cast<uint8_t>(temp);
-	}
-	old_ptr += width;
-	new_ptr += width;
-	for (i = 2; i < height - 1; i++)
-	{
-		for (j = 0; j < width; j++)
-		{
-			temp = (5*(old_ptr[j-width] + old_ptr[j]) -
-				(old_ptr[j-width2] + old_ptr[j+width]))>>3;
-			if (temp < 255)
-				if (temp >= 0);
-				else
-					temp = 0;
-			else
-				temp = 255;
-			new_ptr[j] = static_cast<uint8_t>(temp);
-		}
-		old_ptr += width;
-		new_ptr += width;
-	}
-	for (j = 0; j < width; j++)
-	{
-		temp = (old_ptr[j-width] + old_ptr[j])>>1;
-		if (temp < 255)
-			if (temp >= 0);
-			else
-				temp = 0;
-		else
-			temp = 255;
-		new_ptr[j] = static_cast<uint8_t>(temp);
-	}
-	if (shift_up)
-	{
-		temp = width;
-	}
-	else
-	{
-		temp = 0;
-	}
-	memcpy(field + temp, new_field.get(), width * (height - 1) * sizeof(uint8_t));
-}
-
-void HalfpixelShiftHorz(uint8_t *field, int width, int height, bool shift_right)
-{
-	int i, j, temp;
-	std::unique_ptr<uint8_t[]> new_field(new uint8_t[width*height]);
-	uint8_t *old_ptr = field, *new_ptr = new_field.get();
-
-	old_ptr += 1;
-	for (j = 0; j < height; j++)
-	{
-		temp = (old_ptr[j*width - 1] + old_ptr[j*width])>>1;
-		if (temp < 255)
-			if (temp >= 0);
-			else
-				temp = 0;
-		else
-			temp = 255;
-		new_ptr[j*width] = static_cast<uint8_t>(temp);
-	}
-	old_ptr += 1;
-	new_ptr += 1;
-	for (i = 2; i < width - 1; i++)
-	{
-		for (j = 0; j < height; j++)
-		{
-			temp = (5*(old_ptr[j*width-1] + old_ptr[j*width]) -
-				(old_ptr[j*width-2] + old_ptr[j*width+1]))>>3;
-			if (temp < 255)
-				if (temp >= 0);
-				else
-					temp = 0;
-			else
-				temp = 255;
-			new_ptr[j*width] = static_cast<uint8_t>(temp);
-		}
-		old_ptr += 1;
-		new_ptr += 1;
-	}
-	for (j = 0; j < height; j++)
-	{
-		temp = (old_ptr[j*width-1] + old_ptr[j*width])>>1;
-		if (temp < 255)
-			if (temp >= 0);
-			else
-				temp = 0;
-		else
-			temp = 255;
-		new_ptr[j*width] = static_cast<uint8_t>(temp);
-	}
-	if (shift_right)
-	{
-		new_ptr = new_field.get();
-		old_ptr = field;
-		for (j = 0; j < height; j++)
-		{
-			new_ptr[j*width] = old_ptr[j*width];
-		}
-	}
-	else
-	{
-		new_ptr += 1;
-		for (j = 0; j < height; j++)
-		{
-			new_ptr[j*width] = old_ptr[j*width];
-		}
-	}
-	memcpy(field, new_field.get(), width * height * sizeof(uint8_t));
+#if defined(DE_ARCH_X86)
+#include <emmintrin.h>
+#endif
+
+/// Luma saturates, chroma keeps the full range of int16_t
+static inline uint8_t Store(int value, uint8_t)
+{
+	return static_cast<uint8_t>(std::min(std::max(value, 0), 255));
 }
 
-void HalfpixelShift(int16_t *field, int width, int height, bool shift_up)
+static inline int16_t Store(int value, int16_t)
 {
-	int i, j, width2 = width * 2, temp;
-	std::unique_ptr<int16_t[]> new_field(new int16_t[width*height]);
-	int16_t *old_ptr = field, *new_ptr = new_field.get();
-	old_ptr += width;
-	for (j = 0; j < width; j++)
-	{
-		temp = (old_ptr[j-width] + old_ptr[j])>>1;
-		new_ptr[j] = static_cast<int16_t>(temp);
-	}
-	old_ptr += width;
-	new_ptr += width;
-	for (i = 2; i < height - 1; i++)
-	{
-		for (j = 0; j < width; j++)
-		{
-			temp = (5*(old_ptr[j-width] + old_ptr[j]) -
-				(old_ptr[j-width2] + old_ptr[j+width]))>>3;
-			new_ptr[j] = static_cast<int16_t>(temp);
-		}
-		old_ptr += width;
-		new_ptr += width;
+	return static_cast<int16_t>(value);
+}
+
+template<typename T>
+static inline T Interpolate(T a, T b, T c, T d)
+{
+	return Store((5 * (b + c) - (a + d)) >> 3, T{});
+}
+
+template<typename T>
+static inline T Average(T a, T b)
+{
+	return Store((a + b) >> 1, T{});
+}
+
+/// Pixels [begin, end) of a row between rows r1 and r2, r0 and r3 being the outer taps
+template<typename T>
+static void VertRow_Scalar(const T* r0, const T* r1, const T* r2, const T* r3, int begin, int end, T* out)
+{
+	for (int x = begin; x < end; ++x)
+		out[x] = Interpolate(r0[x], r1[x], r2[x], r3[x]);
+}
+
+/// Pixels [begin, end) of a row between columns x and x + 1
+template<typename T>
+static void HorzRow_Scalar(const T* row, int begin, int end, T* out)
+{
+	for (int x = begin; x < end; ++x)
+		out[x] = Interpolate(row[x - 1], row[x], row[x + 1], row[x + 2]);
+}
+
+#if defined(DE_ARCH_X86)
+
+/// Sixteen 4-tap results from sixteen pixels at each tap
+DE_TARGET_SSE2 static inline __m128i Interpolate_SSE2(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+	const auto zero = _mm_setzero_si128();
+
+	const auto half = [&](__m128i a16, __m128i b16, __m128i c16, __m128i d16) {
+		const auto inner = _mm_add_epi16(b16, c16);
+		const auto inner5 = _mm_add_epi16(_mm_slli_epi16(inner, 2), inner);
+		return _mm_srai_epi16(_mm_sub_epi16(inner5, _mm_add_epi16(a16, d16)), 3);
+	};
+
+	const auto lo = half(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero),
+	                     _mm_unpacklo_epi8(c, zero), _mm_unpacklo_epi8(d, zero));
+	const auto hi = half(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero),
+	                     _mm_unpackhi_epi8(c, zero), _mm_unpackhi_epi8(d, zero));
+
+	return _mm_packus_epi16(lo, hi);
+}
+
+/// Eight 4-tap results from eight int16_t pixels at each tap, computed in 32 bits and wrapped like the scalar version
+DE_TARGET_SSE2 static inline __m128i Interpolate_SSE2(__m128i a, __m128i b, __m128i c, __m128i d, int16_t)
+{
+	const auto inner = _mm_set1_epi16(5);
+	const auto outer = _mm_set1_epi16(-1);
+
+	const auto lo = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(b, c), inner),
+	                                             _mm_madd_epi16(_mm_unpacklo_epi16(a, d), outer)), 3);
+	const auto hi = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(b, c), inner),
+	                                             _mm_madd_epi16(_mm_unpackhi_epi16(a, d), outer)), 3);
+
+	// Keep the low 16 bits of each lane, so packs never saturates.
+	return _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(lo, 16), 16), _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16));
+}
+
+DE_TARGET_SSE2 static inline __m128i Load(const uint8_t* p)
+{
+	return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+DE_TARGET_SSE2 static inline __m128i Load(const int16_t* p)
+{
+	return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+DE_TARGET_SSE2 static inline __m128i Interpolate_SSE2(const uint8_t* a, const uint8_t* b, const uint8_t* c, const uint8_t* d)
+{
+	return Interpolate_SSE2(Load(a), Load(b), Load(c), Load(d));
+}
+
+DE_TARGET_SSE2 static inline __m128i Interpolate_SSE2(const int16_t* a, const int16_t* b, const int16_t* c, const int16_t* d)
+{
+	return Interpolate_SSE2(Load(a), Load(b), Load(c), Load(d), int16_t{});
+}
+
+/// Interpolates from begin on, returns the first pixel left to the scalar version
+template<typename T>
+DE_TARGET_SSE2 static int VertRow_SSE2(const T* r0, const T* r1, const T* r2, const T* r3, int begin, int end, T* out)
+{
+	constexpr int STEP = 16 / sizeof(T);
+
+	int x = begin;
+
+	for (; x + STEP <= end; x += STEP)
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), Interpolate_SSE2(r0 + x, r1 + x, r2 + x, r3 + x));
+
+	return x;
+}
+
+/// Interpolates from begin on, returns the first pixel left to the scalar version
+template<typename T>
+DE_TARGET_SSE2 static int HorzRow_SSE2(const T* row, int begin, int end, T* out)
+{
+	constexpr int STEP = 16 / sizeof(T);
+
+	int x = begin;
+
+	for (; x + STEP <= end; x += STEP)
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), Interpolate_SSE2(row + x - 1, row + x, row + x + 1, row + x + 2));
+
+	return x;
+}
+
+#endif
+
+/**
+ * Pixels [x0, x1) of row y of the vertically shifted plane
+ *
+ * @param[in] src source plane
+ * @param[out] out start of the output row
+ */
+template<typename T>
+static void VertSpan(const T* src, int width, int height, int y, int x0, int x1, bool use_sse2, T* out)
+{
+	const auto row = src + y * width;
+
+	if (y == 0 || y == height - 2) {
+		for (int x = x0; x < x1; ++x)
+			out[x] = Average(row[x], row[x + width]);
+		return;
 	}
-	for (j = 0; j < width; j++)
-	{
-		temp = (old_ptr[j-width] + old_ptr[j])>>1;
-		new_ptr[j] = static_cast<int16_t>(temp);
+
+	if (y == height - 1) {
+		memcpy(out + x0, row + x0, (x1 - x0) * sizeof(T));
+		return;
 	}
-	if (shift_up)
-	{
-		temp = width;
+
+	auto done = x0;
+
+#if defined(DE_ARCH_X86)
+	if (use_sse2)
+		done = VertRow_SSE2(row - width, row, row + width, row + 2 * width, x0, x1, out);
+#else
+	(void)use_sse2;
+#endif
+
+	VertRow_Scalar(row - width, row, row + width, row + 2 * width, done, x1, out);
+}
+
+/**
+ * Pixels [x0, x1) of a row of the horizontally shifted plane
+ *
+ * @param[in] row source row, read from x0 - 1 to x1 + 1
+ * @param[out] out start of the output row
+ */
+template<typename T>
+static void HorzSpan(const T* row, int width, int x0, int x1, bool use_sse2, T* out)
+{
+	// Columns 1 to width - 3 have all four taps.
+	const auto begin = std::max(x0, 1);
+	const auto end = std::min(x1, width - 2);
+
+	if (begin < end) {
+		auto done = begin;
+
+#if defined(DE_ARCH_X86)
+		if (use_sse2)
+			done = HorzRow_SSE2(row, begin, end, out);
+#else
+		(void)use_sse2;
+#endif
+
+		HorzRow_Scalar(row, done, end, out);
 	}
-	else
-	{
-		temp = 0;
+
+	if (x0 == 0)
+		out[0] = Average(row[0], row[1]);
+
+	if (x0 <= width - 2 && width - 2 < x1)
+		out[width - 2] = Average(row[width - 2], row[width - 1]);
+
+	if (x1 == width)
+		out[width - 1] = row[width - 1];
+}
+
+static bool UseSSE2()
+{
+#if defined(DE_ARCH_X86)
+	return GetCPUFeatures().sse2;
+#else
+	return false;
+#endif
+}
+
+template<typename T>
+static void InterpolatePlane(const T* src, int width, int height, T* up, T* left, T* upleft)
+{
+	const auto use_sse2 = UseSSE2();
+
+	for (int y = 0; y < height; ++y) {
+		const auto up_row = up + y * width;
+
+		VertSpan(src, width, height, y, 0, width, use_sse2, up_row);
+
+		// The row just written is still in the cache for the diagonal plane.
+		HorzSpan(src + y * width, width, 0, width, use_sse2, left + y * width);
+		HorzSpan(up_row, width, 0, width, use_sse2, upleft + y * width);
 	}
-	memcpy(field + temp, new_field.get(), width * (height - 1) * sizeof(int16_t));
 }
 
-void HalfpixelShiftHorz(int16_t *field, int width, int height, bool shift_right)
+void HalfpixelInterpolate(const uint8_t* src, int width, int height, uint8_t* up, uint8_t* left, uint8_t* upleft)
 {
-	int i, j, temp;
-	std::unique_ptr<int16_t[]> new_field(new int16_t[width*height]);
-	int16_t *old_ptr = field, *new_ptr = new_field.get();
+	InterpolatePlane(src, width, height, up, left, upleft);
+}
+
+void HalfpixelInterpolate(const int16_t* src, int width, int height, int16_t* up, int16_t* left, int16_t* upleft)
+{
+	InterpolatePlane(src, width, height, up, left, upleft);
+}
 
-	old_ptr += 1;
-	for (j = 0; j < height; j++)
-	{
-		temp = (old_ptr[j*width - 1] + old_ptr[j*width])>>1;
-		new_ptr[j*width] = static_cast<int16_t>(temp);
+HalfpixelCache::HalfpixelCache(int width, int height)
+	: width(width)
+	, height(height)
+	, tiles_hor((width + TILE_SIZE - 1) / TILE_SIZE)
+	, tiles_vert((height + TILE_SIZE - 1) / TILE_SIZE)
+	, src(nullptr)
+	, generation(0)
+	, use_sse2(UseSSE2()) {
+	for (int i = 0; i < 3; ++i) {
+		planes[i] = std::make_unique<uint8_t[]>(width * height);
+		tiles[i] = std::make_unique<std::atomic<unsigned>[]>(tiles_hor * tiles_vert);
+
+		for (int t = 0; t < tiles_hor * tiles_vert; ++t)
+			tiles[i][t].store(0, std::memory_order_relaxed);
 	}
-	old_ptr += 1;
-	new_ptr += 1;
-	for (i = 2; i < width - 1; i++)
-	{
-		for (j = 0; j < height; j++)
-		{
-			temp = (5*(old_ptr[j*width-1] + old_ptr[j*width]) -
-				(old_ptr[j*width-2] + old_ptr[j*width+1]))>>3;
-			new_ptr[j*width] = static_cast<int16_t>(temp);
+}
+
+HalfpixelCache::~HalfpixelCache() {
+}
+
+void HalfpixelCache::Reset(const uint8_t* src) {
+	this->src = src;
+	generation += 2;
+}
+
+const uint8_t* HalfpixelCache::Prepare(ShiftDir dir, int x, int y, int w, int h) {
+	const auto index = static_cast<int>(dir) - 1;
+	const auto done = generation;
+	const auto busy = generation + 1;
+
+	const auto first_x = std::max(x, 0) / TILE_SIZE;
+	const auto first_y = std::max(y, 0) / TILE_SIZE;
+	const auto last_x = (std::min(x + w, width) - 1) / TILE_SIZE;
+	const auto last_y = (std::min(y + h, height) - 1) / TILE_SIZE;
+
+	for (int tile_y = first_y; tile_y <= last_y; ++tile_y) {
+		for (int tile_x = first_x; tile_x <= last_x; ++tile_x) {
+			auto& state = tiles[index][tile_y * tiles_hor + tile_x];
+
+			// Whoever marks the tile busy fills it, everyone else waits for them.
+			for (;;) {
+				auto seen = state.load(std::memory_order_acquire);
+
+				if (seen == done)
+					break;
+
+				if (seen != busy && state.compare_exchange_strong(seen, busy, std::memory_order_acquire)) {
+					Fill(dir, tile_x, tile_y);
+					state.store(done, std::memory_order_release);
+					break;
+				}
+
+				std::this_thread::yield();
+			}
 		}
-		old_ptr += 1;
-		new_ptr += 1;
 	}
-	for (j = 0; j < height; j++)
-	{
-		temp = (old_ptr[j*width-1] + old_ptr[j*width])>>1;
-		new_ptr[j*width] = static_cast<int16_t>(temp);
+
+	return planes[index].get();
+}
+
+void HalfpixelCache::Fill(ShiftDir dir, int tile_x, int tile_y) {
+	const auto x0 = tile_x * TILE_SIZE;
+	const auto y0 = tile_y * TILE_SIZE;
+	const auto x1 = std::min(x0 + TILE_SIZE, width);
+	const auto y1 = std::min(y0 + TILE_SIZE, height);
+
+	switch (dir) {
+	case ShiftDir::UP: {
+		const auto up = planes[0].get();
+
+		for (int y = y0; y < y1; ++y)
+			VertSpan(src, width, height, y, x0, x1, use_sse2, up + y * width);
+		break;
 	}
-	if (shift_right)
-	{
-		new_ptr = new_field.get();
-		old_ptr = field;
-		for (j = 0; j < height; j++)
-		{
-			new_ptr[j*width] = old_ptr[j*width];
-		}
+
+	case ShiftDir::LEFT: {
+		const auto left = planes[1].get();
+
+		for (int y = y0; y < y1; ++y)
+			HorzSpan(src + y * width, width, x0, x1, use_sse2, left + y * width);
+		break;
 	}
-	else
-	{
-		new_ptr += 1;
-		for (j = 0; j < height; j++)
-		{
-			new_ptr[j*width] = old_ptr[j*width];
-		}
+
+	case ShiftDir::UPLEFT: {
+		// Interpolated horizontally from the vertically shifted plane, taps included.
+		const auto up = Prepare(ShiftDir::UP, x0 - 1, y0, x1 - x0 + 3, y1 - y0);
+		const auto upleft = planes[2].get();
+
+		for (int y = y0; y < y1; ++y)
+			HorzSpan(up + y * width, width, x0, x1, use_sse2, upleft + y * width);
+		break;
+	}
+
+	default:
+		break;
 	}
-	memcpy(field, new_field.get(), width * height * sizeof(int16_t));
 }
@@ -1,8 +1,95 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
+#include <memory>
 
-void HalfpixelShift(uint8_t* field, int width, int height, bool shift_up);
-void HalfpixelShift(int16_t* field, int width, int height, bool shift_up);
-void HalfpixelShiftHorz(uint8_t* field, int width, int height, bool shift_up);
-void HalfpixelShiftHorz(int16_t* field, int width, int height, bool shift_up);
+#include "mv.hpp"
+
+/**
+ * Half-pixel interpolation of a plane in one pass, with the (-1, 5, 5, -1) / 8 filter,
+ * or the average of two pixels next to the edges.
+ *
+ * up lies halfway between rows y and y + 1 of the source, left halfway between columns
+ * x and x + 1, upleft both. The last row of up and the last column of left keep the
+ * source pixels. All planes have a pitch equal to the width.
+ *
+ * @param[in] src source plane
+ * @param[in] width plane width, at least 4
+ * @param[in] height plane height, at least 4
+ * @param[out] up plane shifted half a pixel vertically
+ * @param[out] left plane shifted half a pixel horizontally
+ * @param[out] upleft plane shifted half a pixel both ways
+ */
+void HalfpixelInterpolate(const uint8_t* src, int width, int height, uint8_t* up, uint8_t* left, uint8_t* upleft);
+void HalfpixelInterpolate(const int16_t* src, int width, int height, int16_t* up, int16_t* left, int16_t* upleft);
+
+/**
+ * Half-pixel shifted planes of a luma plane, interpolated tile by tile on first use.
+ *
+ * The result is the same as HalfpixelInterpolate, but only the tiles a search actually
+ * looks at are computed. Tiles are invalidated in O(1) when the source changes.
+ */
+class HalfpixelCache {
+public:
+	/// Side of a tile, in pixels
+	static constexpr int TILE_SIZE = 16;
+
+	/**
+	 * Constructor
+	 *
+	 * @param[in] width plane width, at least 4
+	 * @param[in] height plane height, at least 4
+	 */
+	HalfpixelCache(int width, int height);
+
+	/// Destructor
+	~HalfpixelCache();
+
+	/// Copy constructor (deleted)
+	HalfpixelCache(const HalfpixelCache&) = delete;
+
+	/// Copy assignment (deleted)
+	HalfpixelCache& operator=(const HalfpixelCache&) = delete;
+
+	/**
+	 * Start over with a new source plane. Must not run at the same time as Prepare.
+	 *
+	 * @param[in] src source plane, pitch equal to the width, kept until the next Reset
+	 */
+	void Reset(const uint8_t* src);
+
+	/**
+	 * Make sure the pixels of a rectangle of a shifted plane are interpolated.
+	 * Safe to call from several threads at once.
+	 *
+	 * @param[in] dir shifted plane, UP, LEFT or UPLEFT
+	 * @param[in] x, y top left corner, the rectangle is clipped to the plane
+	 * @param[in] w, h size of the rectangle
+	 * @return the shifted plane, with the same layout as the source
+	 */
+	const uint8_t* Prepare(ShiftDir dir, int x, int y, int w, int h);
+
+	/// Make sure a whole shifted plane is interpolated
+	const uint8_t* PrepareAll(ShiftDir dir) { return Prepare(dir, 0, 0, width, height); }
+
+private:
+	const int width, height;
+	const int tiles_hor, tiles_vert;
+
+	const uint8_t* src;
+
+	/// UP, LEFT and UPLEFT planes
+	std::unique_ptr<uint8_t[]> planes[3];
+
+	/// Per plane and tile: the generation the tile was interpolated in, or generation + 1 while it is
+	std::unique_ptr<std::atomic<unsigned>[]> tiles[3];
+
+	/// Even, bumped by 2 on every Reset
+	unsigned generation;
+
+	const bool use_sse2;
+
+	/// Interpolate one tile
+	void Fill(ShiftDir dir, int tile_x, int tile_y);
+};
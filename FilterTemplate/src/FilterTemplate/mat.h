@@ -1,6 +1,7 @@
 #pragma once
 
-#include <exception>
+#include <cstdint>
+#include <stdexcept>
 
 class Mat {
 	uint8_t *data;
@@ -12,22 +13,23 @@ public:
 	~Mat() {} // note underlying data structure is not deleted
 	
 	inline Mat cropped(int origin_x, int origin_y, int width, int height) const {
-		if (origin_y + height > m || origin_x + width > n) throw std::exception("Cannot crop");
+		if (origin_y + height > m || origin_x + width > n) throw std::out_of_range("Cannot crop");
 		return Mat(height, width, data + origin_y*width + origin_x, width);
 	}
 
 	inline Mat& shift(int x, int y) {
 		// note: no bounds check here
 		data += y*width + x;
+		return *this;
 	}
 
 	inline uint8_t operator()(int x, int y) const {
-		if (y >= m || x >= n) throw std::exception("Index out of bounds");
+		if (y >= m || x >= n) throw std::out_of_range("Index out of bounds");
 		return data[y*width + x];
 	}
 
 	inline uint8_t& operator()(int x, int y) {
-		if (y >= m || x >= n) throw std::exception("Index out of bounds");
+		if (y >= m || x >= n) throw std::out_of_range("Index out of bounds");
 		return data[y*width + x];
 	}
 };
\ No newline at end of file
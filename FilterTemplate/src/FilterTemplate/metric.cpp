@@ -1,199 +1,78 @@
+#include <cstdlib>
+
 #include "metric.hpp"
+#include "metric_kernels.hpp"
 
-long GetErrorSAD_16x16(const uint8_t* block1, const uint8_t* block2, const int stride)
+template <int W, int H>
+static long GetErrorSAD_Scalar(const uint8_t* block1, const uint8_t* block2, const int stride)
 {
-    long sum = 0;
-    short m[4] = {1,1,1,1};
-    int b1 = (int)block1;
-    int b2 = (int)block2;
-    __asm
-    {
-        push edi
-        push esi
-
-        mov esi, b1//[esp + 8 + 4]    ; Current MB (Estimated MB)
-        mov edi, b2//[esp + 8 + 12]    ; reference MB
-        mov eax, stride//[esp + 8 + 20]    ; stride
-
-        pxor mm7, mm7            ; mm7 = sum = 0
-        pxor mm6, mm6            ; mm6 = 0
-
-        movq mm1, [esi]            ; 8 pixels for current MB
-        movq mm3, [esi+8]        ; another 8 pixels in the same row of current MB
-
-        mov    ecx, 16
-        //mov    ecx, 8
-
-sad16_mmx_loop:
-        movq mm0, [edi]            ; 8 pixels for reference MB
-        movq mm2, [edi+8]        ; another 8 pixels in the same row of reference MB
-
-        movq mm4, mm1
-        movq mm5, mm3
-
-        psubusb mm1, mm0
-        psubusb mm3, mm2
-
-        add    esi, eax
-        add    edi, eax
-
-        psubusb mm0, mm4
-        psubusb mm2, mm5
-
-        por mm0, mm1            ; mm0 = |cur - ref|
-        por mm2, mm3            ; mm2 = |*(cur+8) - *(ref+8)|
-
-        movq mm1,mm0
-        movq mm3,mm2
-
-        punpcklbw mm0,mm6
-        punpckhbw mm1,mm6
-
-        punpcklbw mm2,mm6
-        punpckhbw mm3,mm6
-
-        paddusw mm0,mm1
-        paddusw mm2,mm3
-
-        paddusw mm7,mm0        ; sum += mm01
-        movq mm1, [esi]        ; 8 pixels for current MB
-
-        paddusw mm7,mm2        ; sum += mm23
-        movq mm3, [esi+8]    ; another 8 pixels in the same row of current MB
-
-        ;// start next row's processing
-        movq mm0, [edi]            ; 8 pixels for reference MB
-        movq mm2, [edi+8]        ; another 8 pixels in the same row of reference MB
-
-        movq mm4, mm1
-        movq mm5, mm3
-
-        psubusb mm1, mm0
-        psubusb mm3, mm2
-
-        add    esi, eax
-        add    edi, eax
-
-        psubusb mm0, mm4
-        psubusb mm2, mm5
-
-        por mm0, mm1            ; mm0 = |cur - ref|
-        por mm2, mm3            ; mm2 = |*(cur+8) - *(ref+8)|
-
-        movq mm1,mm0
-        movq mm3,mm2
-
-        punpcklbw mm0,mm6
-        punpckhbw mm1,mm6
-
-        punpcklbw mm2,mm6
-        punpckhbw mm3,mm6
-
-        paddusw mm0,mm1
-        paddusw mm2,mm3
-
-        paddusw mm7,mm0        ; sum += mm01
-        movq mm1, [esi]        ; 8 pixels for current MB
-
-        paddusw mm7,mm2        ; sum += mm23
-        sub        ecx, 2        ; unlooped two rows processing
+	long sum = 0;
 
-        movq mm3, [esi+8]    ; another 8 pixels in the same row of current MB
+	for (int y = 0; y < H; ++y) {
+		for (int x = 0; x < W; ++x)
+			sum += std::abs(int{block1[x]} - block2[x]);
 
-        jnz    sad16_mmx_loop
+		block1 += stride;
+		block2 += stride;
+	}
 
-        pmaddwd mm7, m    ; merge sum
-        pop     esi
-
-        movq mm0, mm7
-        pop     edi
-        psrlq mm7, 32
-
-        paddd mm0, mm7
-        movd sum, mm0
-
-        emms
-    }
-    return sum;
+	return sum;
 }
 
-long GetErrorSAD_8x8(const uint8_t* block1, const uint8_t *block2, const int stride)
+template <int W, int H>
+static void GetErrorSADx4_Scalar(const uint8_t* block, const uint8_t* const refs[4], const int stride, long out[4])
 {
-    long sum = 0;
-    short m[4] = {1,1,1,1};
-    int b1 = (int)block1;
-    int b2 = (int)block2;
-    __asm
-    {
-        push edi
-        push esi
-
-        mov esi, b1//[esp + 8 + 4]    ; Current MB (Estimated MB)
-        mov edi, b2//[esp + 8 + 12]    ; reference MB
-        mov eax, stride//[esp + 8 + 20]    ; stride
-
-        pxor    mm6, mm6            ; mm6 = sum = 0
-
-        pxor    mm7, mm7            ; mm7 = 0
-        mov        ecx, 4
-
-sad8_mmx_lp:
-
-        movq mm0, [esi]    ; ref
-        movq mm1, [edi]    ; cur
-
-        add    esi, eax
-        add    edi, eax
-
-        movq mm2, [esi]    ; ref2
-        movq mm3, [edi]    ; cur2
-
-        movq mm4, mm0
-        movq mm5, mm2
-
-        psubusb mm0, mm1
-        psubusb mm2, mm3
-
-        psubusb mm1, mm4
-        psubusb mm3, mm5
-
-        por mm0, mm1            ; mm0 = |ref - cur|
-        por mm2, mm3            ; mm2 = |*(ref+stride) - *(cur+stride)|
-
-        movq mm1,mm0
-        movq mm3,mm2
-
-        punpcklbw mm0,mm7
-        punpcklbw mm2,mm7
-
-        punpckhbw mm1,mm7
-        punpckhbw mm3,mm7
-
-        paddusw mm0,mm1
-        paddusw mm2,mm3
+	for (int i = 0; i < 4; ++i)
+		out[i] = GetErrorSAD_Scalar<W, H>(block, refs[i], stride);
+}
 
-        paddusw mm6,mm0            ; sum += mm01
-        add    esi, eax
+const SADKernels kSADKernelsScalar = {
+	SADInstructionSet::SCALAR,
+	&GetErrorSAD_Scalar<4, 4>,
+	&GetErrorSAD_Scalar<8, 8>,
+	&GetErrorSAD_Scalar<16, 16>,
+	&GetErrorSAD_Scalar<8, 16>,
+	&GetErrorSAD_Scalar<16, 8>,
+	&GetErrorSADx4_Scalar<4, 4>,
+	&GetErrorSADx4_Scalar<8, 8>,
+	&GetErrorSADx4_Scalar<16, 16>,
+};
+
+const SADKernels& GetSADKernels(SADInstructionSet isa)
+{
+#if defined(DE_ARCH_X86)
+	const auto& cpu = GetCPUFeatures();
 
-        add    edi, eax
-        paddusw mm6,mm2            ; sum += mm23
+	if (isa >= SADInstructionSet::AVX512BW && cpu.avx512bw)
+		return kSADKernelsAVX512BW;
 
-        dec    ecx
-        jnz    sad8_mmx_lp
+	if (isa >= SADInstructionSet::AVX2 && cpu.avx2)
+		return kSADKernelsAVX2;
 
-        pmaddwd mm6, m    ; merge sum
-        pop     esi
+	if (isa >= SADInstructionSet::SSE2 && cpu.sse2)
+		return kSADKernelsSSE2;
+#endif
 
-        movq mm7, mm6
-        pop     edi
+	return kSADKernelsScalar;
+}
 
-        psrlq mm7, 32
+const SADKernels& GetSADKernels()
+{
+	static const SADKernels& kernels = GetSADKernels(SADInstructionSet::AVX512BW);
+	return kernels;
+}
 
-        paddd mm6, mm7
+long GetErrorSAD_16x16(const uint8_t* block1, const uint8_t* block2, const int stride)
+{
+	return GetSADKernels().sad_16x16(block1, block2, stride);
+}
 
-        movd sum, mm6
+long GetErrorSAD_8x8(const uint8_t* block1, const uint8_t* block2, const int stride)
+{
+	return GetSADKernels().sad_8x8(block1, block2, stride);
+}
 
-        emms
-    }
-    return sum;
+long GetErrorSAD_4x4(const uint8_t* block1, const uint8_t* block2, const int stride)
+{
+	return GetSADKernels().sad_4x4(block1, block2, stride);
 }
@@ -2,8 +2,46 @@
 
 #include <cstdint>
 
+/// SAD kernel: sum of absolute differences between two blocks sharing the same stride
+using SADFunc = long (*)(const uint8_t* block1, const uint8_t* block2, int stride);
+
+/// Batched SAD kernel: one block against four reference blocks, the block is loaded only once
+using SADx4Func = void (*)(const uint8_t* block, const uint8_t* const refs[4], int stride, long out[4]);
+
+/// Instruction set a family of SAD kernels is written for
+enum class SADInstructionSet
+{
+	SCALAR,
+	SSE2,
+	AVX2,
+	AVX512BW
+};
+
+/// SAD kernels for every block shape used by the motion estimator.
+/// WxH naming: sad_8x16 is 8 pixels wide and 16 rows tall.
+struct SADKernels {
+	SADInstructionSet isa;
+	SADFunc sad_4x4;
+	SADFunc sad_8x8;
+	SADFunc sad_16x16;
+	SADFunc sad_8x16;
+	SADFunc sad_16x8;
+	SADx4Func sad_4x4_x4;
+	SADx4Func sad_8x8_x4;
+	SADx4Func sad_16x16_x4;
+};
+
+/// Get the fastest kernel family supported by the running CPU
+const SADKernels& GetSADKernels();
+
+/// Get the kernel family for an instruction set, or the best supported one below it
+const SADKernels& GetSADKernels(SADInstructionSet isa);
+
 /// Compute SAD between two 16x16 blocks
 long GetErrorSAD_16x16(const uint8_t* block1, const uint8_t* block2, int stride);
 
 /// Compute SAD between two 8x8 blocks
 long GetErrorSAD_8x8(const uint8_t* block1, const uint8_t* block2, int stride);
+
+/// Compute SAD between two 4x4 blocks
+long GetErrorSAD_4x4(const uint8_t* block1, const uint8_t* block2, int stride);
@@ -0,0 +1,104 @@
+#include "metric_kernels.hpp"
+
+#if defined(DE_ARCH_X86)
+
+#include <immintrin.h>
+
+/// Load two rows of 16 pixels into one register
+DE_TARGET_AVX2 static inline __m256i Load16x2(const uint8_t* p, int stride)
+{
+	const auto lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+	const auto hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + stride));
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+/// Load four rows of 8 pixels into one register
+DE_TARGET_AVX2 static inline __m256i Load8x4(const uint8_t* p, int stride)
+{
+	const auto r0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+	const auto r1 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + stride));
+	const auto r2 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + 2 * stride));
+	const auto r3 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + 3 * stride));
+	const auto lo = _mm_unpacklo_epi64(r0, r1);
+	const auto hi = _mm_unpacklo_epi64(r2, r3);
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+/// Add the four 64-bit partial sums left by vpsadbw
+DE_TARGET_AVX2 static inline long HorizontalSum(__m256i sum)
+{
+	auto s = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+	s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+	return static_cast<long>(_mm_cvtsi128_si32(s));
+}
+
+template <int H>
+DE_TARGET_AVX2 static long GetErrorSAD_8xH_AVX2(const uint8_t* block1, const uint8_t* block2, const int stride)
+{
+	auto sum = _mm256_setzero_si256();
+
+	for (int y = 0; y < H; y += 4) {
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(Load8x4(block1, stride), Load8x4(block2, stride)));
+		block1 += 4 * stride;
+		block2 += 4 * stride;
+	}
+
+	return HorizontalSum(sum);
+}
+
+template <int H>
+DE_TARGET_AVX2 static long GetErrorSAD_16xH_AVX2(const uint8_t* block1, const uint8_t* block2, const int stride)
+{
+	auto sum = _mm256_setzero_si256();
+
+	for (int y = 0; y < H; y += 2) {
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(Load16x2(block1, stride), Load16x2(block2, stride)));
+		block1 += 2 * stride;
+		block2 += 2 * stride;
+	}
+
+	return HorizontalSum(sum);
+}
+
+DE_TARGET_AVX2 static void GetErrorSADx4_8x8_AVX2(const uint8_t* block, const uint8_t* const refs[4], const int stride, long out[4])
+{
+	const auto cur_top = Load8x4(block, stride);
+	const auto cur_bottom = Load8x4(block + 4 * stride, stride);
+
+	for (int i = 0; i < 4; ++i) {
+		const auto top = _mm256_sad_epu8(cur_top, Load8x4(refs[i], stride));
+		const auto bottom = _mm256_sad_epu8(cur_bottom, Load8x4(refs[i] + 4 * stride, stride));
+		out[i] = HorizontalSum(_mm256_add_epi64(top, bottom));
+	}
+}
+
+DE_TARGET_AVX2 static void GetErrorSADx4_16x16_AVX2(const uint8_t* block, const uint8_t* const refs[4], const int stride, long out[4])
+{
+	__m256i sum[4] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+
+	// Rows in the outer loop so that each row pair of the block is loaded once for all four references.
+	for (int y = 0; y < 16; y += 2) {
+		const auto ofs = y * stride;
+		const auto cur = Load16x2(block + ofs, stride);
+
+		for (int i = 0; i < 4; ++i)
+			sum[i] = _mm256_add_epi64(sum[i], _mm256_sad_epu8(cur, Load16x2(refs[i] + ofs, stride)));
+	}
+
+	for (int i = 0; i < 4; ++i)
+		out[i] = HorizontalSum(sum[i]);
+}
+
+const SADKernels kSADKernelsAVX2 = {
+	SADInstructionSet::AVX2,
+	&GetErrorSAD_4x4_SSE2,
+	&GetErrorSAD_8xH_AVX2<8>,
+	&GetErrorSAD_16xH_AVX2<16>,
+	&GetErrorSAD_8xH_AVX2<16>,
+	&GetErrorSAD_16xH_AVX2<8>,
+	&GetErrorSADx4_4x4_SSE2,
+	&GetErrorSADx4_8x8_AVX2,
+	&GetErrorSADx4_16x16_AVX2,
+};
+
+#endif
@@ -0,0 +1,111 @@
+#include "metric_kernels.hpp"
+
+#if defined(DE_ARCH_X86)
+
+#include <immintrin.h>
+
+/// Load four rows of 16 pixels into one register
+DE_TARGET_AVX512BW static inline __m512i Load16x4(const uint8_t* p, int stride)
+{
+	auto v = _mm512_castsi128_si512(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+	v = _mm512_inserti32x4(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + stride)), 1);
+	v = _mm512_inserti32x4(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 2 * stride)), 2);
+	v = _mm512_inserti32x4(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 3 * stride)), 3);
+	return v;
+}
+
+/// Load four rows of 8 pixels into one 256-bit register
+DE_TARGET_AVX512BW static inline __m256i Load8x4(const uint8_t* p, int stride)
+{
+	const auto r0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+	const auto r1 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + stride));
+	const auto r2 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + 2 * stride));
+	const auto r3 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + 3 * stride));
+	const auto lo = _mm_unpacklo_epi64(r0, r1);
+	const auto hi = _mm_unpacklo_epi64(r2, r3);
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+/// Load eight rows of 8 pixels into one register
+DE_TARGET_AVX512BW static inline __m512i Load8x8(const uint8_t* p, int stride)
+{
+	const auto lo = Load8x4(p, stride);
+	const auto hi = Load8x4(p + 4 * stride, stride);
+	return _mm512_inserti64x4(_mm512_castsi256_si512(lo), hi, 1);
+}
+
+/// Add the eight 64-bit partial sums left by vpsadbw
+DE_TARGET_AVX512BW static inline long HorizontalSum(__m512i sum)
+{
+	const auto s256 = _mm256_add_epi64(_mm512_castsi512_si256(sum), _mm512_extracti64x4_epi64(sum, 1));
+	auto s = _mm_add_epi64(_mm256_castsi256_si128(s256), _mm256_extracti128_si256(s256, 1));
+	s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+	return static_cast<long>(_mm_cvtsi128_si32(s));
+}
+
+template <int H>
+DE_TARGET_AVX512BW static long GetErrorSAD_8xH_AVX512(const uint8_t* block1, const uint8_t* block2, const int stride)
+{
+	auto sum = _mm512_setzero_si512();
+
+	for (int y = 0; y < H; y += 8) {
+		sum = _mm512_add_epi64(sum, _mm512_sad_epu8(Load8x8(block1, stride), Load8x8(block2, stride)));
+		block1 += 8 * stride;
+		block2 += 8 * stride;
+	}
+
+	return HorizontalSum(sum);
+}
+
+template <int H>
+DE_TARGET_AVX512BW static long GetErrorSAD_16xH_AVX512(const uint8_t* block1, const uint8_t* block2, const int stride)
+{
+	auto sum = _mm512_setzero_si512();
+
+	for (int y = 0; y < H; y += 4) {
+		sum = _mm512_add_epi64(sum, _mm512_sad_epu8(Load16x4(block1, stride), Load16x4(block2, stride)));
+		block1 += 4 * stride;
+		block2 += 4 * stride;
+	}
+
+	return HorizontalSum(sum);
+}
+
+DE_TARGET_AVX512BW static void GetErrorSADx4_8x8_AVX512(const uint8_t* block, const uint8_t* const refs[4], const int stride, long out[4])
+{
+	const auto cur = Load8x8(block, stride);
+
+	for (int i = 0; i < 4; ++i)
+		out[i] = HorizontalSum(_mm512_sad_epu8(cur, Load8x8(refs[i], stride)));
+}
+
+DE_TARGET_AVX512BW static void GetErrorSADx4_16x16_AVX512(const uint8_t* block, const uint8_t* const refs[4], const int stride, long out[4])
+{
+	__m512i sum[4] = { _mm512_setzero_si512(), _mm512_setzero_si512(), _mm512_setzero_si512(), _mm512_setzero_si512() };
+
+	// Rows in the outer loop so that each group of four rows is loaded once for all four references.
+	for (int y = 0; y < 16; y += 4) {
+		const auto ofs = y * stride;
+		const auto cur = Load16x4(block + ofs, stride);
+
+		for (int i = 0; i < 4; ++i)
+			sum[i] = _mm512_add_epi64(sum[i], _mm512_sad_epu8(cur, Load16x4(refs[i] + ofs, stride)));
+	}
+
+	for (int i = 0; i < 4; ++i)
+		out[i] = HorizontalSum(sum[i]);
+}
+
+const SADKernels kSADKernelsAVX512BW = {
+	SADInstructionSet::AVX512BW,
+	&GetErrorSAD_4x4_SSE2,
+	&GetErrorSAD_8xH_AVX512<8>,
+	&GetErrorSAD_16xH_AVX512<16>,
+	&GetErrorSAD_8xH_AVX512<16>,
+	&GetErrorSAD_16xH_AVX512<8>,
+	&GetErrorSADx4_4x4_SSE2,
+	&GetErrorSADx4_8x8_AVX512,
+	&GetErrorSADx4_16x16_AVX512,
+};
+
+#endif
@@ -0,0 +1,19 @@
+#pragma once
+
+// Per-instruction-set kernel tables, only meant to be used by metric.cpp.
+// A table is only defined when the target architecture can run it.
+
+#include "cpu.hpp"
+#include "metric.hpp"
+
+extern const SADKernels kSADKernelsScalar;
+
+#if defined(DE_ARCH_X86)
+extern const SADKernels kSADKernelsSSE2;
+extern const SADKernels kSADKernelsAVX2;
+extern const SADKernels kSADKernelsAVX512BW;
+
+/// 4x4 blocks fit a single SSE2 register, wider instruction sets reuse this kernel
+long GetErrorSAD_4x4_SSE2(const uint8_t* block1, const uint8_t* block2, int stride);
+void GetErrorSADx4_4x4_SSE2(const uint8_t* block, const uint8_t* const refs[4], int stride, long out[4]);
+#endif
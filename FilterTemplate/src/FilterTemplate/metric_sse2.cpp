@@ -0,0 +1,129 @@
+#include "metric_kernels.hpp"
+
+#if defined(DE_ARCH_X86)
+
+#include <cstring>
+#include <emmintrin.h>
+
+/// Load 8 pixels into the low half of a register
+DE_TARGET_SSE2 static inline __m128i Load8(const uint8_t* p)
+{
+	return _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+}
+
+/// Load two rows of 8 pixels into one register
+DE_TARGET_SSE2 static inline __m128i Load8x2(const uint8_t* p, int stride)
+{
+	return _mm_unpacklo_epi64(Load8(p), Load8(p + stride));
+}
+
+/// Load four rows of 4 pixels into one register
+DE_TARGET_SSE2 static inline __m128i Load4x4(const uint8_t* p, int stride)
+{
+	int32_t rows[4];
+	for (int i = 0; i < 4; ++i)
+		std::memcpy(&rows[i], p + i * stride, 4);
+	return _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows));
+}
+
+/// Add the two 64-bit partial sums left by psadbw
+DE_TARGET_SSE2 static inline long HorizontalSum(__m128i sum)
+{
+	sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+	return static_cast<long>(_mm_cvtsi128_si32(sum));
+}
+
+DE_TARGET_SSE2 long GetErrorSAD_4x4_SSE2(const uint8_t* block1, const uint8_t* block2, const int stride)
+{
+	return HorizontalSum(_mm_sad_epu8(Load4x4(block1, stride), Load4x4(block2, stride)));
+}
+
+template <int H>
+DE_TARGET_SSE2 static long GetErrorSAD_8xH_SSE2(const uint8_t* block1, const uint8_t* block2, const int stride)
+{
+	auto sum = _mm_setzero_si128();
+
+	for (int y = 0; y < H; y += 2) {
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(Load8x2(block1, stride), Load8x2(block2, stride)));
+		block1 += 2 * stride;
+		block2 += 2 * stride;
+	}
+
+	return HorizontalSum(sum);
+}
+
+template <int H>
+DE_TARGET_SSE2 static long GetErrorSAD_16xH_SSE2(const uint8_t* block1, const uint8_t* block2, const int stride)
+{
+	auto sum = _mm_setzero_si128();
+
+	for (int y = 0; y < H; ++y) {
+		const auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block1));
+		const auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block2));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(a, b));
+		block1 += stride;
+		block2 += stride;
+	}
+
+	return HorizontalSum(sum);
+}
+
+DE_TARGET_SSE2 void GetErrorSADx4_4x4_SSE2(const uint8_t* block, const uint8_t* const refs[4], const int stride, long out[4])
+{
+	const auto cur = Load4x4(block, stride);
+
+	for (int i = 0; i < 4; ++i)
+		out[i] = HorizontalSum(_mm_sad_epu8(cur, Load4x4(refs[i], stride)));
+}
+
+DE_TARGET_SSE2 static void GetErrorSADx4_8x8_SSE2(const uint8_t* block, const uint8_t* const refs[4], const int stride, long out[4])
+{
+	const __m128i cur[4] = {
+		Load8x2(block, stride),
+		Load8x2(block + 2 * stride, stride),
+		Load8x2(block + 4 * stride, stride),
+		Load8x2(block + 6 * stride, stride),
+	};
+
+	for (int i = 0; i < 4; ++i) {
+		auto sum = _mm_setzero_si128();
+
+		for (int y = 0; y < 4; ++y)
+			sum = _mm_add_epi64(sum, _mm_sad_epu8(cur[y], Load8x2(refs[i] + 2 * y * stride, stride)));
+
+		out[i] = HorizontalSum(sum);
+	}
+}
+
+DE_TARGET_SSE2 static void GetErrorSADx4_16x16_SSE2(const uint8_t* block, const uint8_t* const refs[4], const int stride, long out[4])
+{
+	__m128i sum[4] = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+
+	// Rows in the outer loop so that each row of the block is loaded once for all four references.
+	for (int y = 0; y < 16; ++y) {
+		const auto ofs = y * stride;
+		const auto cur = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + ofs));
+
+		for (int i = 0; i < 4; ++i) {
+			const auto ref = _mm_loadu_si128(reinterpret_cast<const __m128i*>(refs[i] + ofs));
+			sum[i] = _mm_add_epi64(sum[i], _mm_sad_epu8(cur, ref));
+		}
+	}
+
+	for (int i = 0; i < 4; ++i)
+		out[i] = HorizontalSum(sum[i]);
+}
+
+const SADKernels kSADKernelsSSE2 = {
+	SADInstructionSet::SSE2,
+	&GetErrorSAD_4x4_SSE2,
+	&GetErrorSAD_8xH_SSE2<8>,
+	&GetErrorSAD_16xH_SSE2<16>,
+	&GetErrorSAD_8xH_SSE2<16>,
+	&GetErrorSAD_16xH_SSE2<8>,
+	&GetErrorSADx4_4x4_SSE2,
+	&GetErrorSADx4_8x8_SSE2,
+	&GetErrorSADx4_16x16_SSE2,
+};
+
+#endif
@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <cstring>
+
+#include "cpu.hpp"
+#include "motion_compensation.hpp"
+
+#if defined(DE_ARCH_X86)
+#include <emmintrin.h>
+#endif
+
+/// Source of a row of a block: the reference row itself if the block lies inside the frame,
+/// otherwise the row gathered into tmp with pixels outside the frame taking the nearest edge pixel
+template<int SIZE, typename T>
+static inline const T* BlockRow(const T* src_row, int x, int mv_x, int width, bool inside, T* tmp)
+{
+	if (inside)
+		return src_row + x + mv_x;
+
+	for (int i = 0; i < SIZE && x + i < width; ++i)
+		tmp[i] = src_row[std::min(std::max(x + i + mv_x, 0), width - 1)];
+
+	return tmp;
+}
+
+template<bool STORE, bool MEASURE, typename T>
+static inline void ProcessRow(const T* src, const T* cur, T* dst, int count, uint64_t& error)
+{
+	if (STORE && dst)
+		memcpy(dst, src, count * sizeof(T));
+
+	if (MEASURE) {
+		uint32_t sum = 0;
+
+		for (int i = 0; i < count; ++i) {
+			const auto diff = int{src[i]} - cur[i];
+			sum += diff * diff;
+		}
+
+		error += sum;
+	}
+}
+
+/// Sum of squared differences between two SIZE x SIZE blocks
+template<int SIZE, typename T>
+static uint32_t BlockSquaredError_Scalar(const T* a, ptrdiff_t a_pitch, const T* b, ptrdiff_t b_pitch)
+{
+	uint32_t sum = 0;
+
+	for (int y = 0; y < SIZE; ++y) {
+		for (int x = 0; x < SIZE; ++x) {
+			const auto diff = int{a[x]} - b[x];
+			sum += diff * diff;
+		}
+
+		a += a_pitch;
+		b += b_pitch;
+	}
+
+	return sum;
+}
+
+#if defined(DE_ARCH_X86)
+
+/// Load SIZE pixels, zero extended to 16 bits; 16 pixels take two registers
+template<int SIZE>
+DE_TARGET_SSE2 static inline void LoadWords(const uint8_t* p, __m128i& lo, __m128i& hi)
+{
+	const auto zero = _mm_setzero_si128();
+	__m128i bytes;
+
+	if (SIZE == 16)
+		bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+	else if (SIZE == 8)
+		bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+	else {
+		int32_t row;
+		memcpy(&row, p, 4);
+		bytes = _mm_cvtsi32_si128(row);
+	}
+
+	lo = _mm_unpacklo_epi8(bytes, zero);
+	hi = _mm_unpackhi_epi8(bytes, zero);
+}
+
+template<int SIZE>
+DE_TARGET_SSE2 static inline void LoadWords(const int16_t* p, __m128i& lo, __m128i& hi)
+{
+	if (SIZE == 16) {
+		lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 8));
+	} else if (SIZE == 8) {
+		lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		hi = _mm_setzero_si128();
+	} else {
+		lo = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+		hi = _mm_setzero_si128();
+	}
+}
+
+/// pmaddwd squares and adds pairs of differences; 32-bit lanes do not overflow within a block
+/// and the block total is added to the 64-bit frame total by the caller.
+template<int SIZE, typename T>
+DE_TARGET_SSE2 static uint32_t BlockSquaredError_SSE2(const T* a, ptrdiff_t a_pitch, const T* b, ptrdiff_t b_pitch)
+{
+	auto sum = _mm_setzero_si128();
+
+	for (int y = 0; y < SIZE; ++y) {
+		__m128i a_lo, a_hi, b_lo, b_hi;
+		LoadWords<SIZE>(a, a_lo, a_hi);
+		LoadWords<SIZE>(b, b_lo, b_hi);
+
+		const auto diff_lo = _mm_sub_epi16(a_lo, b_lo);
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(diff_lo, diff_lo));
+
+		if (SIZE == 16) {
+			const auto diff_hi = _mm_sub_epi16(a_hi, b_hi);
+			sum = _mm_add_epi32(sum, _mm_madd_epi16(diff_hi, diff_hi));
+		}
+
+		a += a_pitch;
+		b += b_pitch;
+	}
+
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+	return static_cast<uint32_t>(_mm_cvtsi128_si32(sum));
+}
+
+#endif
+
+template<int SIZE, typename T>
+static inline uint32_t BlockSquaredError(const T* a, ptrdiff_t a_pitch, const T* b, ptrdiff_t b_pitch, bool use_sse2)
+{
+#if defined(DE_ARCH_X86)
+	if (use_sse2)
+		return BlockSquaredError_SSE2<SIZE>(a, a_pitch, b, b_pitch);
+#endif
+
+	return BlockSquaredError_Scalar<SIZE>(a, a_pitch, b, b_pitch);
+}
+
+template<int SIZE, bool STORE, bool MEASURE>
+static void CompensateBlock(const ReferencePlanes& ref, const CurrentPlanes& cur, int width, int height,
+                            uint8_t* Y, ptrdiff_t Y_pitch, int16_t* U, int16_t* V,
+                            int x, int y, const MV& mv, bool use_sse2, CompensationError& error)
+{
+	const auto dir = static_cast<int>(mv.shift_dir);
+
+	// Whole rows can be used as they are if the block and its source lie inside the frame.
+	const auto inside = x + SIZE <= width && x + mv.x >= 0 && x + SIZE + mv.x <= width;
+	const auto count = std::min(SIZE, width - x);
+	const auto y1 = std::min(y + SIZE, height);
+
+	const auto src_Y = ref.Y[dir];
+	const auto src_U = ref.U[dir];
+	const auto src_V = ref.V[dir];
+
+	// Blocks inside the frame vertically as well are measured as a whole.
+	if (inside && y + SIZE <= height && y + mv.y >= 0 && y + SIZE + mv.y <= height) {
+		const auto p_Y = src_Y + (y + mv.y) * ref.Y_pitch + x + mv.x;
+		const auto p_U = src_U + (y + mv.y) * width + x + mv.x;
+		const auto p_V = src_V + (y + mv.y) * width + x + mv.x;
+
+		if (STORE) {
+			for (int row = 0; row < SIZE; ++row) {
+				memcpy(Y + (y + row) * Y_pitch + x, p_Y + row * ref.Y_pitch, SIZE);
+
+				if (U) {
+					memcpy(U + (y + row) * width + x, p_U + row * width, SIZE * sizeof(int16_t));
+					memcpy(V + (y + row) * width + x, p_V + row * width, SIZE * sizeof(int16_t));
+				}
+			}
+		}
+
+		if (MEASURE) {
+			error.Y += BlockSquaredError<SIZE>(p_Y, ref.Y_pitch, cur.Y + y * cur.Y_pitch + x, cur.Y_pitch, use_sse2);
+			error.U += BlockSquaredError<SIZE>(p_U, width, cur.U + y * width + x, width, use_sse2);
+			error.V += BlockSquaredError<SIZE>(p_V, width, cur.V + y * width + x, width, use_sse2);
+		}
+
+		return;
+	}
+
+	uint8_t tmp_Y[SIZE];
+	int16_t tmp_U[SIZE], tmp_V[SIZE];
+
+	for (int row = y; row < y1; ++row) {
+		const auto src_row = std::min(std::max(row + mv.y, 0), height - 1);
+
+		const auto p_Y = BlockRow<SIZE>(src_Y + src_row * ref.Y_pitch, x, mv.x, width, inside, tmp_Y);
+		const auto p_U = BlockRow<SIZE>(src_U + src_row * width, x, mv.x, width, inside, tmp_U);
+		const auto p_V = BlockRow<SIZE>(src_V + src_row * width, x, mv.x, width, inside, tmp_V);
+
+		// Planes left out are null.
+		const auto cur_Y = MEASURE ? cur.Y + row * cur.Y_pitch + x : nullptr;
+		const auto cur_U = MEASURE ? cur.U + row * width + x : nullptr;
+		const auto cur_V = MEASURE ? cur.V + row * width + x : nullptr;
+
+		const auto dst_Y = STORE ? Y + row * Y_pitch + x : nullptr;
+		const auto dst_U = STORE && U ? U + row * width + x : nullptr;
+		const auto dst_V = STORE && V ? V + row * width + x : nullptr;
+
+		// A constant count lets the compiler unroll rows that need no clamping.
+		if (inside) {
+			ProcessRow<STORE, MEASURE>(p_Y, cur_Y, dst_Y, SIZE, error.Y);
+			ProcessRow<STORE, MEASURE>(p_U, cur_U, dst_U, SIZE, error.U);
+			ProcessRow<STORE, MEASURE>(p_V, cur_V, dst_V, SIZE, error.V);
+		} else {
+			ProcessRow<STORE, MEASURE>(p_Y, cur_Y, dst_Y, count, error.Y);
+			ProcessRow<STORE, MEASURE>(p_U, cur_U, dst_U, count, error.U);
+			ProcessRow<STORE, MEASURE>(p_V, cur_V, dst_V, count, error.V);
+		}
+	}
+}
+
+template<bool STORE, bool MEASURE>
+static void Compensate(const MVField& vectors, const ReferencePlanes& ref, const CurrentPlanes& cur,
+                       int width, int height, uint8_t* Y, ptrdiff_t Y_pitch, int16_t* U, int16_t* V,
+                       CompensationError& error)
+{
+#if defined(DE_ARCH_X86)
+	const auto use_sse2 = GetCPUFeatures().sse2;
+#else
+	const auto use_sse2 = false;
+#endif
+
+	vectors.ForEachLeafBlock([&](int x, int y, int size, const MV& mv) {
+		// Blocks on the right and bottom edges may reach past a frame that is not a multiple of 16.
+		if (x >= width || y >= height)
+			return;
+
+		switch (size) {
+		case 16:
+			CompensateBlock<16, STORE, MEASURE>(ref, cur, width, height, Y, Y_pitch, U, V, x, y, mv, use_sse2, error);
+			break;
+		case 8:
+			CompensateBlock<8, STORE, MEASURE>(ref, cur, width, height, Y, Y_pitch, U, V, x, y, mv, use_sse2, error);
+			break;
+		default:
+			CompensateBlock<4, STORE, MEASURE>(ref, cur, width, height, Y, Y_pitch, U, V, x, y, mv, use_sse2, error);
+			break;
+		}
+	});
+}
+
+void CompensateBlocks(const MVField& vectors, const ReferencePlanes& ref, int width, int height,
+                      uint8_t* Y, ptrdiff_t Y_pitch, int16_t* U, int16_t* V)
+{
+	const CurrentPlanes none = { nullptr, 0, nullptr, nullptr };
+	CompensationError error;
+
+	Compensate<true, false>(vectors, ref, none, width, height, Y, Y_pitch, U, V, error);
+}
+
+void CompensateAndMeasure(const MVField& vectors, const ReferencePlanes& ref, const CurrentPlanes& cur,
+                          int width, int height, uint8_t* Y, ptrdiff_t Y_pitch, int16_t* U, int16_t* V,
+                          CompensationError& error)
+{
+	if (Y)
+		Compensate<true, true>(vectors, ref, cur, width, height, Y, Y_pitch, U, V, error);
+	else
+		Compensate<false, true>(vectors, ref, cur, width, height, Y, Y_pitch, U, V, error);
+}
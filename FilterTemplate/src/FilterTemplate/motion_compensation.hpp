@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "mv_field.hpp"
+
+/// Planes of a reference frame by shift direction, null where no vector of the frame uses the direction.
+struct ReferencePlanes {
+	/// First visible pixel of the Y planes, Y_pitch apart
+	const uint8_t* Y[4];
+	ptrdiff_t Y_pitch;
+
+	/// U and V planes, pitch equal to the frame width
+	const int16_t* U[4];
+	const int16_t* V[4];
+};
+
+/// Planes of the frame being compensated, to measure the error of the compensation against
+struct CurrentPlanes {
+	/// First visible pixel of the Y plane
+	const uint8_t* Y;
+	ptrdiff_t Y_pitch;
+
+	/// U and V planes, pitch equal to the frame width
+	const int16_t* U;
+	const int16_t* V;
+};
+
+/// Sums of squared differences between the compensated and the current frame
+struct CompensationError {
+	uint64_t Y = 0;
+	uint64_t U = 0;
+	uint64_t V = 0;
+};
+
+/**
+ * Build the motion compensated frame block by block.
+ *
+ * Every unsplit block of the field, down to 4x4, is copied from the reference one row at a time.
+ * Pixels the vector points outside the frame take the nearest edge pixel, only blocks that
+ * reach past an edge pay for it.
+ *
+ * @param[in] vectors motion vectors of the frame
+ * @param[in] ref reference planes
+ * @param[in] width frame width
+ * @param[in] height frame height
+ * @param[out] Y compensated Y plane
+ * @param[in] Y_pitch pitch of the compensated Y plane
+ * @param[out] U compensated U plane, pitch equal to the width
+ * @param[out] V compensated V plane, pitch equal to the width
+ */
+void CompensateBlocks(const MVField& vectors, const ReferencePlanes& ref, int width, int height,
+                      uint8_t* Y, ptrdiff_t Y_pitch, int16_t* U, int16_t* V);
+
+/**
+ * CompensateBlocks and the squared error against the current frame in the same pass,
+ * so the reference and the current frame are read once. Blocks inside the frame are
+ * measured with SSE2 where available.
+ *
+ * @param[in] vectors motion vectors of the frame
+ * @param[in] ref reference planes
+ * @param[in] cur current frame
+ * @param[in] width frame width
+ * @param[in] height frame height
+ * @param[out] Y compensated Y plane, or null with U and V null to only measure the error
+ * @param[in] Y_pitch pitch of the compensated Y plane
+ * @param[out] U compensated U plane, pitch equal to the width, or null with V null to store Y only
+ * @param[out] V compensated V plane, pitch equal to the width
+ * @param[in,out] error squared error per plane, added to
+ */
+void CompensateAndMeasure(const MVField& vectors, const ReferencePlanes& ref, const CurrentPlanes& cur,
+                          int width, int height, uint8_t* Y, ptrdiff_t Y_pitch, int16_t* U, int16_t* V,
+                          CompensationError& error);
@@ -1,46 +1,24 @@
-#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <thread>
 
 #include "motion_estimator.hpp"
 #include "mat.h"
 
-const int thresholds[5][3][3] = {
-	{
-		{ 768, 768, 512 },
-		{ 256, 256, 192 },
-		{ 256, 256, 192 }
-	},
-	{
-		{ 768, 768, 512 },
-		{ 256, 256, 192 },
-		{ 256, 256, 192 }
-	},
-	{
-		{ 768, 768, 512 },
-		{ 256, 256, 192 },
-		{ 256, 256, 192 }
-	},
-	{
-		{ 768, 768, 512 },
-		{ 256, 256, 192 },
-		{ 256, 256, 192 }
-	},
-	{
-		{ 768, 768, 512 },
-		{ 256, 256, 192 },
-		{ 256, 256, 192 }
-	}
-};
-
-
-MotionEstimator::MotionEstimator(int width, int height, uint8_t quality, bool use_half_pixel)
+MotionEstimator::MotionEstimator(int width, int height, uint8_t quality, bool use_half_pixel, int num_threads, MotionSearch search, EarlyTermination termination)
 	: width(width)
 	, height(height)
 	, quality(quality)
 	, use_half_pixel(use_half_pixel)
+	, search(search)
+	, termination(termination)
 	, width_ext(width + 2 * BORDER)
 	, num_blocks_hor((width + BLOCK_SIZE - 1) / BLOCK_SIZE)
 	, num_blocks_vert((height + BLOCK_SIZE - 1) / BLOCK_SIZE)
 	, first_row_offset(width_ext * BORDER + BORDER)
+	, sad(GetSADKernels())
 {
 
 	if (quality > 90) {
@@ -76,137 +54,145 @@ MotionEstimator::MotionEstimator(int width, int height, uint8_t quality, bool us
 
 	img_size = width_ext * height;
 
-	prev = NULL;
-	//prev = new MV[height*width];
+	if (num_threads != 1) {
+		pool = std::make_unique<ThreadPool>(num_threads);
+	}
+
+	if (search == MotionSearch::PREDICTIVE) {
+		row_progress = std::make_unique<std::atomic<int>[]>(num_blocks_vert);
+	}
+
+	prev = MVField(num_blocks_hor, num_blocks_vert);
+	has_prev = false;
+
+	if (termination == EarlyTermination::CALIBRATED) {
+		row_errors.resize(num_blocks_vert);
+	}
+	error_scale8 = 1.0;
 }
 
 MotionEstimator::~MotionEstimator() {
-	delete[] prev;
 }
 
 void MotionEstimator::Estimate(const uint8_t* cur_Y,
 	const uint8_t* prev_Y,
-	const uint8_t* prev_Y_up,
-	const uint8_t* prev_Y_left,
-	const uint8_t* prev_Y_upleft,
-	MV* mvectors) {
-	//FullSearch(cur_Y, prev_Y, prev_Y_up, prev_Y_left, prev_Y_upleft, mvectors);
-	ARPS(cur_Y, prev_Y, prev_Y_up, prev_Y_left, prev_Y_upleft, mvectors);
-}
+	HalfpixelCache* prev_half_pixel,
+	const LumaPyramid* cur_pyramid,
+	const LumaPyramid* prev_pyramid,
+	MVField& mvectors) {
+	const auto half_pixel = use_half_pixel ? prev_half_pixel : nullptr;
+
+	std::fill(row_errors.begin(), row_errors.end(), ErrorSums());
+
+	if (search == MotionSearch::HIERARCHICAL && cur_pyramid && prev_pyramid)
+		Hierarchical(cur_Y, prev_Y, half_pixel, *cur_pyramid, *prev_pyramid, mvectors);
+	else if (search == MotionSearch::PREDICTIVE)
+		Predictive(cur_Y, prev_Y, half_pixel, mvectors);
+	else
+		ARPS(cur_Y, prev_Y, half_pixel, mvectors);
+
+	// Calibrate the next frame on this one, the first frame matches itself and tells nothing.
+	ErrorSums total;
+
+	for (const auto& row : row_errors) {
+		for (int k = 0; k < 2; ++k) {
+			total.sum[k] += row.sum[k];
+			total.count[k] += row.count[k];
+		}
+	}
 
-void MotionEstimator::FullSearch(const uint8_t* cur_Y,
-	const uint8_t* prev_Y,
-	const uint8_t* prev_Y_up,
-	const uint8_t* prev_Y_left,
-	const uint8_t* prev_Y_upleft,
-	MV* mvectors)
-{
-	std::unordered_map<ShiftDir, const uint8_t*> prev_map{
-		{ ShiftDir::NONE, prev_Y }
-	};
+	if (total.count[0] > 0 && total.count[1] > 0 && total.sum[1] > 0) {
+		error_scale8 = (total.sum[0] / total.count[0]) / (total.sum[1] / total.count[1]);
+	}
 
-	/*if (use_half_pixel) {
-		prev_map.emplace(ShiftDir::UP, prev_Y_up);
-		prev_map.emplace(ShiftDir::LEFT, prev_Y_left);
-		prev_map.emplace(ShiftDir::UPLEFT, prev_Y_upleft);
-	}*/
+	// Same size every frame, so this reuses the storage of prev.
+	prev = mvectors;
+	has_prev = true;
+}
 
-	for (int i = 0; i < num_blocks_vert; ++i) {
-		for (int j = 0; j < num_blocks_hor; ++j) {
-			const auto block_id = i * num_blocks_hor + j;
-			const auto hor_offset = j * BLOCK_SIZE;
-			const auto vert_offset = first_row_offset + i * BLOCK_SIZE * width_ext;
-			const auto cur = cur_Y + vert_offset + hor_offset;
+/// Tells whether the window a candidate is scored over may be read
+using WindowCheck = bool(*)(const MV& mv, const uint8_t *window, const int stride, const uint8_t *prev_Y, const int first_row_offset, const int img_size);
 
-			MV best_vector;
-			best_vector.error = std::numeric_limits<long>::max();
-
-			// Split into four subvectors if the error is too large
-			best_vector.Split();
-
-			for (int h = 0; h < 4; ++h) {
-				auto& best8 = best_vector.SubVector(h);
-				best8.error = std::numeric_limits<long>::max();
-				best8.Split();
-
-				for (int h2 = 0; h2 < 4; ++h2) {
-					auto& best4 = best8.SubVector(h2);
-					best4.error = std::numeric_limits<long>::max();
-
-					const auto hor_offset = j * BLOCK_SIZE + ((h & 1) ? BLOCK_SIZE / 2 : 0) + ((h2 & 1) ? BLOCK_SIZE / 4 : 0);
-					const auto vert_offset = first_row_offset + (i * BLOCK_SIZE + ((h > 1) ? BLOCK_SIZE / 2 : 0) + ((h2 > 1) ? BLOCK_SIZE / 4 : 0)) * width_ext;
-					const auto cur = cur_Y + vert_offset + hor_offset;
-						
-					for (const auto& prev_pair : prev_map) {
-						const auto prev = prev_pair.second + vert_offset + hor_offset;
-
-						for (int y = -6; y <= 6; ++y) {
-							for (int x = -BORDER; x <= BORDER; ++x) {
-								const auto comp = prev + y * width_ext + x;
-									
-								auto shifted1 = cur - 2 * width_ext - 2;
-								auto shifted2 = comp - 2 * width_ext - 2;
-
-									
-								if (shifted2 < prev_pair.second || shifted2 > prev_pair.second + first_row_offset + img_size) {
-									continue;
-								}
-
-								const auto error = GetErrorSAD_8x8(shifted1, shifted2, width_ext);
-								if (error < best4.error) {
-									best4.x = x;
-									best4.y = y;
-									best4.shift_dir = prev_pair.first;
-									best4.error = error;
-								}
-							}
-						}
-					}
-				}
-
-				best8.x = best8.SubVector(0).x;
-				best8.y = best8.SubVector(0).y;
+/// Whether the columns of a SIZE wide window lie inside the plane. The column is taken from
+/// the block the vector starts at, since a window past the left edge has the same address
+/// as one at the end of the row above.
+template <int SIZE>
+inline bool InColumns(const MV& mv, const uint8_t *window, const int stride, const uint8_t *prev_Y) {
+	const auto column = static_cast<int>((window - mv.y * stride - mv.x - prev_Y) % stride) + mv.x;
+	return column >= 0 && column + SIZE <= stride;
+}
 
-			}
-		
-			mvectors[block_id] = best_vector;
-		}
+/// The SIZE x SIZE window starts at a frame or border pixel and does not wrap around a row
+template <int SIZE>
+inline bool InFrame(const MV& mv, const uint8_t *window, const int stride, const uint8_t *prev_Y, const int first_row_offset, const int img_size) {
+	if (window < prev_Y + first_row_offset || window > prev_Y + first_row_offset + img_size) {
+		return false;
 	}
-}
 
+	return InColumns<SIZE>(mv, window, stride, prev_Y);
+}
 
-void SafeSAD_16x16(MV& mv, const uint8_t *block1, const uint8_t *block2, const int stride, const uint8_t *prev_Y, const int first_row_offset, const int img_size) {
-	if (block2 < prev_Y + first_row_offset || block2 > prev_Y + first_row_offset + img_size) {
-		mv.error = std::numeric_limits<long>::max();
-		return;
+inline bool InSearchWindow4x4(const MV& mv, const uint8_t *window, const int, const uint8_t *prev_Y, const int first_row_offset, const int img_size) {
+	if (abs(mv.x) > 15 || abs(mv.y) > 6) {
+		return false;
 	}
-	mv.error = GetErrorSAD_16x16(block1, block2, stride);
+
+	return !(window < prev_Y || window > prev_Y + first_row_offset + img_size);
 }
 
-void SafeSAD_8x8(MV& mv, const uint8_t *block1, const uint8_t *block2, const int stride, const uint8_t *prev_Y, const int first_row_offset, const int img_size) {
-	if (block2 < prev_Y + first_row_offset || block2 > prev_Y + first_row_offset + img_size) {
-		mv.error = std::numeric_limits<long>::max();
-		return;
+// Vectors found on the pyramid may be longer than the 4x4 search window allows, this
+// only checks that the 8x8 window stays inside the plane, without wrapping around a row.
+
+inline bool InPlane8x8(const MV& mv, const uint8_t *window, const int stride, const uint8_t *prev_Y, const int first_row_offset, const int img_size) {
+	if (window < prev_Y || window > prev_Y + first_row_offset + img_size) {
+		return false;
 	}
-	mv.error = GetErrorSAD_8x8(block1, block2, stride);
+
+	return InColumns<8>(mv, window, stride, prev_Y);
 }
 
-void SafeSAD_4x4(MV& mv, const uint8_t *block1, const uint8_t *block2, const int stride, const uint8_t *prev_Y, const int first_row_offset, const int img_size) {
-	auto shifted1 = block1 - 2 * stride - 2;
-	auto shifted2 = block2 - 2 * stride - 2;
-	
-	if (abs(mv.x) > 15 || abs(mv.y) > 6) {
-		mv.error = std::numeric_limits<long>::max();
-		return;
+/// SAD of candidates that are checked with VALID first, over the window starting OFFSET pixels
+/// above and to the left of the block. 4x4 blocks are compared over the 8x8 window around them.
+template <SADFunc SADKernels::*KERNEL, SADx4Func SADKernels::*KERNEL_X4, int OFFSET, WindowCheck VALID>
+struct CheckedSAD {
+	static void Single(MV& mv, const SADKernels& sad, const uint8_t *block1, const uint8_t *block2, const int stride, const uint8_t *prev_Y, const int first_row_offset, const int img_size) {
+		const auto shift = OFFSET * stride + OFFSET;
+		const auto window2 = block2 - shift;
+
+		if (!VALID(mv, window2, stride, prev_Y, first_row_offset, img_size)) {
+			mv.error = std::numeric_limits<long>::max();
+			return;
+		}
+
+		mv.error = (sad.*KERNEL)(block1 - shift, window2, stride);
 	}
 
-	if (shifted2 < prev_Y || shifted2 > prev_Y + first_row_offset + img_size) {
-		mv.error = std::numeric_limits<long>::max();
-		return;
+	/// Score four candidates with one kernel call. Candidates failing VALID are scored
+	/// against the current block itself and then discarded.
+	static void Batch(MV *mvs, const SADKernels& sad, const uint8_t *block1, const uint8_t *const *block2, const int stride, const uint8_t *prev_Y, const int first_row_offset, const int img_size) {
+		const auto shift = OFFSET * stride + OFFSET;
+		const auto window1 = block1 - shift;
+		const uint8_t *refs[4];
+		bool valid[4];
+		long errors[4];
+
+		for (int i = 0; i < 4; ++i) {
+			const auto window2 = block2[i] - shift;
+			valid[i] = VALID(mvs[i], window2, stride, prev_Y, first_row_offset, img_size);
+			refs[i] = valid[i] ? window2 : window1;
+		}
+
+		(sad.*KERNEL_X4)(window1, refs, stride, errors);
+
+		for (int i = 0; i < 4; ++i)
+			mvs[i].error = valid[i] ? errors[i] : std::numeric_limits<long>::max();
 	}
-	
-	mv.error = GetErrorSAD_8x8(shifted1, shifted2, stride);
-}
+};
+
+using SafeSAD_16x16 = CheckedSAD<&SADKernels::sad_16x16, &SADKernels::sad_16x16_x4, 0, &InFrame<16>>;
+using SafeSAD_8x8 = CheckedSAD<&SADKernels::sad_8x8, &SADKernels::sad_8x8_x4, 0, &InFrame<8>>;
+using SafeSAD_4x4 = CheckedSAD<&SADKernels::sad_8x8, &SADKernels::sad_8x8_x4, 2, &InSearchWindow4x4>;
+using WideSAD_4x4 = CheckedSAD<&SADKernels::sad_8x8, &SADKernels::sad_8x8_x4, 2, &InPlane8x8>;
 
 
 inline void update(MV& best, const MV& mv) {
@@ -215,17 +201,91 @@ inline void update(MV& best, const MV& mv) {
 	}
 }
 
+/// An 8x8 window of one pyramid level, compared against the previous frame's level
+struct LevelWindow {
+	const uint8_t* cur;
+	const uint8_t* prev;
+	int pitch;
+	int x, y;
+	int width, height;
+	/// How far the window may move past the edges of the level
+	int margin;
+};
+
+static LevelWindow MakeLevelWindow(const LumaPyramid& cur_pyramid, const LumaPyramid& prev_pyramid, int level, int x, int y, int margin) {
+	const auto pitch = cur_pyramid.Pitch(level);
+	return { cur_pyramid.Plane(level) + y * pitch + x, prev_pyramid.Plane(level) + y * pitch + x, pitch,
+	         x, y, cur_pyramid.Width(level), cur_pyramid.Height(level), margin };
+}
+
+/// Whether the window moved by mv stays inside the level and its margin
+static inline bool InLevel(const LevelWindow& window, const MV& mv) {
+	constexpr int size = 8;
+	const auto x = window.x + mv.x;
+	const auto y = window.y + mv.y;
+
+	return x >= -window.margin && y >= -window.margin
+		&& x + size <= window.width + window.margin && y + size <= window.height + window.margin;
+}
+
+static void LevelSAD(const SADKernels& sad, const LevelWindow& window, MV& mv) {
+	mv.error = InLevel(window, mv)
+		? sad.sad_8x8(window.cur, window.prev + mv.y * window.pitch + mv.x, window.pitch)
+		: std::numeric_limits<long>::max();
+}
+
+/// Try the candidates (center + step * (dx, dy)) for dx, dy in [-radius, radius], four at a time
+static void SearchLevel(const SADKernels& sad, const LevelWindow& window, int radius, int step, MV& best) {
+	const auto center = best;
+	MV batch[4];
+	int count = 0;
+
+	const auto flush = [&]() {
+		const uint8_t *refs[4];
+		bool valid[4];
+		long errors[4];
 
-template <void(*SAD)(MV&, const uint8_t *, const uint8_t *, const int, const uint8_t *, const int, const int)>
-void MotionEstimator::EstimateAtLevel(bool at_edge, const uint8_t *prev_Y, const uint8_t *cur, const uint8_t *prev, MV& predicted, MV& best) {
-	auto comp = prev;
+		for (int k = 0; k < 4; ++k) {
+			valid[k] = k < count && InLevel(window, batch[k]);
+			refs[k] = valid[k] ? window.prev + batch[k].y * window.pitch + batch[k].x : window.cur;
+		}
+
+		sad.sad_8x8_x4(window.cur, refs, window.pitch, errors);
+
+		for (int k = 0; k < count; ++k) {
+			batch[k].error = valid[k] ? errors[k] : std::numeric_limits<long>::max();
+			update(best, batch[k]);
+		}
+
+		count = 0;
+	};
+
+	for (int dy = -radius; dy <= radius; ++dy) {
+		for (int dx = -radius; dx <= radius; ++dx) {
+			if (dx == 0 && dy == 0)
+				continue;
+
+			batch[count++] = MV(center.x + dx * step, center.y + dy * step);
+
+			if (count == 4)
+				flush();
+		}
+	}
+
+	if (count > 0)
+		flush();
+}
+
+
+template <MotionEstimator::SafeSADFunc SAD, MotionEstimator::SafeSADx4Func SADx4, int SIZE>
+void MotionEstimator::EstimateAtLevel(const Thresholds& thresholds, bool at_edge, const uint8_t *prev_Y, HalfpixelCache* prev_half_pixel, const uint8_t *cur, const uint8_t *prev, MV& predicted, MV& best) {
 	MV current;
 
 	// check center (ZMP)
-	SAD(current, cur, comp, width_ext, prev_Y, first_row_offset, img_size);
+	SAD(current, sad, cur, prev, width_ext, prev_Y, first_row_offset, img_size);
 	update(best, current);
 
-	if (best.error < zmp_threshold) {
+	if (best.error < thresholds.zmp) {
 		return;
 	}
 
@@ -236,199 +296,625 @@ void MotionEstimator::EstimateAtLevel(bool at_edge, const uint8_t *prev_Y, const
 		// only search center
 	}
 	else {
-		// serach four rood points
-		// 1
-		current.x = -arm_length;
-		comp = prev - arm_length;
-		SAD(current, cur, comp, width_ext, prev_Y, first_row_offset, img_size);
-		update(best, current);
-		// 2
-		current.x = arm_length;
-		comp = prev + arm_length;
-		SAD(current, cur, comp, width_ext, prev_Y, first_row_offset, img_size);
-		update(best, current);
-		// 3
-		current.x = 0;
-		current.y = -arm_length;
-		comp = prev - arm_length * width_ext;
-		SAD(current, cur, comp, width_ext, prev_Y, first_row_offset, img_size);
-		update(best, current);
-		// 4
-		current.y = arm_length;
-		comp = prev + arm_length * width_ext;
-		SAD(current, cur, comp, width_ext, prev_Y, first_row_offset, img_size);
-		update(best, current);
+		// search four rood points in one batch
+		MV arms[4] = {
+			MV(-arm_length, 0),
+			MV(arm_length, 0),
+			MV(0, -arm_length),
+			MV(0, arm_length)
+		};
+		const uint8_t *comps[4] = {
+			prev - arm_length,
+			prev + arm_length,
+			prev - arm_length * width_ext,
+			prev + arm_length * width_ext
+		};
+		SADx4(arms, sad, cur, comps, width_ext, prev_Y, first_row_offset, img_size);
+		for (const auto& arm : arms) {
+			update(best, arm);
+		}
 
-		// also search predicted MV
+		// also search predicted MV, at its whole-pixel position since this is the whole-pixel plane
 		if (!at_edge && predicted.x != 0 && predicted.y != 0) {
+			MV candidate(predicted.x, predicted.y);
 			const auto comp = prev + predicted.y * width_ext + predicted.x;
-			SAD(predicted, cur, comp, width_ext, prev_Y, first_row_offset, img_size); // fixme
-			update(best, predicted);
+			SAD(candidate, sad, cur, comp, width_ext, prev_Y, first_row_offset, img_size); // fixme
+			update(best, candidate);
 		}
 	}
 
-	if (best.error < first_threshold) {
+	if (best.error < thresholds.first) {
 		return;
 	}
 
 	// Local search (URP)
+	SearchSmallDiamond<SADx4>(prev_Y, cur, prev, thresholds.first, best);
+
+	if (prev_half_pixel && best.error > thresholds.second) {
+		RefineHalfPixel<SAD, SIZE>(prev_Y, *prev_half_pixel, cur, prev, best);
+	}
+}
+
+template <MotionEstimator::SafeSADx4Func SADx4>
+void MotionEstimator::SearchSmallDiamond(const uint8_t *prev_Y, const uint8_t *cur, const uint8_t *prev, long threshold, MV& best) {
+	// The four neighbours of the current best in one batch
+	int center_x, center_y;
 	do {
-		current = best;
-		const auto base = prev + current.y * width_ext + current.x;
-		// 1
-		current.x -= 1;
-		comp = base - 1;
-		SAD(current, cur, comp, width_ext, prev_Y, first_row_offset, img_size);
-		update(best, current);
-		// 2
-		current.x += 2;
-		comp = base + 1;
-		SAD(current, cur, comp, width_ext, prev_Y, first_row_offset, img_size);
-		update(best, current);
-		// 3
-		current.x -= 1;
-		current.y -= 1;
-		comp = base - width_ext;
-		SAD(current, cur, comp, width_ext, prev_Y, first_row_offset, img_size);
-		update(best, current);
-		// 4
-		current.y += 2;
-		comp = base + width_ext;
-		SAD(current, cur, comp, width_ext, prev_Y, first_row_offset, img_size);
-		update(best, current);
-		current.y -= 1;
-	} while (!(best.error < first_threshold) && (current.x != best.x || current.y != best.y));
-
-	/*if (use_half_pixel && best.error > second_threshold) {
-		current = best;
-		auto ofs = vert_offset + hor_offset + current.y * width_ext + current.x;
-		// 1
-		current.shift_dir = ShiftDir::LEFT;
-		comp = prev_Y_left + ofs;
-		SAD(current, cur, comp, width_ext, prev_Y_left);
-		update(best, current);
-		// 2
-		current.shift_dir = ShiftDir::LEFT;
-		current.x += 1;
-		comp = prev_Y_left + ofs + 1;
-		SAD(current, cur, comp, width_ext, prev_Y_left);
-		update(best, current);
-		current.x -= 1;
-		// 3
-		current.shift_dir = ShiftDir::UP;
-		comp = prev_Y_up + ofs;
-		SAD(current, cur, comp, width_ext, prev_Y_up);
-		update(best, current);
-		// 4
-		current.shift_dir = ShiftDir::UP;
-		current.y += 1;
-		comp = prev_Y_up + ofs + width_ext;
-		SAD(current, cur, comp, width_ext, prev_Y_up);
-		update(best, current);
-		current.y -= 1;
-
-		if (best.shift_dir == ShiftDir::UP) {
-			current = best;
-			// 1
-			current.shift_dir = ShiftDir::UPLEFT;
-			comp = prev_Y_upleft + ofs;
-			SAD(current, cur, comp, width_ext, prev_Y_upleft);
-			update(best, current);
-			// 2
-			current.shift_dir = ShiftDir::UPLEFT;
-			current.x += 1;
-			comp = prev_Y_upleft + ofs + 1;
-			SAD(current, cur, comp, width_ext, prev_Y_upleft);
-			update(best, current);
+		center_x = best.x;
+		center_y = best.y;
+		const auto shift_dir = best.shift_dir;
+		const auto base = prev + center_y * width_ext + center_x;
+
+		MV neighbours[4] = {
+			MV(center_x - 1, center_y, shift_dir),
+			MV(center_x + 1, center_y, shift_dir),
+			MV(center_x, center_y - 1, shift_dir),
+			MV(center_x, center_y + 1, shift_dir)
+		};
+		const uint8_t *comps[4] = {
+			base - 1,
+			base + 1,
+			base - width_ext,
+			base + width_ext
+		};
+		SADx4(neighbours, sad, cur, comps, width_ext, prev_Y, first_row_offset, img_size);
+		for (const auto& neighbour : neighbours) {
+			update(best, neighbour);
+		}
+	} while (!(best.error < threshold) && (center_x != best.x || center_y != best.y));
+}
 
+template <MotionEstimator::SafeSADFunc SAD, MotionEstimator::SafeSADx4Func SADx4, int SIZE, typename Gather>
+void MotionEstimator::EstimateFromPredictors(const uint8_t *prev_Y, HalfpixelCache* prev_half_pixel, const uint8_t *cur, const uint8_t *prev, const MV& first, Gather gather, MV& best) {
+	// The leading predictor alone first, on smooth motion it is usually right
+	MV current(first.x, first.y);
+	SAD(current, sad, cur, prev + current.y * width_ext + current.x, width_ext, prev_Y, first_row_offset, img_size);
+	update(best, current);
+
+	if (best.error < zmp_threshold) {
+		return;
+	}
+
+	MV predictors[MAX_PREDICTORS];
+	long threshold;
+	const auto count = gather(predictors, threshold);
+
+	// The others four at a time, skipping repeated ones
+	MV batch[4];
+	const uint8_t *comps[4];
+	int batched = 0;
+
+	for (int k = 0; k <= count; ++k) {
+		if (k < count) {
+			const auto& candidate = predictors[k];
+			const auto repeated = (candidate.x == first.x && candidate.y == first.y)
+				|| std::any_of(predictors, predictors + k, [&](const MV& other) {
+					return other.x == candidate.x && other.y == candidate.y;
+				});
+
+			if (!repeated) {
+				batch[batched] = MV(candidate.x, candidate.y);
+				comps[batched] = prev + candidate.y * width_ext + candidate.x;
+				++batched;
+			}
 		}
 
-		if (best.shift_dir == ShiftDir::LEFT) {
-			current = best;
-			// 3
-			current.shift_dir = ShiftDir::UPLEFT;
-			comp = prev_Y_upleft + ofs;
-			SAD(current, cur, comp, width_ext, prev_Y_upleft);
-			update(best, current);
-			// 4
-			current.shift_dir = ShiftDir::UPLEFT;
-			current.y += 1;
-			comp = prev_Y_upleft + ofs + width_ext;
-			SAD(current, cur, comp, width_ext, prev_Y_upleft);
-			update(best, current);
+		if (batched == 4 || (k == count && batched > 0)) {
+			// Unused slots repeat the first candidate
+			for (int slot = batched; slot < 4; ++slot) {
+				batch[slot] = batch[0];
+				comps[slot] = comps[0];
+			}
+
+			SADx4(batch, sad, cur, comps, width_ext, prev_Y, first_row_offset, img_size);
+			for (int slot = 0; slot < batched; ++slot) {
+				update(best, batch[slot]);
+			}
+			batched = 0;
 		}
-	}*/
+	}
+
+	if (best.error < threshold) {
+		return;
+	}
+
+	SearchSmallDiamond<SADx4>(prev_Y, cur, prev, threshold, best);
+
+	if (prev_half_pixel && best.error > second_threshold) {
+		RefineHalfPixel<SAD, SIZE>(prev_Y, *prev_half_pixel, cur, prev, best);
+	}
+}
+
+template <MotionEstimator::SafeSADFunc SAD, int SIZE>
+void MotionEstimator::RefineHalfPixel(const uint8_t *prev_Y, HalfpixelCache& prev_half_pixel, const uint8_t *cur, const uint8_t *prev, MV& best) {
+	// 4x4 blocks are compared over the 8x8 window around them, see SafeSAD_4x4.
+	constexpr int margin = SIZE < 8 ? (8 - SIZE) / 2 : 0;
+	constexpr int window = SIZE + 2 * margin;
+
+	const auto offset = prev - prev_Y;
+	const auto block_x = static_cast<int>(offset % width_ext);
+	const auto block_y = static_cast<int>(offset / width_ext);
+
+	// A shifted plane holds the pixels half a pixel right of and/or below the source ones.
+	// Only the window the SAD reads is interpolated, so candidates whose window leaves the
+	// plane are skipped rather than compared against tiles nobody prepared.
+	const auto check = [&](int x, int y, ShiftDir shift_dir) {
+		const auto window_x = block_x + x - margin;
+		const auto window_y = block_y + y - margin;
+
+		if (window_x < 0 || window_y < 0 || window_x + window > width_ext || window_y + window > height + 2 * BORDER)
+			return;
+
+		const auto plane = prev_half_pixel.Prepare(shift_dir, window_x, window_y, window, window);
+		const auto comp = plane + offset + y * width_ext + x;
+
+		MV current(x, y, shift_dir);
+		SAD(current, sad, cur, comp, width_ext, plane, first_row_offset, img_size);
+		update(best, current);
+	};
+
+	const auto center = best;
+
+	check(center.x, center.y, ShiftDir::LEFT);
+	check(center.x - 1, center.y, ShiftDir::LEFT);
+	check(center.x, center.y, ShiftDir::UP);
+	check(center.x, center.y - 1, ShiftDir::UP);
+
+	// Diagonal positions next to the best half-pixel one.
+	if (best.shift_dir == ShiftDir::UP) {
+		const auto up = best;
+		check(up.x, up.y, ShiftDir::UPLEFT);
+		check(up.x - 1, up.y, ShiftDir::UPLEFT);
+	}
+	else if (best.shift_dir == ShiftDir::LEFT) {
+		const auto left = best;
+		check(left.x, left.y, ShiftDir::UPLEFT);
+		check(left.x, left.y - 1, ShiftDir::UPLEFT);
+	}
 }
 
 void MotionEstimator::ARPS(const uint8_t* cur_Y,
 	const uint8_t* prev_Y,
-	const uint8_t* prev_Y_up,
-	const uint8_t* prev_Y_left,
-	const uint8_t* prev_Y_upleft,
-	MV* mvectors) 
+	HalfpixelCache* prev_half_pixel,
+	MVField& mvectors) 
 {
+	// Block rows only depend on the left neighbour, so they are estimated independently.
+	if (pool) {
+		pool->ParallelFor(num_blocks_vert, [&](int i) {
+			ARPSRow(i, cur_Y, prev_Y, prev_half_pixel, mvectors);
+		});
+	}
+	else {
+		for (int i = 0; i < num_blocks_vert; ++i) {
+			ARPSRow(i, cur_Y, prev_Y, prev_half_pixel, mvectors);
+		}
+	}
+}
+
+void MotionEstimator::ARPSRow(int i, const uint8_t* cur_Y, const uint8_t* prev_Y, HalfpixelCache* prev_half_pixel, MVField& mvectors)
+{
+	constexpr int cells = MVField::CELLS_PER_BLOCK;
+
 	// Uses MV of the left block as estimation
 	MV predicted;
 
-	for (int i = 0; i < num_blocks_vert; ++i) {
-		for (int j = 0; j < num_blocks_hor; ++j) {
-			const auto block_id = i * num_blocks_hor + j;
-				
-			MV best16;
-			best16.Split(); // always split for 8x8
+	for (int j = 0; j < num_blocks_hor; ++j) {
+		// always split for 8x8
+		for (int h = 0; h < 4; ++h) {
+			MV best8;
+
+			const auto hor_offset =                      j * BLOCK_SIZE + ((h & 1) ? BLOCK_SIZE / 2 : 0);
+			const auto vert_offset = first_row_offset + (i * BLOCK_SIZE + ((h > 1) ? BLOCK_SIZE / 2 : 0)) * width_ext;
+			const auto cur = cur_Y + vert_offset + hor_offset;
+			const auto prev = prev_Y + vert_offset + hor_offset;
+
+			const auto cx = j * cells + ((h & 1) ? cells / 2 : 0);
+			const auto cy = i * cells + ((h > 1) ? cells / 2 : 0);
+	
+			const auto at_edge = j == 0 && (h & 1) == 0;
+			const auto thresholds8 = BlockThresholds(mvectors, cx, cy, cells / 2);
+			
+			EstimateAtLevel<&SafeSAD_8x8::Single, &SafeSAD_8x8::Batch, 8>(thresholds8, at_edge, prev_Y, prev_half_pixel, cur, prev, predicted, best8);
+			CountError(i, cells / 2, best8);
 			
-			for (int h = 0; h < 4; ++h) {
-				auto& best8 = best16.SubVector(h);
-				best8.error = std::numeric_limits<long>::max();
+			predicted = best8;
 
-				const auto hor_offset =                      j * BLOCK_SIZE + ((h & 1) ? BLOCK_SIZE / 2 : 0);
-				const auto vert_offset = first_row_offset + (i * BLOCK_SIZE + ((h > 1) ? BLOCK_SIZE / 2 : 0)) * width_ext;
+			for (int h2 = 0; h2 < 4; ++h2) {
+				MV best4;
+
+				const auto hor_offset =                      j * BLOCK_SIZE + ((h & 1) ? BLOCK_SIZE / 2 : 0) + ((h2 & 1) ? BLOCK_SIZE / 4 : 0);
+				const auto vert_offset = first_row_offset + (i * BLOCK_SIZE + ((h > 1) ? BLOCK_SIZE / 2 : 0) + ((h2 > 1) ? BLOCK_SIZE / 4 : 0)) * width_ext;
 				const auto cur = cur_Y + vert_offset + hor_offset;
 				const auto prev = prev_Y + vert_offset + hor_offset;
-		
-				const auto at_edge = j == 0 && (h & 1) == 0;
-				
-				EstimateAtLevel<&(SafeSAD_8x8)>(at_edge, prev_Y, cur, prev, predicted, best8);
-				
-				if (best8.error > -1) { // was 250
-					best8.Split();
 
-					predicted = best8;
+				const auto at_edge = j == 0 && (h & 1) == 0 && (h2 & 1) == 0;
+				const auto thresholds4 = BlockThresholds(mvectors, cx + (h2 & 1), cy + (h2 > 1 ? 1 : 0), 1);
 
-					for (int h2 = 0; h2 < 4; ++h2) {
-						auto& best4 = best8.SubVector(h2);
-						best4.error = std::numeric_limits<long>::max();
+				EstimateAtLevel<&SafeSAD_4x4::Single, &SafeSAD_4x4::Batch, 4>(thresholds4, at_edge, prev_Y, prev_half_pixel, cur, prev, predicted, best4);
+				CountError(i, 1, best4);
 
-						const auto hor_offset =                      j * BLOCK_SIZE + ((h & 1) ? BLOCK_SIZE / 2 : 0) + ((h2 & 1) ? BLOCK_SIZE / 4 : 0);
-						const auto vert_offset = first_row_offset + (i * BLOCK_SIZE + ((h > 1) ? BLOCK_SIZE / 2 : 0) + ((h2 > 1) ? BLOCK_SIZE / 4 : 0)) * width_ext;
-						const auto cur = cur_Y + vert_offset + hor_offset;
-						const auto prev = prev_Y + vert_offset + hor_offset;
+				mvectors.SetSubSubBlock(i, j, h, h2, best4);
+			}
+		}
+	}
+}
 
-						const auto at_edge = j == 0 && (h & 1) == 0 && (h2 & 1) == 0;
+void MotionEstimator::Hierarchical(const uint8_t* cur_Y,
+	const uint8_t* prev_Y,
+	HalfpixelCache* prev_half_pixel,
+	const LumaPyramid& cur_pyramid,
+	const LumaPyramid& prev_pyramid,
+	MVField& mvectors)
+{
+	// Same row split as ARPS, the coarse levels only predict from the left block too.
+	if (pool) {
+		pool->ParallelFor(num_blocks_vert, [&](int i) {
+			HierarchicalRow(i, cur_Y, prev_Y, prev_half_pixel, cur_pyramid, prev_pyramid, mvectors);
+		});
+	}
+	else {
+		for (int i = 0; i < num_blocks_vert; ++i) {
+			HierarchicalRow(i, cur_Y, prev_Y, prev_half_pixel, cur_pyramid, prev_pyramid, mvectors);
+		}
+	}
+}
+
+MV MotionEstimator::SearchPyramid(int i, int j, const LumaPyramid& cur_pyramid, const LumaPyramid& prev_pyramid, const MV& left) {
+	static_assert(LumaPyramid::LEVELS == 3, "the search starts at level 2");
+
+	// Vectors are kept to what the full size border allows, so the refinement below starts inside it.
+	static_assert(BORDER / 2 <= LumaPyramid::BORDER, "the pyramid border is too small");
+
+	// A 16x16 block is 4x4 pixels on level 2, search with the 8x8 window centered on it.
+	const auto coarse = MakeLevelWindow(cur_pyramid, prev_pyramid, 2, j * BLOCK_SIZE / 4 - 2, i * BLOCK_SIZE / 4 - 2, BORDER / 4 + 2);
+
+	MV best(0, 0);
+	LevelSAD(sad, coarse, best);
+
+	MV left_candidate(left.x / 4, left.y / 4);
+	LevelSAD(sad, coarse, left_candidate);
+	update(best, left_candidate);
+
+	if (has_prev) {
+		const auto colocated = prev.Get(prev.CellOf(i, j, 0, 0));
+		MV temporal(colocated.x / 4, colocated.y / 4);
+		LevelSAD(sad, coarse, temporal);
+		update(best, temporal);
+	}
+
+	// A coarse grid, then every position around the best point of it
+	SearchLevel(sad, coarse, 4, 2, best);
+	SearchLevel(sad, coarse, 1, 1, best);
+
+	// Level 1 halves the error of the vector found on level 2
+	const auto fine = MakeLevelWindow(cur_pyramid, prev_pyramid, 1, j * BLOCK_SIZE / 2, i * BLOCK_SIZE / 2, BORDER / 2);
+
+	MV refined(best.x * 2, best.y * 2);
+	LevelSAD(sad, fine, refined);
+	SearchLevel(sad, fine, 1, 1, refined);
+
+	return refined;
+}
+
+void MotionEstimator::HierarchicalRow(int i, const uint8_t* cur_Y, const uint8_t* prev_Y, HalfpixelCache* prev_half_pixel, const LumaPyramid& cur_pyramid, const LumaPyramid& prev_pyramid, MVField& mvectors)
+{
+	constexpr int cells = MVField::CELLS_PER_BLOCK;
 
-						if (this->prev) {
-						//	predicted = this->prev[block_id].SubVector(h).SubVector(h2);
-						}
+	// Level 1 vector of the left block
+	MV coarse;
 
-						EstimateAtLevel<&(SafeSAD_4x4)>(at_edge, prev_Y, cur, prev, predicted, best4); // FIX thresholds
-					}
+	// Full size vector of the left 8x8 block
+	MV left;
 
-					/*if (best8.SubVector(0).error + best8.SubVector(1).error + best8.SubVector(2).error + best8.SubVector(3).error >= 3 * best8.error) {
-						best8.Unsplit(); 
-					}*/
-				}
+	for (int j = 0; j < num_blocks_hor; ++j) {
+		coarse = SearchPyramid(i, j, cur_pyramid, prev_pyramid, MV(coarse.x * 2, coarse.y * 2));
 
-				predicted = best8;
+		// Full size refinement with the ARPS patterns, the coarse vector sets the arm length
+		MV predicted(coarse.x * 2, coarse.y * 2);
+
+		for (int h = 0; h < 4; ++h) {
+			MV best8;
+
+			const auto hor_offset =                      j * BLOCK_SIZE + ((h & 1) ? BLOCK_SIZE / 2 : 0);
+			const auto vert_offset = first_row_offset + (i * BLOCK_SIZE + ((h > 1) ? BLOCK_SIZE / 2 : 0)) * width_ext;
+			const auto cur = cur_Y + vert_offset + hor_offset;
+			const auto prev = prev_Y + vert_offset + hor_offset;
+
+			// Start from the best of the coarse vector and the full size ones of the neighbours,
+			// repetitive texture can make the coarse levels pick a wrong period.
+			MV starts[3] = { MV(predicted.x, predicted.y), MV(left.x, left.y) };
+			int num_starts = 2;
+
+			if (has_prev) {
+				const auto colocated = this->prev.Get(mvectors.CellOf(i, j, h));
+				starts[num_starts++] = MV(colocated.x, colocated.y);
 			}
-			
-			mvectors[block_id] = best16;
+
+			for (int k = 0; k < num_starts; ++k) {
+				SafeSAD_8x8::Single(starts[k], sad, cur, prev + starts[k].y * width_ext + starts[k].x, width_ext, prev_Y, first_row_offset, img_size);
+				update(best8, starts[k]);
+			}
+
+			const auto cx = j * cells + ((h & 1) ? cells / 2 : 0);
+			const auto cy = i * cells + ((h > 1) ? cells / 2 : 0);
+			const auto thresholds8 = BlockThresholds(mvectors, cx, cy, cells / 2);
+
+			EstimateAtLevel<&SafeSAD_8x8::Single, &SafeSAD_8x8::Batch, 8>(thresholds8, false, prev_Y, prev_half_pixel, cur, prev, predicted, best8);
+			CountError(i, cells / 2, best8);
+
+			for (int h2 = 0; h2 < 4; ++h2) {
+				MV best4;
+
+				const auto hor_offset =                      j * BLOCK_SIZE + ((h & 1) ? BLOCK_SIZE / 2 : 0) + ((h2 & 1) ? BLOCK_SIZE / 4 : 0);
+				const auto vert_offset = first_row_offset + (i * BLOCK_SIZE + ((h > 1) ? BLOCK_SIZE / 2 : 0) + ((h2 > 1) ? BLOCK_SIZE / 4 : 0)) * width_ext;
+				const auto cur = cur_Y + vert_offset + hor_offset;
+				const auto prev = prev_Y + vert_offset + hor_offset;
+
+				const auto thresholds4 = BlockThresholds(mvectors, cx + (h2 & 1), cy + (h2 > 1 ? 1 : 0), 1);
+
+				EstimateAtLevel<&WideSAD_4x4::Single, &WideSAD_4x4::Batch, 4>(thresholds4, false, prev_Y, prev_half_pixel, cur, prev, best8, best4);
+				CountError(i, 1, best4);
+
+				mvectors.SetSubSubBlock(i, j, h, h2, best4);
+			}
+
+			left = best8;
+		}
+	}
+}
+
+void MotionEstimator::Predictive(const uint8_t* cur_Y,
+	const uint8_t* prev_Y,
+	HalfpixelCache* prev_half_pixel,
+	MVField& mvectors)
+{
+	for (int i = 0; i < num_blocks_vert; ++i) {
+		row_progress[i].store(0, std::memory_order_relaxed);
+	}
+
+	// Rows are handed out in order, so the row above is always being worked on or done.
+	if (pool) {
+		pool->ParallelFor(num_blocks_vert, [&](int i) {
+			PredictiveRow(i, cur_Y, prev_Y, prev_half_pixel, mvectors);
+		});
+	}
+	else {
+		for (int i = 0; i < num_blocks_vert; ++i) {
+			PredictiveRow(i, cur_Y, prev_Y, prev_half_pixel, mvectors);
 		}
 	}
+}
+
+/// Whether cell (cx, cy) is estimated before the cell with the given order in block (i, j).
+/// Of the row above only the blocks up to j + 1 are, the wavefront guarantees no more.
+static bool IsEstimated(const MVField& field, int cx, int cy, int i, int j, int order) {
+	constexpr int cells = MVField::CELLS_PER_BLOCK;
 
-	if (!this->prev) {
-		prev = new MV[num_blocks_hor*num_blocks_vert];
+	if (cx < 0 || cy < 0 || cx >= field.Stride() || cy >= field.BlocksVert() * cells) {
+		return false;
 	}
 
-	std::copy(mvectors, mvectors + (num_blocks_hor*num_blocks_vert), prev);
+	const auto bi = cy / cells;
+	const auto bj = cx / cells;
+
+	if (bi != i) {
+		return bi == i - 1 && bj <= j + 1;
+	}
+
+	if (bj != j) {
+		return bj < j;
+	}
+
+	// Sub-blocks in raster order, 4x4 cells in raster order inside them
+	const auto row = cy % cells;
+	const auto col = cx % cells;
+	const auto cell_order = ((row >= 2 ? 2 : 0) + (col >= 2 ? 1 : 0)) * 4 + (row & 1) * 2 + (col & 1);
+
+	return cell_order < order;
+}
+
+static int Median3(int a, int b, int c) {
+	return std::max(std::min(a, b), std::min(std::max(a, b), c));
+}
+
+/// Vectors of the left, top and top-right neighbours of a block, top-left standing in for
+/// top-right when that one is not estimated yet
+struct SpatialNeighbours {
+	MV left, top, top_right;
+	bool has_left = false, has_top = false, has_top_right = false;
+
+	SpatialNeighbours(const MVField& field, int i, int j, int cx, int cy, int size, int order) {
+		const auto cell = [&](int x, int y) {
+			return field.Get(y * field.Stride() + x);
+		};
+
+		if (IsEstimated(field, cx - 1, cy, i, j, order)) {
+			left = cell(cx - 1, cy);
+			has_left = true;
+		}
+
+		if (IsEstimated(field, cx, cy - 1, i, j, order)) {
+			top = cell(cx, cy - 1);
+			has_top = true;
+		}
+
+		if (IsEstimated(field, cx + size, cy - 1, i, j, order)) {
+			top_right = cell(cx + size, cy - 1);
+			has_top_right = true;
+		}
+		else if (IsEstimated(field, cx - 1, cy - 1, i, j, order)) {
+			top_right = cell(cx - 1, cy - 1);
+			has_top_right = true;
+		}
+	}
+
+	/// Component-wise median, missing neighbours count as zero; a single one is used as it is
+	MV Median() const {
+		if (has_left + has_top + has_top_right == 1) {
+			return has_left ? left : has_top ? top : top_right;
+		}
 
+		return MV(Median3(left.x, top.x, top_right.x), Median3(left.y, top.y, top_right.y));
+	}
+};
+
+MV MotionEstimator::MedianPredictor(const MVField& mvectors, int i, int j, int cx, int cy, int size, int order) const {
+	return SpatialNeighbours(mvectors, i, j, cx, cy, size, order).Median();
+}
+
+int MotionEstimator::GatherPredictors(const MVField& mvectors, int i, int j, int cx, int cy, int size, int order, MV* predictors, long& threshold) const {
+	const SpatialNeighbours neighbours(mvectors, i, j, cx, cy, size, order);
+	long min_error = std::numeric_limits<long>::max();
+	int count = 0;
+
+	predictors[count++] = neighbours.Median();
+	predictors[count++] = MV(0, 0);
+
+	if (neighbours.has_left) {
+		predictors[count++] = neighbours.left;
+		min_error = std::min(min_error, neighbours.left.error);
+	}
+
+	if (neighbours.has_top) {
+		predictors[count++] = neighbours.top;
+		min_error = std::min(min_error, neighbours.top.error);
+	}
+
+	if (neighbours.has_top_right) {
+		predictors[count++] = neighbours.top_right;
+		min_error = std::min(min_error, neighbours.top_right.error);
+	}
+
+	if (has_prev) {
+		const auto colocated = prev.Get(cy * prev.Stride() + cx);
+		predictors[count++] = colocated;
+		min_error = std::min(min_error, colocated.error);
+
+		if (cx + size < prev.Stride()) {
+			predictors[count++] = prev.Get(cy * prev.Stride() + cx + size);
+		}
+
+		if (cy + size < prev.BlocksVert() * MVField::CELLS_PER_BLOCK) {
+			predictors[count++] = prev.Get((cy + size) * prev.Stride() + cx);
+		}
+	}
+
+	// Stop once a predictor is about as good as the best neighbour (EPZS)
+	if (min_error == std::numeric_limits<long>::max()) {
+		threshold = first_threshold;
+	}
+	else {
+		threshold = std::min<long>(std::max<long>(min_error + min_error / 4, zmp_threshold), 4 * first_threshold);
+	}
+
+	return count;
+}
+
+MotionEstimator::Thresholds MotionEstimator::BlockThresholds(const MVField& mvectors, int cx, int cy, int size) const {
+	const Thresholds fixed = { zmp_threshold, first_threshold, second_threshold };
+
+	if (termination == EarlyTermination::FIXED) {
+		return fixed;
+	}
+
+	// Rows are estimated independently, so the top neighbour only counts inside the block row.
+	// In that order the cells left of and above a block there are always estimated before it.
+	const auto errors = mvectors.Errors();
+	const auto cell = cy * mvectors.Stride() + cx;
+	long reference = std::numeric_limits<int32_t>::max();
+
+	if (cx > 0) {
+		reference = std::min<long>(reference, errors[cell - 1]);
+	}
+
+	if (cy % MVField::CELLS_PER_BLOCK != 0) {
+		reference = std::min<long>(reference, errors[cell - mvectors.Stride()]);
+	}
+
+	if (has_prev) {
+		reference = std::min<long>(reference, prev.Errors()[cell]);
+	}
+
+	if (reference == std::numeric_limits<int32_t>::max()) {
+		return fixed;
+	}
+
+	if (termination == EarlyTermination::CALIBRATED && size > 1) {
+		reference = std::lround(reference * error_scale8);
+	}
+
+	// A block as good as its neighbourhood is done, up to a limit for occlusions and cuts
+	const auto limit = 16L * first_threshold;
+	const auto raise = [limit](long floor, long value) {
+		return std::max(floor, std::min(value, limit));
+	};
+
+	return { raise(fixed.zmp, reference), raise(fixed.first, reference + reference / 4), raise(fixed.second, reference) };
+}
+
+void MotionEstimator::CountError(int i, int size, const MV& best) {
+	if (termination != EarlyTermination::CALIBRATED || best.error == std::numeric_limits<long>::max()) {
+		return;
+	}
+
+	auto& row = row_errors[i];
+	const auto k = size > 1 ? 0 : 1;
+	row.sum[k] += best.error;
+	++row.count[k];
+}
+
+void MotionEstimator::PredictiveRow(int i, const uint8_t* cur_Y, const uint8_t* prev_Y, HalfpixelCache* prev_half_pixel, MVField& mvectors)
+{
+	constexpr int cells = MVField::CELLS_PER_BLOCK;
+
+	for (int j = 0; j < num_blocks_hor; ++j) {
+		// Wait for the top-right neighbour
+		if (i > 0) {
+			const auto needed = std::min(j + 2, num_blocks_hor);
+
+			while (row_progress[i - 1].load(std::memory_order_acquire) < needed) {
+				std::this_thread::yield();
+			}
+		}
+
+		for (int h = 0; h < 4; ++h) {
+			MV best8;
+
+			const auto hor_offset =                      j * BLOCK_SIZE + ((h & 1) ? BLOCK_SIZE / 2 : 0);
+			const auto vert_offset = first_row_offset + (i * BLOCK_SIZE + ((h > 1) ? BLOCK_SIZE / 2 : 0)) * width_ext;
+			const auto cur = cur_Y + vert_offset + hor_offset;
+			const auto prev = prev_Y + vert_offset + hor_offset;
+
+			const auto cx = j * cells + ((h & 1) ? cells / 2 : 0);
+			const auto cy = i * cells + ((h > 1) ? cells / 2 : 0);
+
+			// The median leads, the others are only gathered when it is not good enough
+			const auto gather = [&](MV* predictors, long& threshold) {
+				return GatherPredictors(mvectors, i, j, cx, cy, cells / 2, h * 4, predictors, threshold);
+			};
+			const auto median = MedianPredictor(mvectors, i, j, cx, cy, cells / 2, h * 4);
+
+			EstimateFromPredictors<&SafeSAD_8x8::Single, &SafeSAD_8x8::Batch, 8>(prev_Y, prev_half_pixel, cur, prev, median, gather, best8);
+
+			for (int h2 = 0; h2 < 4; ++h2) {
+				MV best4;
+
+				const auto hor_offset =                      j * BLOCK_SIZE + ((h & 1) ? BLOCK_SIZE / 2 : 0) + ((h2 & 1) ? BLOCK_SIZE / 4 : 0);
+				const auto vert_offset = first_row_offset + (i * BLOCK_SIZE + ((h > 1) ? BLOCK_SIZE / 2 : 0) + ((h2 > 1) ? BLOCK_SIZE / 4 : 0)) * width_ext;
+				const auto cur = cur_Y + vert_offset + hor_offset;
+				const auto prev = prev_Y + vert_offset + hor_offset;
+
+				// The 8x8 vector leads
+				const auto gather = [&](MV* predictors, long& threshold) {
+					return GatherPredictors(mvectors, i, j, cx + (h2 & 1), cy + (h2 > 1 ? 1 : 0), 1, h * 4 + h2, predictors, threshold);
+				};
+
+				EstimateFromPredictors<&WideSAD_4x4::Single, &WideSAD_4x4::Batch, 4>(prev_Y, prev_half_pixel, cur, prev, best8, gather, best4);
+
+				mvectors.SetSubSubBlock(i, j, h, h2, best4);
+			}
+		}
+
+		row_progress[i].store(j + 1, std::memory_order_release);
+	}
 }
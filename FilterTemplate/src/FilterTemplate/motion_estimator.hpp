@@ -1,17 +1,61 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
+#include <memory>
+#include <vector>
+#include "half_pixel.hpp"
 #include "mv.hpp"
+#include "mv_field.hpp"
 #include "mat.h"
 #include "metric.hpp"
+#include "pyramid.hpp"
+#include "thread_pool.hpp"
 
 constexpr const char FILTER_NAME[] = "DE_Starshinov";
 constexpr const char FILTER_AUTHOR[] = "Nikita Starshinov";
 
+/// Search strategy of the motion estimator
+enum class MotionSearch : int {
+	/// Adaptive rood pattern search, predicted from the left neighbour
+	ARPS,
+
+	/// Coarse-to-fine search over 1/4 and 1/2 size pyramids, then ARPS from the coarse vector;
+	/// finds motion longer than the ARPS windows in a bounded number of steps, though blocks
+	/// still only move up to BORDER pixels past the frame edges
+	HIERARCHICAL,
+
+	/// Spatial and temporal predictors first (EPZS), stopping as soon as one is about as good
+	/// as the neighbours; block rows are estimated as a wavefront
+	PREDICTIVE
+};
+
+/// How ARPS and the hierarchical refinement decide that a block needs no further search
+enum class EarlyTermination : int {
+	/// Thresholds from the quality alone
+	FIXED,
+
+	/// Per block thresholds, raised to the errors of the already estimated neighbours and of
+	/// the co-located block of the previous frame
+	ADAPTIVE,
+
+	/// Like ADAPTIVE, with the neighbour errors scaled to the block size by the error ratio
+	/// measured on the previous frame
+	CALIBRATED
+};
+
 class MotionEstimator {
 public:
-	/// Constructor
-	MotionEstimator(int width, int height, uint8_t quality, bool use_half_pixel);
+	/**
+	 * Constructor
+	 *
+	 * @param[in] num_threads number of threads estimating block rows in parallel,
+	 *   0 means one per hardware thread. The result does not depend on it.
+	 * @param[in] search search strategy
+	 * @param[in] termination early termination of ARPS and of the hierarchical refinement
+	 */
+	MotionEstimator(int width, int height, uint8_t quality, bool use_half_pixel, int num_threads = 1,
+	                MotionSearch search = MotionSearch::ARPS, EarlyTermination termination = EarlyTermination::FIXED);
 
 	/// Destructor
 	~MotionEstimator();
@@ -33,20 +77,18 @@ public:
 	 *
 	 * @param[in] cur_Y array of pixels of the current frame
 	 * @param[in] prev_Y array of pixels of the previous frame
-	 * @param[in] prev_Y_up array of pixels of the previous frame shifted half a pixel up,
-	 *   only valid if use_half_pixel is true
-	 * @param[in] prev_Y_left array of pixels of the previous frame shifted half a pixel left,
-	 *   only valid if use_half_pixel is true
-	 * @param[in] prev_Y_upleft array of pixels of the previous frame shifted half a pixel up left,
-	 *   only valid if use_half_pixel is true
-	 * @param[out] mvectors output array of motion vectors
+	 * @param[in] prev_half_pixel half-pixel shifted versions of prev_Y, interpolated as the
+	 *   search needs them; only used if use_half_pixel is true
+	 * @param[in] cur_pyramid, prev_pyramid pyramids of cur_Y and prev_Y, only used by the
+	 *   hierarchical search, which falls back to ARPS without them
+	 * @param[out] mvectors output motion vectors, sized for this frame
 	 */
 	void Estimate(const uint8_t* cur_Y,
 	              const uint8_t* prev_Y,
-	              const uint8_t* prev_Y_up,
-	              const uint8_t* prev_Y_left,
-	              const uint8_t* prev_Y_upleft,
-	              MV* mvectors);
+	              HalfpixelCache* prev_half_pixel,
+	              const LumaPyramid* cur_pyramid,
+	              const LumaPyramid* prev_pyramid,
+	              MVField& mvectors);
 
 	/**
 	 * Size of the borders added to frames by the template, in pixels.
@@ -70,6 +112,12 @@ private:
 	/// Whether to use half-pixel precision
 	const bool use_half_pixel;
 
+	/// Search strategy
+	const MotionSearch search;
+
+	/// Early termination model
+	const EarlyTermination termination;
+
 	/// Extended frame width (including borders)
 	const int width_ext;
 
@@ -82,26 +130,137 @@ private:
 	/// Position of the first pixel of the frame in the extended frame
 	const int first_row_offset;
 
+	/// SAD kernels for the running CPU, selected once on construction
+	const SADKernels& sad;
+
 	// Custom data
 	int zmp_threshold, first_threshold, second_threshold;
 	int img_size;
-	int ** thresholds;
-	MV *prev;
+	MVField prev;
+	bool has_prev;
+
+	/// Early termination thresholds of one block
+	struct Thresholds {
+		/// Stop after the zero vector below this error
+		long zmp;
+
+		/// Stop after the rood pattern, and stop the URP walk, below this error
+		long first;
+
+		/// Refine to half-pixel precision above this error
+		long second;
+	};
+
+	/// Sums of the final errors of 8x8 and 4x4 blocks of one block row, for calibration
+	struct ErrorSums {
+		double sum[2] = { 0, 0 };
+		long count[2] = { 0, 0 };
+	};
+
+	/// Error sums of every block row of the frame being estimated
+	std::vector<ErrorSums> row_errors;
+
+	/// Ratio of the mean 8x8 error to the mean 4x4 error on the previous frame; the field
+	/// holds 4x4 errors, so this scales them for 8x8 blocks
+	double error_scale8;
+
+	/// Workers for row-parallel estimation, null when running single-threaded
+	std::unique_ptr<ThreadPool> pool;
+
+	/// Most predictors GatherPredictors returns
+	static constexpr int MAX_PREDICTORS = 8;
+
+	/// Number of finished blocks of every row, for the wavefront of the predictive search
+	std::unique_ptr<std::atomic<int>[]> row_progress;
 
 	// ME methods
-	void FullSearch(const uint8_t* cur_Y,
-		const uint8_t* prev_Y,
-		const uint8_t* prev_Y_up,
-		const uint8_t* prev_Y_left,
-		const uint8_t* prev_Y_upleft,
-		MV* mvectors);
 	void ARPS(const uint8_t* cur_Y,
 		const uint8_t* prev_Y,
-		const uint8_t* prev_Y_up,
-		const uint8_t* prev_Y_left,
-		const uint8_t* prev_Y_upleft,
-		MV* mvectors);
+		HalfpixelCache* prev_half_pixel,
+		MVField& mvectors);
+
+	/// Estimate one row of blocks with ARPS
+	void ARPSRow(int i, const uint8_t* cur_Y, const uint8_t* prev_Y, HalfpixelCache* prev_half_pixel, MVField& mvectors);
+
+	void Hierarchical(const uint8_t* cur_Y,
+		const uint8_t* prev_Y,
+		HalfpixelCache* prev_half_pixel,
+		const LumaPyramid& cur_pyramid,
+		const LumaPyramid& prev_pyramid,
+		MVField& mvectors);
+
+	/// Estimate one row of blocks on the pyramid, refining at full size with ARPS
+	void HierarchicalRow(int i, const uint8_t* cur_Y, const uint8_t* prev_Y, HalfpixelCache* prev_half_pixel,
+		const LumaPyramid& cur_pyramid, const LumaPyramid& prev_pyramid, MVField& mvectors);
+
+	/// Vector of a 16x16 block at 1/2 size, searched at 1/4 size first around zero, the full size
+	/// vector of the left block and the co-located one of the previous frame
+	MV SearchPyramid(int i, int j, const LumaPyramid& cur_pyramid, const LumaPyramid& prev_pyramid, const MV& left);
+
+	void Predictive(const uint8_t* cur_Y,
+		const uint8_t* prev_Y,
+		HalfpixelCache* prev_half_pixel,
+		MVField& mvectors);
+
+	/// Estimate one row of blocks from predictors, once the row above is one block ahead
+	void PredictiveRow(int i, const uint8_t* cur_Y, const uint8_t* prev_Y, HalfpixelCache* prev_half_pixel, MVField& mvectors);
+
+	/**
+	 * Early termination thresholds of a block. With FIXED they are the ones set by the quality,
+	 * otherwise those are raised to the smallest error of the left and top neighbours in the
+	 * same block row and of the co-located cell of the previous frame.
+	 *
+	 * @param[in] cx, cy top left cell of the block
+	 * @param[in] size side of the block, in cells
+	 */
+	Thresholds BlockThresholds(const MVField& mvectors, int cx, int cy, int size) const;
+
+	/// Add the final error of an 8x8 (size 2) or 4x4 (size 1) block of row i to the calibration
+	void CountError(int i, int size, const MV& best);
+
+	/// Median of the left, top and top-right vectors of a block, see GatherPredictors
+	MV MedianPredictor(const MVField& mvectors, int i, int j, int cx, int cy, int size, int order) const;
+
+	/**
+	 * Collect the predictors of a block: the median of left, top and top-right, zero, those
+	 * three and the co-located vector of the previous frame with its right and bottom
+	 * neighbours. Only cells estimated before the block are used.
+	 *
+	 * @param[in] cx, cy top left cell of the block
+	 * @param[in] size side of the block, in cells
+	 * @param[in] order number of cells of block (i, j) estimated before this block
+	 * @param[out] predictors at least MAX_PREDICTORS entries
+	 * @param[out] threshold early exit threshold, from the errors of the neighbours
+	 * @return number of predictors
+	 */
+	int GatherPredictors(const MVField& mvectors, int i, int j, int cx, int cy, int size, int order, MV* predictors, long& threshold) const;
+
+	/// Bounds-checked SAD of a single candidate, stores the result in mv.error
+	using SafeSADFunc = void(*)(MV&, const SADKernels&, const uint8_t *, const uint8_t *, const int, const uint8_t *, const int, const int);
+
+	/// Bounds-checked SAD of four candidates against the same block
+	using SafeSADx4Func = void(*)(MV*, const SADKernels&, const uint8_t *, const uint8_t *const *, const int, const uint8_t *, const int, const int);
+
+	/// Search for the vector of a SIZE x SIZE block, with half-pixel refinement if prev_half_pixel is not null
+	template <SafeSADFunc SAD, SafeSADx4Func SADx4, int SIZE>
+	void EstimateAtLevel(const Thresholds& thresholds, bool at_edge, const uint8_t *prev_Y, HalfpixelCache* prev_half_pixel, const uint8_t *cur, const uint8_t *prev, MV& predicted, MV& best);
+
+	/**
+	 * Search for the vector of a SIZE x SIZE block among predictors, walking the small diamond
+	 * from the best of them if none is below threshold
+	 *
+	 * @param[in] first predictor tried alone first
+	 * @param[in] gather int(MV* predictors, long& threshold), called for the other predictors
+	 *   and the threshold only when first is not good enough
+	 */
+	template <SafeSADFunc SAD, SafeSADx4Func SADx4, int SIZE, typename Gather>
+	void EstimateFromPredictors(const uint8_t *prev_Y, HalfpixelCache* prev_half_pixel, const uint8_t *cur, const uint8_t *prev, const MV& first, Gather gather, MV& best);
+
+	/// Move best to its best neighbour until none is better or best is below threshold (URP)
+	template <SafeSADx4Func SADx4>
+	void SearchSmallDiamond(const uint8_t *prev_Y, const uint8_t *cur, const uint8_t *prev, long threshold, MV& best);
 
-	template <void(*SafeSAD_8x8)(MV&, const uint8_t *, const uint8_t *, const int, const uint8_t *, const int, const int)>
-	void MotionEstimator::EstimateAtLevel(bool at_edge, const uint8_t *prev_Y, const uint8_t *cur, const uint8_t *prev, MV& predicted, MV& best);
+	/// Try the half-pixel positions around the integer best vector of a SIZE x SIZE block
+	template <SafeSADFunc SAD, int SIZE>
+	void RefineHalfPixel(const uint8_t *prev_Y, HalfpixelCache& prev_half_pixel, const uint8_t *cur, const uint8_t *prev, MV& best);
 };
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "mv.hpp"
+
+/**
+ * Motion vectors of a whole frame.
+ *
+ * Vectors are stored per 4x4 cell in separate arrays, a vector of a larger block is
+ * written to every cell it covers. Which blocks are split is kept in a bitmap with
+ * one byte per 16x16 block. Storage is allocated once, on construction.
+ */
+class MVField
+{
+public:
+	/// Size of a cell, in pixels
+	static constexpr int CELL_SIZE = 4;
+
+	/// Number of cells along a side of a 16x16 block
+	static constexpr int CELLS_PER_BLOCK = 4;
+
+	/// Constructor
+	MVField(int num_blocks_hor = 0, int num_blocks_vert = 0)
+		: num_blocks_hor(num_blocks_hor)
+		, num_blocks_vert(num_blocks_vert)
+		, stride(num_blocks_hor * CELLS_PER_BLOCK)
+		, x(stride * num_blocks_vert * CELLS_PER_BLOCK)
+		, y(x.size())
+		, shift_dir(x.size(), ShiftDir::NONE)
+		, error(x.size(), std::numeric_limits<int32_t>::max())
+		, split(num_blocks_hor * num_blocks_vert)
+	{}
+
+	/// Number of 16x16 blocks per X-axis
+	inline int BlocksHor() const { return num_blocks_hor; }
+
+	/// Number of 16x16 blocks per Y-axis
+	inline int BlocksVert() const { return num_blocks_vert; }
+
+	/// Number of cells per row of the cell arrays
+	inline int Stride() const { return stride; }
+
+	/// Index of the cell containing pixel (px, py)
+	inline int CellAt(int px, int py) const
+	{
+		return (py / CELL_SIZE) * stride + px / CELL_SIZE;
+	}
+
+	/// Index of the top left cell of 16x16 block (i, j), h and h2 select the 8x8 and 4x4 sub-block
+	inline int CellOf(int i, int j, int h = 0, int h2 = 0) const
+	{
+		return (i * CELLS_PER_BLOCK + ((h > 1) ? 2 : 0) + ((h2 > 1) ? 1 : 0)) * stride
+			+ j * CELLS_PER_BLOCK + ((h & 1) ? 2 : 0) + (h2 & 1);
+	}
+
+	/// Cell arrays, Stride() cells per row
+	inline const int16_t* X() const { return x.data(); }
+	inline const int16_t* Y() const { return y.data(); }
+	inline const ShiftDir* ShiftDirs() const { return shift_dir.data(); }
+	inline const int32_t* Errors() const { return error.data(); }
+
+	/// Get the vector covering a cell
+	inline MV Get(int cell) const
+	{
+		return MV(x[cell], y[cell], shift_dir[cell], error[cell]);
+	}
+
+	/// Write a vector to a square of size x size cells starting at cell
+	inline void Set(int cell, int size, const MV& mv)
+	{
+		const auto err = static_cast<int32_t>(std::min<long>(mv.error, std::numeric_limits<int32_t>::max()));
+
+		for (int r = 0; r < size; ++r, cell += stride) {
+			for (int c = 0; c < size; ++c) {
+				x[cell + c] = static_cast<int16_t>(mv.x);
+				y[cell + c] = static_cast<int16_t>(mv.y);
+				shift_dir[cell + c] = mv.shift_dir;
+				error[cell + c] = err;
+			}
+		}
+	}
+
+	/// Set the vector of 16x16 block (i, j) and mark it not split
+	inline void SetBlock(int i, int j, const MV& mv)
+	{
+		Set(CellOf(i, j), CELLS_PER_BLOCK, mv);
+		split[i * num_blocks_hor + j] = 0;
+	}
+
+	/// Set the vector of 8x8 sub-block h of block (i, j) and mark it not split
+	inline void SetSubBlock(int i, int j, int h, const MV& mv)
+	{
+		Set(CellOf(i, j, h), CELLS_PER_BLOCK / 2, mv);
+		split[i * num_blocks_hor + j] = static_cast<uint8_t>((split[i * num_blocks_hor + j] | SPLIT_16) & ~(SPLIT_8 << h));
+	}
+
+	/// Set the vector of 4x4 sub-block h2 of 8x8 sub-block h of block (i, j), marking both split
+	inline void SetSubSubBlock(int i, int j, int h, int h2, const MV& mv)
+	{
+		Set(CellOf(i, j, h, h2), 1, mv);
+		split[i * num_blocks_hor + j] |= SPLIT_16 | (SPLIT_8 << h);
+	}
+
+	/// Check if 16x16 block (i, j) is split into 8x8 sub-blocks
+	inline bool IsSplit(int i, int j) const
+	{
+		return (split[i * num_blocks_hor + j] & SPLIT_16) != 0;
+	}
+
+	/// Check if 8x8 sub-block h of block (i, j) is split into 4x4 sub-blocks
+	inline bool IsSplit(int i, int j, int h) const
+	{
+		assert(h >= 0 && h < 4);
+		return (split[i * num_blocks_hor + j] & (SPLIT_8 << h)) != 0;
+	}
+
+	/// Call f(x, y, size, mv) for every unsplit block, (x, y) being its top left pixel and size its side
+	template <typename F>
+	void ForEachLeafBlock(F f) const
+	{
+		constexpr int size16 = CELLS_PER_BLOCK * CELL_SIZE;
+
+		for (int i = 0; i < num_blocks_vert; ++i) {
+			for (int j = 0; j < num_blocks_hor; ++j) {
+				if (!IsSplit(i, j)) {
+					f(j * size16, i * size16, size16, Get(CellOf(i, j)));
+					continue;
+				}
+
+				for (int h = 0; h < 4; ++h) {
+					const auto x = j * size16 + ((h & 1) ? size16 / 2 : 0);
+					const auto y = i * size16 + ((h > 1) ? size16 / 2 : 0);
+
+					if (!IsSplit(i, j, h)) {
+						f(x, y, size16 / 2, Get(CellOf(i, j, h)));
+						continue;
+					}
+
+					for (int h2 = 0; h2 < 4; ++h2) {
+						f(x + ((h2 & 1) ? size16 / 4 : 0),
+						  y + ((h2 > 1) ? size16 / 4 : 0),
+						  size16 / 4,
+						  Get(CellOf(i, j, h, h2)));
+					}
+				}
+			}
+		}
+	}
+
+	/// Call f(center_x, center_y, mv) for every unsplit block, center in pixels
+	template <typename F>
+	void ForEachLeaf(F f) const
+	{
+		ForEachLeafBlock([&](int x, int y, int size, const MV& mv) {
+			f(x + size / 2, y + size / 2, mv);
+		});
+	}
+
+private:
+	/// Split bitmap layout: bit 0 for the 16x16 block, bits 1-4 for its 8x8 sub-blocks
+	static constexpr uint8_t SPLIT_16 = 1;
+	static constexpr uint8_t SPLIT_8 = 2;
+
+	int num_blocks_hor;
+	int num_blocks_vert;
+	int stride;
+
+	std::vector<int16_t> x;
+	std::vector<int16_t> y;
+	std::vector<ShiftDir> shift_dir;
+	std::vector<int32_t> error;
+	std::vector<uint8_t> split;
+};
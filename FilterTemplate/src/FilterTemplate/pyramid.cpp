@@ -0,0 +1,106 @@
+#include <cstring>
+
+#include "cpu.hpp"
+#include "pyramid.hpp"
+
+#if defined(DE_ARCH_X86)
+#include <emmintrin.h>
+#endif
+
+/// Average of 2x2 pixels, rounded
+static void DownsampleRow_Scalar(const uint8_t* row0, const uint8_t* row1, int begin, int width, uint8_t* dst)
+{
+	for (int x = begin; x < width; ++x)
+		dst[x] = static_cast<uint8_t>((row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2);
+}
+
+#if defined(DE_ARCH_X86)
+
+/// Sums of horizontal pairs of 16 pixels; even and odd pixels of a 16-bit lane are its low and high byte
+DE_TARGET_SSE2 static inline __m128i PairSums(const uint8_t* p)
+{
+	const auto pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+	return _mm_add_epi16(_mm_and_si128(pixels, _mm_set1_epi16(0x00FF)), _mm_srli_epi16(pixels, 8));
+}
+
+DE_TARGET_SSE2 static int DownsampleRow_SSE2(const uint8_t* row0, const uint8_t* row1, int width, uint8_t* dst)
+{
+	const auto two = _mm_set1_epi16(2);
+	int x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		const auto lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(PairSums(row0 + 2 * x), PairSums(row1 + 2 * x)), two), 2);
+		const auto hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(PairSums(row0 + 2 * x + 16), PairSums(row1 + 2 * x + 16)), two), 2);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(lo, hi));
+	}
+
+	return x;
+}
+
+#endif
+
+/// Replicate the edge pixels of a plane into its border
+static void FillBorder(uint8_t* plane, int width, int height, int border)
+{
+	const auto pitch = width + 2 * border;
+	auto row = plane + border * pitch;
+
+	for (int y = 0; y < height; ++y, row += pitch) {
+		memset(row, row[border], border);
+		memset(row + border + width, row[border + width - 1], border);
+	}
+
+	const auto first = plane + border * pitch;
+	const auto last = plane + (border + height - 1) * pitch;
+
+	for (int y = 0; y < border; ++y) {
+		memcpy(plane + y * pitch, first, pitch);
+		memcpy(last + (y + 1) * pitch, last, pitch);
+	}
+}
+
+LumaPyramid::LumaPyramid(int width, int height)
+#if defined(DE_ARCH_X86)
+	: use_sse2(GetCPUFeatures().sse2)
+#else
+	: use_sse2(false)
+#endif
+{
+	widths[0] = width;
+	heights[0] = height;
+
+	for (int level = 1; level < LEVELS; ++level) {
+		widths[level] = (widths[level - 1] + 1) / 2;
+		heights[level] = (heights[level - 1] + 1) / 2;
+		levels[level - 1] = std::make_unique<uint8_t[]>((widths[level] + 2 * BORDER) * (heights[level] + 2 * BORDER));
+	}
+}
+
+LumaPyramid::~LumaPyramid() {
+}
+
+void LumaPyramid::Build(const uint8_t* src, ptrdiff_t src_pitch)
+{
+	for (int level = 1; level < LEVELS; ++level) {
+		const auto dst = levels[level - 1].get() + BORDER * Pitch(level) + BORDER;
+		const auto width = widths[level];
+
+		for (int y = 0; y < heights[level]; ++y) {
+			const auto row0 = src + 2 * y * src_pitch;
+			const auto row1 = row0 + src_pitch;
+			int x = 0;
+
+#if defined(DE_ARCH_X86)
+			if (use_sse2)
+				x = DownsampleRow_SSE2(row0, row1, width, dst + y * Pitch(level));
+#endif
+
+			DownsampleRow_Scalar(row0, row1, x, width, dst + y * Pitch(level));
+		}
+
+		FillBorder(levels[level - 1].get(), width, heights[level], BORDER);
+
+		src = dst;
+		src_pitch = Pitch(level);
+	}
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/**
+ * Downsampled copies of a luma plane at 1/2 and 1/4 of its size, each level the 2x2 average
+ * of the one above, with replicated borders so a search may read past the edges.
+ *
+ * Level 0 is the plane itself and is not stored.
+ */
+class LumaPyramid {
+public:
+	/// Number of levels, the full size one included
+	static constexpr int LEVELS = 3;
+
+	/// Border around every stored level, in pixels of that level
+	static constexpr int BORDER = 16;
+
+	/**
+	 * Constructor
+	 *
+	 * @param[in] width width of the full size plane
+	 * @param[in] height height of the full size plane
+	 */
+	LumaPyramid(int width, int height);
+
+	/// Destructor
+	~LumaPyramid();
+
+	/// Copy constructor (deleted)
+	LumaPyramid(const LumaPyramid&) = delete;
+
+	/// Copy assignment (deleted)
+	LumaPyramid& operator=(const LumaPyramid&) = delete;
+
+	/**
+	 * Build the levels from a full size plane
+	 *
+	 * @param[in] src first visible pixel of the plane; one pixel past the right and bottom edges
+	 *   is read for odd sizes, as a plane with borders has
+	 * @param[in] src_pitch pitch of the plane
+	 */
+	void Build(const uint8_t* src, ptrdiff_t src_pitch);
+
+	/// First visible pixel of level 1 or 2
+	const uint8_t* Plane(int level) const { return levels[level - 1].get() + BORDER * Pitch(level) + BORDER; }
+
+	/// Pitch of level 1 or 2
+	int Pitch(int level) const { return widths[level] + 2 * BORDER; }
+
+	/// Width of a level
+	int Width(int level) const { return widths[level]; }
+
+	/// Height of a level
+	int Height(int level) const { return heights[level]; }
+
+private:
+	int widths[LEVELS];
+	int heights[LEVELS];
+
+	/// Levels 1 and 2, with borders
+	std::unique_ptr<uint8_t[]> levels[LEVELS - 1];
+
+	const bool use_sse2;
+};
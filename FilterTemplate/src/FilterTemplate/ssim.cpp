@@ -0,0 +1,113 @@
+#include "cpu.hpp"
+#include "ssim.hpp"
+
+#if defined(DE_ARCH_X86)
+#include <emmintrin.h>
+#endif
+
+/// Sums over a window: of a, of b, of a * a + b * b and of a * b
+struct WindowSums {
+	uint32_t a;
+	uint32_t b;
+	uint32_t squares;
+	uint32_t product;
+};
+
+static WindowSums GetWindowSums_Scalar(const uint8_t* a, ptrdiff_t a_pitch, const uint8_t* b, ptrdiff_t b_pitch)
+{
+	WindowSums sums = { 0, 0, 0, 0 };
+
+	for (int y = 0; y < SSIM_WINDOW; ++y) {
+		for (int x = 0; x < SSIM_WINDOW; ++x) {
+			sums.a += a[x];
+			sums.b += b[x];
+			sums.squares += a[x] * a[x] + b[x] * b[x];
+			sums.product += a[x] * b[x];
+		}
+
+		a += a_pitch;
+		b += b_pitch;
+	}
+
+	return sums;
+}
+
+#if defined(DE_ARCH_X86)
+
+DE_TARGET_SSE2 static inline uint32_t HorizontalSum32(__m128i sum)
+{
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+	return static_cast<uint32_t>(_mm_cvtsi128_si32(sum));
+}
+
+DE_TARGET_SSE2 static WindowSums GetWindowSums_SSE2(const uint8_t* a, ptrdiff_t a_pitch, const uint8_t* b, ptrdiff_t b_pitch)
+{
+	const auto zero = _mm_setzero_si128();
+	auto sum_a = zero, sum_b = zero, squares = zero, product = zero;
+
+	for (int y = 0; y < SSIM_WINDOW; ++y) {
+		const auto row_a = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(a)), zero);
+		const auto row_b = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(b)), zero);
+
+		sum_a = _mm_add_epi16(sum_a, row_a);
+		sum_b = _mm_add_epi16(sum_b, row_b);
+		squares = _mm_add_epi32(squares, _mm_add_epi32(_mm_madd_epi16(row_a, row_a), _mm_madd_epi16(row_b, row_b)));
+		product = _mm_add_epi32(product, _mm_madd_epi16(row_a, row_b));
+
+		a += a_pitch;
+		b += b_pitch;
+	}
+
+	// Column sums of 8 rows fit 16 bits, pmaddwd by one widens them for the horizontal sum.
+	const auto one = _mm_set1_epi16(1);
+
+	WindowSums sums;
+	sums.a = HorizontalSum32(_mm_madd_epi16(sum_a, one));
+	sums.b = HorizontalSum32(_mm_madd_epi16(sum_b, one));
+	sums.squares = HorizontalSum32(squares);
+	sums.product = HorizontalSum32(product);
+	return sums;
+}
+
+#endif
+
+double BlockSSIM(const uint8_t* a, ptrdiff_t a_pitch, const uint8_t* b, ptrdiff_t b_pitch, int width, int height)
+{
+	// Stabilising constants of the original definition, (0.01 * 255)^2 and (0.03 * 255)^2,
+	// scaled to sums over a window.
+	constexpr double N = SSIM_WINDOW * SSIM_WINDOW;
+	constexpr double C1 = 6.5025 * N * N;
+	constexpr double C2 = 58.5225 * N * N;
+
+#if defined(DE_ARCH_X86)
+	const auto use_sse2 = GetCPUFeatures().sse2;
+#endif
+
+	double total = 0.0;
+	int count = 0;
+
+	for (int y = 0; y + SSIM_WINDOW <= height; y += SSIM_WINDOW) {
+		for (int x = 0; x + SSIM_WINDOW <= width; x += SSIM_WINDOW) {
+			const auto p_a = a + y * a_pitch + x;
+			const auto p_b = b + y * b_pitch + x;
+
+#if defined(DE_ARCH_X86)
+			const auto sums = use_sse2 ? GetWindowSums_SSE2(p_a, a_pitch, p_b, b_pitch) : GetWindowSums_Scalar(p_a, a_pitch, p_b, b_pitch);
+#else
+			const auto sums = GetWindowSums_Scalar(p_a, a_pitch, p_b, b_pitch);
+#endif
+
+			// N^2 times the means, variances and covariance.
+			const double sum_a = sums.a, sum_b = sums.b;
+			const auto means = sum_a * sum_a + sum_b * sum_b;
+			const auto variances = N * sums.squares - means;
+			const auto covariance = N * sums.product - sum_a * sum_b;
+
+			total += (2 * sum_a * sum_b + C1) * (2 * covariance + C2) / ((means + C1) * (variances + C2));
+			++count;
+		}
+	}
+
+	return count ? total / count : 1.0;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/// Side of the windows BlockSSIM averages over
+constexpr int SSIM_WINDOW = 8;
+
+/**
+ * Mean structural similarity (SSIM) of two planes, sampled on non-overlapping
+ * SSIM_WINDOW x SSIM_WINDOW windows with uniform weights instead of a sliding Gaussian.
+ * Partial windows at the right and bottom edges are left out.
+ *
+ * @param[in] a first plane
+ * @param[in] a_pitch pitch of the first plane
+ * @param[in] b second plane
+ * @param[in] b_pitch pitch of the second plane
+ * @param[in] width plane width
+ * @param[in] height plane height
+ * @return mean SSIM, 1 for identical planes, or 1 if no window fits
+ */
+double BlockSSIM(const uint8_t* a, ptrdiff_t a_pitch, const uint8_t* b, ptrdiff_t b_pitch, int width, int height);
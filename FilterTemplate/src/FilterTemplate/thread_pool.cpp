@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include "thread_pool.hpp"
+
+ThreadPool::ThreadPool(int num_threads)
+	: stopping(false)
+{
+	if (num_threads <= 0)
+		num_threads = static_cast<int>(std::thread::hardware_concurrency());
+
+	for (int i = 1; i < num_threads; ++i)
+		workers.emplace_back(&ThreadPool::WorkerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	cv.notify_all();
+
+	for (auto& worker : workers)
+		worker.join();
+}
+
+std::future<void> ThreadPool::Submit(std::function<void()> task)
+{
+	auto packaged = std::make_shared<std::packaged_task<void()>>(std::move(task));
+	auto result = packaged->get_future();
+
+	if (workers.empty()) {
+		(*packaged)();
+		return result;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks.emplace([packaged]() { (*packaged)(); });
+	}
+	cv.notify_one();
+
+	return result;
+}
+
+void ThreadPool::ParallelFor(int count, const std::function<void(int)>& body)
+{
+	if (count <= 0)
+		return;
+
+	if (workers.empty() || count == 1) {
+		for (int i = 0; i < count; ++i)
+			body(i);
+		return;
+	}
+
+	// Shared between the caller and helper tasks. Helpers that only start after
+	// all indices were handed out find nothing to do and exit, so the caller never
+	// waits on a helper that has not started yet.
+	struct State {
+		std::atomic<int> next{ 0 };
+		std::atomic<int> done{ 0 };
+		std::mutex mutex;
+		std::condition_variable cv;
+	};
+	auto state = std::make_shared<State>();
+
+	auto run = [state, count, &body]() {
+		int i;
+		while ((i = state->next.fetch_add(1)) < count) {
+			body(i);
+
+			if (state->done.fetch_add(1) + 1 == count) {
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->cv.notify_all();
+			}
+		}
+	};
+
+	const auto num_helpers = std::min(static_cast<int>(workers.size()), count - 1);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int i = 0; i < num_helpers; ++i)
+			tasks.emplace(run);
+	}
+	cv.notify_all();
+
+	run();
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->cv.wait(lock, [&state, count]() { return state->done.load() == count; });
+}
+
+void ThreadPool::WorkerLoop()
+{
+	for (;;) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+
+			if (stopping && tasks.empty())
+				return;
+
+			task = std::move(tasks.front());
+			tasks.pop();
+		}
+		task();
+	}
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param[in] num_threads total number of threads doing work, including the thread
+	 *   calling ParallelFor; 0 means one per hardware thread
+	 */
+	explicit ThreadPool(int num_threads);
+
+	/// Destructor, waits for queued tasks to finish
+	~ThreadPool();
+
+	/// Copy constructor (deleted)
+	ThreadPool(const ThreadPool&) = delete;
+
+	/// Copy assignment (deleted)
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	/// Number of threads doing work, including the calling thread
+	int Size() const { return static_cast<int>(workers.size()) + 1; }
+
+	/// Run a task on a worker thread
+	std::future<void> Submit(std::function<void()> task);
+
+	/**
+	 * Call body(i) for every i in [0, count) and wait for all calls to finish.
+	 * The calling thread takes part in the work, so this may be called from inside a task.
+	 * Indices are handed out dynamically in increasing order, so body(i) may wait for progress
+	 * of a smaller index, which is then already running; it must not wait for a larger one.
+	 */
+	void ParallelFor(int count, const std::function<void(int)>& body);
+
+private:
+	std::vector<std::thread> workers;
+	std::queue<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool stopping;
+
+	void WorkerLoop();
+};